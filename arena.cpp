@@ -0,0 +1,91 @@
+/*
+ * arena.cpp
+ *
+ * Bump allocator. Chunks start small so that tiny trees stay tiny and double up to a
+ * cap, so that large trees need few chunks.
+ */
+
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+namespace {
+constexpr size_t kFirstChunk = 16 * 1024;
+constexpr size_t kMaxChunk = 4 * 1024 * 1024;
+}  // namespace
+
+// Implementation of Arena::~Arena
+Arena::~Arena() {
+  for (void *chunk : chunks_) {
+    free(chunk);
+  }
+}
+
+// Implementation of Arena::Arena (move)
+Arena::Arena(Arena &&other) noexcept
+    : cur_(other.cur_),
+      end_(other.end_),
+      next_chunk_(other.next_chunk_),
+      footprint_(other.footprint_),
+      chunks_(std::move(other.chunks_)) {
+  other.cur_ = other.end_ = nullptr;
+  other.next_chunk_ = other.footprint_ = 0;
+  other.chunks_.clear();
+}
+
+// Implementation of Arena::NewChunk
+void Arena::NewChunk(size_t size) {
+  if (next_chunk_ == 0) {
+    next_chunk_ = kFirstChunk;
+  }
+  size_t chunk_size = size > next_chunk_ ? size : next_chunk_;
+  if (next_chunk_ < kMaxChunk) {
+    next_chunk_ *= 2;
+  }
+  void *chunk = malloc(chunk_size);
+  if (!chunk) {
+    throw std::bad_alloc();
+  }
+  chunks_.push_back(chunk);
+  footprint_ += chunk_size;
+  cur_ = static_cast<char *>(chunk);
+  end_ = cur_ + chunk_size;
+}
+
+// Implementation of Arena::Allocate
+void *Arena::Allocate(size_t size, size_t align) {
+  uintptr_t cur = reinterpret_cast<uintptr_t>(cur_);
+  size_t pad = (align - (cur & (align - 1))) & (align - 1);
+  if (!cur_ || size + pad > size_t(end_ - cur_)) {
+    NewChunk(size);  // malloc'ed chunks are suitably aligned for anything
+    pad = 0;
+  }
+  char *result = cur_ + pad;
+  cur_ = result + size;
+  return result;
+}
+
+// Implementation of Arena::Intern
+std::string_view Arena::Intern(std::string_view str) {
+  char *copy = static_cast<char *>(Allocate(str.size() + 1, 1));
+  memcpy(copy, str.data(), str.size());
+  copy[str.size()] = '\0';
+  return std::string_view(copy, str.size());
+}
+
+// Implementation of Arena::Clear
+void Arena::Clear() {
+  if (chunks_.empty()) {
+    return;
+  }
+  for (size_t i = 0; i + 1 < chunks_.size(); ++i) {
+    free(chunks_[i]);
+  }
+  chunks_.erase(chunks_.begin(), chunks_.end() - 1);
+  cur_ = static_cast<char *>(chunks_.back());
+  footprint_ = size_t(end_ - cur_);
+}
@@ -0,0 +1,88 @@
+/*
+ * arena.h
+ *
+ * Header file for a bump allocator that holds the names, entry arrays and directory
+ * levels of a DirLevel tree.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include <new>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * Arena - Bump allocator that frees everything at once
+ *
+ * Memory is carved out of large chunks and only released when the arena is destroyed,
+ * so a tree with millions of entries costs a few dozen frees to tear down. Objects
+ * created in an arena never have their destructors run. Not thread-safe; concurrent
+ * writers each use their own arena.
+ */
+class Arena {
+ public:
+  Arena() = default;
+  ~Arena();
+
+  Arena(Arena &&other) noexcept;
+  Arena &operator=(Arena &&other) = delete;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /**
+   * Allocate - Get uninitialized memory
+   *
+   * @param size: Number of bytes
+   * @param align: Required alignment (a power of two, at most alignof(max_align_t))
+   * @return: Pointer to the memory, valid for the lifetime of the arena
+   */
+  void *Allocate(size_t size, size_t align);
+
+  // Uninitialized array of count objects of type T
+  template <class T>
+  T *AllocateArray(size_t count) {
+    return count ? static_cast<T *>(Allocate(count * sizeof(T), alignof(T))) : nullptr;
+  }
+
+  // Construct a T in the arena (its destructor will never run)
+  template <class T, class... Args>
+  T *New(Args &&...args) {
+    return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  /**
+   * Intern - Copy a string into the arena
+   *
+   * @param str: String to copy
+   * @return: View of the copy, which is followed by a NUL so data() can be passed to
+   *          system calls
+   */
+  std::string_view Intern(std::string_view str);
+
+  /**
+   * Clear - Discard everything allocated so far
+   *
+   * Keeps the current (largest) chunk for reuse and frees the others, so an arena that
+   * is cleared and refilled repeatedly settles at a single chunk.
+   */
+  void Clear();
+
+  // Total bytes obtained from malloc so far
+  size_t Footprint() const { return footprint_; }
+
+ private:
+  // Start a new chunk large enough for size bytes
+  void NewChunk(size_t size);
+
+  char *cur_ = nullptr;       // Next free byte in the current chunk
+  char *end_ = nullptr;       // End of the current chunk
+  size_t next_chunk_ = 0;     // Size of the next chunk (grows geometrically)
+  size_t footprint_ = 0;      // Sum of sizes of the chunks still held
+  std::vector<void *> chunks_;  // Every chunk, for freeing
+};
+
+#endif  // ARENA_H
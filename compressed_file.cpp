@@ -0,0 +1,496 @@
+/*
+ * compressed_file.cpp
+ *
+ * Framed gzip files: each frame is deflated and inflated on its own, on worker
+ * threads, with zlib.
+ */
+
+#include "compressed_file.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "mapped_file.h"
+#include "work_pool.h"
+
+namespace {
+// Bytes of a member's header (with its extra field) and of its trailer
+constexpr size_t kHeaderSize = 24;
+constexpr size_t kTrailerSize = 8;
+
+// Blocks (when writing) or frames (when reading) each thread may be ahead by
+constexpr uint64_t kAheadPerThread = 2;
+
+// Store a 16- or 32-bit value little-endian
+void Put16(unsigned char *p, unsigned value) {
+  p[0] = (unsigned char)(value & 0xff);
+  p[1] = (unsigned char)(value >> 8 & 0xff);
+}
+void Put32(unsigned char *p, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = (unsigned char)(value >> (8 * i) & 0xff);
+  }
+}
+
+// Load a 32-bit little-endian value
+uint32_t Get32(const unsigned char *p) {
+  return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 |
+         uint32_t(p[3]) << 24;
+}
+
+/*
+ * Deflate - Compress one block into a gzip member with the frame's extra field
+ *
+ * @param stream: Raw deflate stream of the calling thread, reset before use
+ * @param data: The block (at most kMaxFrame bytes)
+ * @return: The member
+ */
+std::string Deflate(z_stream *stream, const std::string &data) {
+  if (deflateReset(stream) != Z_OK) {
+    throw std::runtime_error("Cannot reset the compressor");
+  }
+  uLong bound = deflateBound(stream, uLong(data.size()));
+  std::string frame(kHeaderSize + bound + kTrailerSize, '\0');
+  auto *out = reinterpret_cast<unsigned char *>(frame.data());
+  stream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  stream->avail_in = uInt(data.size());
+  stream->next_out = out + kHeaderSize;
+  stream->avail_out = uInt(bound);
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+    throw std::runtime_error("Cannot compress a frame");
+  }
+  size_t stored = kHeaderSize + (bound - stream->avail_out) + kTrailerSize;
+  frame.resize(stored);
+  out = reinterpret_cast<unsigned char *>(frame.data());
+
+  // ID1 ID2 CM FLG(FEXTRA) MTIME(0) XFL OS(Unix), then the extra field
+  const unsigned char start[] = {kGzipMagic[0], kGzipMagic[1], 8, 4, 0, 0, 0, 0, 0, 3};
+  std::copy(start, start + sizeof(start), out);
+  Put16(out + 10, 12);
+  out[12] = 'F';
+  out[13] = 'L';
+  Put16(out + 14, 8);
+  Put32(out + 16, uint32_t(stored));
+  Put32(out + 20, uint32_t(data.size()));
+  uLong crc = crc32(0, reinterpret_cast<const Bytef *>(data.data()), uInt(data.size()));
+  Put32(out + stored - kTrailerSize, uint32_t(crc));
+  Put32(out + stored - 4, uint32_t(data.size()));
+  return frame;
+}
+
+// Write all of data to fd, retrying after signals. Returns false with errno set on
+// failure.
+bool WriteAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t len = write(fd, data, size);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += len;
+    size -= size_t(len);
+  }
+  return true;
+}
+}  // namespace
+
+// Implementation of FrameWriter::FrameWriter
+FrameWriter::FrameWriter(int fd, unsigned threads, int level) : fd_(fd), level_(level) {
+  for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+    workers_.emplace_back(&FrameWriter::WorkerLoop, this);
+  }
+  writer_ = std::thread(&FrameWriter::WriterLoop, this);
+}
+
+// Implementation of FrameWriter::~FrameWriter
+FrameWriter::~FrameWriter() {
+  try {
+    Finish();
+  } catch (const std::exception &) {
+    // Finish() reports errors; this is only the last of the output after a failure
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  done_cv_.notify_all();
+  for (auto &thread : workers_) {
+    thread.join();
+  }
+  writer_.join();
+}
+
+// Implementation of FrameWriter::Write
+void FrameWriter::Write(std::string &&data) {
+  // A block too large for one frame is split
+  for (size_t pos = 0; pos < data.size(); pos += kMaxFrame) {
+    std::string block = pos == 0 && data.size() <= kMaxFrame
+                            ? std::move(data)
+                            : data.substr(pos, kMaxFrame);
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_cv_.wait(lock, [this] {
+      return first_error_ ||
+             next_block_ - next_write_ < kAheadPerThread * workers_.size() + 1;
+    });
+    if (first_error_) {
+      std::rethrow_exception(first_error_);
+    }
+    queued_.emplace(next_block_++, std::move(block));
+    lock.unlock();
+    work_cv_.notify_one();
+    if (data.empty()) {
+      break;  // Moved from whole
+    }
+  }
+}
+
+// Implementation of FrameWriter::Finish
+uint64_t FrameWriter::Finish() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  space_cv_.wait(lock, [this] { return next_write_ == next_block_; });
+  if (first_error_) {
+    std::rethrow_exception(first_error_);
+  }
+  return written_;
+}
+
+// Implementation of FrameWriter::WorkerLoop
+void FrameWriter::WorkerLoop() {
+  z_stream stream = {};
+  bool ready = deflateInit2(&stream, level_, Z_DEFLATED, -MAX_WBITS, 8,
+                            Z_DEFAULT_STRATEGY) == Z_OK;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+    if (queued_.empty()) {
+      break;  // Stopped
+    }
+    auto block = queued_.begin();
+    uint64_t number = block->first;
+    std::string data = std::move(block->second);
+    queued_.erase(block);
+    lock.unlock();
+
+    // A frame that fails is left empty for the writer to skip
+    std::string frame;
+    std::exception_ptr error;
+    try {
+      if (!ready) {
+        throw std::runtime_error("Cannot start the compressor");
+      }
+      frame = Deflate(&stream, data);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    if (error && !first_error_) {
+      first_error_ = error;
+    }
+    compressed_.emplace(number, std::move(frame));
+    done_cv_.notify_all();
+  }
+  if (ready) {
+    deflateEnd(&stream);
+  }
+}
+
+// Implementation of FrameWriter::WriterLoop
+void FrameWriter::WriterLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    done_cv_.wait(lock, [this] { return stop_ || compressed_.count(next_write_); });
+    auto frame = compressed_.find(next_write_);
+    if (frame == compressed_.end()) {
+      return;  // Stopped
+    }
+    std::string data = std::move(frame->second);
+    compressed_.erase(frame);
+    bool failed = first_error_ != nullptr;
+    lock.unlock();
+
+    // Nothing more is written after a failure, so the file ends with a whole frame
+    int saved_errno = 0;
+    if (!failed && !WriteAll(fd_, data.data(), data.size())) {
+      saved_errno = errno;
+    }
+
+    lock.lock();
+    if (saved_errno && !first_error_) {
+      first_error_ = std::make_exception_ptr(std::runtime_error(
+          std::string("Error writing compressed snapshot: ") + strerror(saved_errno)));
+    }
+    if (!failed && !saved_errno) {
+      written_ += data.size();
+    }
+    ++next_write_;
+    space_cv_.notify_all();
+  }
+}
+
+// Implementation of FrameReader::FrameReader
+FrameReader::FrameReader(int fd, std::string name, unsigned threads)
+    : fd_(fd), name_(std::move(name)), threads_(std::max(threads, 1u)) {
+  for (unsigned i = 0; i < threads_; ++i) {
+    workers_.emplace_back(&FrameReader::WorkerLoop, this);
+  }
+}
+
+// Implementation of FrameReader::~FrameReader
+FrameReader::~FrameReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &thread : workers_) {
+    thread.join();
+  }
+  close(fd_);
+}
+
+// Implementation of FrameReader::IsFramed
+bool FrameReader::IsFramed(int fd) {
+  unsigned char magic[2];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+         magic[0] == kGzipMagic[0] && magic[1] == kGzipMagic[1];
+}
+
+// Implementation of FrameReader::Corrupt
+void FrameReader::Corrupt(uint64_t offset) const {
+  throw std::runtime_error("Corrupt compressed snapshot '" + name_ + "' at offset " +
+                           std::to_string(offset));
+}
+
+// Implementation of FrameReader::ReadHeader
+bool FrameReader::ReadHeader(uint64_t offset, Frame *frame) const {
+  unsigned char header[kHeaderSize];
+  ssize_t len = pread(fd_, header, sizeof(header), off_t(offset));
+  if (len < 0) {
+    throw std::runtime_error("Error reading '" + name_ + "': " + strerror(errno));
+  }
+  if (len == 0) {
+    return false;
+  }
+  if (size_t(len) < sizeof(header) || header[0] != kGzipMagic[0] ||
+      header[1] != kGzipMagic[1] || header[2] != 8 || header[3] != 4 ||
+      header[10] != 12 || header[11] != 0 || header[12] != 'F' || header[13] != 'L' ||
+      header[14] != 8 || header[15] != 0) {
+    if (offset == 0) {
+      throw std::runtime_error("'" + name_ + "' is compressed, but not in frames");
+    }
+    Corrupt(offset);
+  }
+  frame->offset = offset;
+  frame->stored = Get32(header + 16);
+  frame->size = Get32(header + 20);
+  if (frame->stored < kHeaderSize + kTrailerSize || frame->size > kMaxFrame) {
+    Corrupt(offset);
+  }
+  return true;
+}
+
+// Implementation of FrameReader::Inflate
+void FrameReader::Inflate(const Frame &frame, char *out) const {
+  std::string member(frame.stored, '\0');
+  for (size_t done = 0; done < member.size();) {
+    ssize_t len = pread(fd_, member.data() + done, member.size() - done,
+                        off_t(frame.offset + done));
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0) {
+      throw std::runtime_error("Error reading '" + name_ + "': " + strerror(errno));
+    }
+    if (len == 0) {
+      Corrupt(frame.offset);  // Truncated
+    }
+    done += size_t(len);
+  }
+
+  z_stream stream = {};
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    throw std::runtime_error("Cannot start the decompressor");
+  }
+  auto *in = reinterpret_cast<unsigned char *>(member.data());
+  size_t deflated = member.size() - kHeaderSize - kTrailerSize;
+  stream.next_in = in + kHeaderSize;
+  stream.avail_in = uInt(deflated);
+  stream.next_out = reinterpret_cast<Bytef *>(out);
+  stream.avail_out = frame.size;
+  int result = inflate(&stream, Z_FINISH);
+  bool whole = result == Z_STREAM_END && stream.avail_out == 0 && stream.avail_in == 0;
+  inflateEnd(&stream);
+  const unsigned char *trailer = in + member.size() - kTrailerSize;
+  if (!whole ||
+      Get32(trailer) != uint32_t(crc32(0, reinterpret_cast<const Bytef *>(out),
+                                       frame.size)) ||
+      Get32(trailer + 4) != frame.size) {
+    Corrupt(frame.offset);
+  }
+}
+
+// Implementation of FrameReader::LoadTable
+void FrameReader::LoadTable() {
+  if (!starts_.empty()) {
+    return;
+  }
+  uint64_t offset = 0, total = 0;
+  Frame frame;
+  while (ReadHeader(offset, &frame)) {
+    frames_.push_back(frame);
+    starts_.push_back(total);
+    total += frame.size;
+    offset += frame.stored;
+  }
+  starts_.push_back(total);
+}
+
+// Implementation of FrameReader::WorkerLoop
+void FrameReader::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock, [this] {
+      return stop_ || (active_ && !first_error_ && next_frame_ < end_frame_ &&
+                       next_frame_ < read_frame_ + kAheadPerThread * threads_);
+    });
+    if (stop_) {
+      return;
+    }
+
+    // Take the next frame, finding it from its header
+    uint64_t number = next_frame_, generation = generation_;
+    Frame frame;
+    try {
+      if (!ReadHeader(next_offset_, &frame)) {
+        end_frame_ = number;
+        done_cv_.notify_all();
+        continue;
+      }
+    } catch (...) {
+      first_error_ = std::current_exception();
+      done_cv_.notify_all();
+      continue;
+    }
+    next_offset_ += frame.stored;
+    ++next_frame_;
+    lock.unlock();
+
+    std::string data(frame.size, '\0');
+    std::exception_ptr error;
+    try {
+      Inflate(frame, data.data());
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    if (generation != generation_) {
+      continue;  // Read before a Seek()
+    }
+    if (error) {
+      if (!first_error_) {
+        first_error_ = error;
+      }
+    } else {
+      done_.emplace(number, std::move(data));
+    }
+    done_cv_.notify_all();
+  }
+}
+
+// Implementation of FrameReader::Read
+size_t FrameReader::Read(char *data, size_t size) {
+  while (current_pos_ == current_.size()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!active_) {
+      active_ = true;
+      work_cv_.notify_all();
+    }
+    done_cv_.wait(lock, [this] {
+      return first_error_ || done_.count(read_frame_) || read_frame_ >= end_frame_;
+    });
+    auto frame = done_.find(read_frame_);
+    if (frame == done_.end()) {
+      if (first_error_) {
+        std::rethrow_exception(first_error_);
+      }
+      return 0;  // The end
+    }
+    current_ = std::move(frame->second);
+    done_.erase(frame);
+    ++read_frame_;
+    current_pos_ = std::min(skip_, current_.size());
+    skip_ = 0;
+    lock.unlock();
+    work_cv_.notify_all();  // Room to read further ahead
+  }
+  size_t len = std::min(size, current_.size() - current_pos_);
+  memcpy(data, current_.data() + current_pos_, len);
+  current_pos_ += len;
+  return len;
+}
+
+// Implementation of FrameReader::Seek
+void FrameReader::Seek(uint64_t offset) {
+  LoadTable();
+  if (offset > starts_.back()) {
+    throw std::runtime_error("Offset " + std::to_string(offset) +
+                             " is past the end of '" + name_ + "'");
+  }
+  // The frame holding offset (none if it is the end)
+  size_t index = size_t(std::upper_bound(starts_.begin(), starts_.end(), offset) -
+                        starts_.begin()) -
+                 1;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++generation_;
+    done_.clear();
+    first_error_ = nullptr;
+    next_frame_ = read_frame_ = 0;
+    end_frame_ = UINT64_MAX;
+    if (index < frames_.size()) {
+      next_offset_ = frames_[index].offset;
+      skip_ = size_t(offset - starts_[index]);
+    } else {
+      next_offset_ = frames_.empty() ? 0 : frames_.back().offset + frames_.back().stored;
+      skip_ = 0;
+    }
+    active_ = true;
+  }
+  current_.clear();
+  current_pos_ = 0;
+  work_cv_.notify_all();
+}
+
+// Implementation of FrameReader::Size
+uint64_t FrameReader::Size() {
+  LoadTable();
+  return starts_.back();
+}
+
+// Implementation of FrameReader::ReadAll
+std::shared_ptr<MappedFile> FrameReader::ReadAll() {
+  LoadTable();
+  if (starts_.back() == 0) {
+    return nullptr;
+  }
+  char *out;
+  auto mapping = MappedFile::Allocate(size_t(starts_.back()), &out);
+  WorkPool pool(threads_);
+  for (size_t i = 0; i < frames_.size(); ++i) {
+    pool.Submit([this, i, out] { Inflate(frames_[i], out + starts_[i]); });
+  }
+  pool.Run();
+  return mapping;
+}
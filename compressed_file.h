@@ -0,0 +1,226 @@
+/*
+ * compressed_file.h
+ *
+ * Header file for writing and reading files compressed in independent frames, with
+ * the compression done on threads of their own while the data is produced or used.
+ *
+ * Format: a sequence of gzip members (RFC 1952), so that gzip -d reads the file as one
+ * stream. Each member (a frame) holds at most kMaxFrame bytes of the data, deflated on
+ * its own, and has exactly one extra field in its header (FLG.FEXTRA):
+ *   XLEN 12, then subfield 'F' 'L' of length 8:
+ *     4 bytes  size of the whole member in bytes, little-endian
+ *     4 bytes  size of the data it holds, little-endian
+ * With the sizes in the headers, a reader finds every frame by reading the headers
+ * alone, so it can start at any frame and decompress several at once.
+ */
+
+#ifndef COMPRESSED_FILE_H
+#define COMPRESSED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MappedFile;
+
+// First bytes of a gzip member
+inline constexpr unsigned char kGzipMagic[2] = {0x1f, 0x8b};
+
+// Most data in one frame
+inline constexpr size_t kMaxFrame = 4 << 20;
+
+/**
+ * FrameWriter - Compresses data into frames on a pool of threads
+ *
+ * Each block handed to Write() becomes a frame (or several, if it is larger than
+ * kMaxFrame). Workers deflate the blocks in parallel and a writer thread writes the
+ * frames out in order, so the caller only waits when more than a few blocks per worker
+ * are queued.
+ */
+class FrameWriter {
+ public:
+  /**
+   * Constructor - Start the workers
+   *
+   * @param fd: Descriptor to write to (not taken over; a pipe will do)
+   * @param threads: Number of compressing threads (at least 1 is started)
+   * @param level: zlib compression level (1 = fastest .. 9 = smallest)
+   */
+  FrameWriter(int fd, unsigned threads, int level);
+
+  // Writes out what was queued, ignoring errors, then stops the threads
+  ~FrameWriter();
+
+  FrameWriter(const FrameWriter &) = delete;
+  FrameWriter &operator=(const FrameWriter &) = delete;
+
+  /**
+   * Write - Queue a block of data
+   *
+   * @param data: The block (moved from)
+   *
+   * Blocks while too many are queued. Throws std::runtime_error if an earlier frame
+   * couldn't be compressed or written.
+   */
+  void Write(std::string &&data);
+
+  /**
+   * Finish - Wait until every block queued has been written
+   *
+   * @return: Bytes written so far
+   *
+   * Throws std::runtime_error if anything couldn't be compressed or written.
+   */
+  uint64_t Finish();
+
+ private:
+  // Main loops of the compressing threads and of the writer thread
+  void WorkerLoop();
+  void WriterLoop();
+
+  int fd_;
+  int level_;
+  std::vector<std::thread> workers_;
+  std::thread writer_;
+
+  std::mutex mutex_;                   // Guards everything below
+  std::condition_variable work_cv_;    // Signalled when a block is queued or on stop
+  std::condition_variable done_cv_;    // Signalled when a frame is compressed or on stop
+  std::condition_variable space_cv_;   // Signalled when a frame has been written
+  std::map<uint64_t, std::string> queued_;      // Blocks to compress, by number
+  std::map<uint64_t, std::string> compressed_;  // Frames to write, by number
+  uint64_t next_block_ = 0;            // Number of the next block queued
+  uint64_t next_write_ = 0;            // Number of the next frame to write
+  uint64_t written_ = 0;               // Bytes written
+  bool stop_ = false;                  // Set by the destructor
+  std::exception_ptr first_error_;
+};
+
+/**
+ * FrameReader - Decompresses a framed file on a pool of threads
+ *
+ * Read() hands out the data in order while the workers decompress the frames after the
+ * one being read, a few per worker ahead. Seek() finds a frame from the table of
+ * frames, which is built from their headers the first time it is needed. The file must
+ * be a regular file.
+ */
+class FrameReader {
+ public:
+  /**
+   * Constructor - Start reading a framed file
+   *
+   * @param fd: Descriptor of the file (taken over)
+   * @param name: Name of the file, for error messages
+   * @param threads: Number of decompressing threads (at least 1 is started)
+   *
+   * Nothing is read until the first Read() or Seek().
+   */
+  FrameReader(int fd, std::string name, unsigned threads);
+
+  // Stops the threads and closes the file
+  ~FrameReader();
+
+  FrameReader(const FrameReader &) = delete;
+  FrameReader &operator=(const FrameReader &) = delete;
+
+  /**
+   * IsFramed - Whether an open file is in the framed format
+   *
+   * @param fd: Descriptor of the file
+   * @return: true if it starts with a gzip member (it can't be a snapshot otherwise)
+   */
+  static bool IsFramed(int fd);
+
+  /**
+   * Read - Read the next bytes of the data
+   *
+   * @param data: Where to put them
+   * @param size: Most bytes to read
+   * @return: Bytes read, 0 only at the end of the data
+   *
+   * Throws std::runtime_error if the file can't be read or is corrupt.
+   */
+  size_t Read(char *data, size_t size);
+
+  /**
+   * Seek - Continue reading at another offset in the data
+   *
+   * @param offset: Offset in the decompressed data
+   *
+   * Throws std::runtime_error if it is past the end.
+   */
+  void Seek(uint64_t offset);
+
+  /**
+   * Size - Size of the decompressed data
+   *
+   * @return: Sum of the frames' sizes
+   */
+  uint64_t Size();
+
+  /**
+   * ReadAll - Decompress the whole file into memory
+   *
+   * @return: Anonymous mapping holding the data (nullptr if there is none), which can
+   *          stand in for a mapping of the uncompressed file
+   *
+   * Every worker decompresses frames straight into their place in the mapping.
+   */
+  std::shared_ptr<MappedFile> ReadAll();
+
+ private:
+  // A frame in the file
+  struct Frame {
+    uint64_t offset;  // Of its member in the file
+    uint32_t stored;  // Size of the member
+    uint32_t size;    // Size of the data it holds
+  };
+
+  // Read the header of the member at offset. Returns false at the end of the file.
+  bool ReadHeader(uint64_t offset, Frame *frame) const;
+
+  // Decompress a frame into out (frame.size bytes)
+  void Inflate(const Frame &frame, char *out) const;
+
+  // Build frames_ and starts_ if they haven't been yet
+  void LoadTable();
+
+  // Main loop of the decompressing threads
+  void WorkerLoop();
+
+  // Throw an error about a malformed frame
+  [[noreturn]] void Corrupt(uint64_t offset) const;
+
+  int fd_;
+  std::string name_;
+  unsigned threads_;
+  std::vector<Frame> frames_;    // The table of frames, once loaded
+  std::vector<uint64_t> starts_;  // Offset in the data of each frame, then the size
+  std::string current_;           // Data of the frame being read
+  size_t current_pos_ = 0;        // Next byte of it to hand out
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;                  // Guards everything below
+  std::condition_variable work_cv_;   // Signalled when there is room to read ahead
+  std::condition_variable done_cv_;   // Signalled when a frame is decompressed
+  std::map<uint64_t, std::string> done_;  // Decompressed frames, by number
+  bool active_ = false;       // Read() or Seek() has been called
+  bool stop_ = false;         // Set by the destructor
+  uint64_t generation_ = 0;   // Counts Seek() calls, to discard frames read before
+  uint64_t next_offset_ = 0;  // Offset in the file of the next frame to take
+  uint64_t next_frame_ = 0;   // Number of the next frame to take
+  uint64_t read_frame_ = 0;   // Number of the next frame Read() needs
+  uint64_t end_frame_ = UINT64_MAX;  // Number of frames, once the end has been seen
+  size_t skip_ = 0;           // Bytes of the next frame to skip (after Seek())
+  std::exception_ptr first_error_;
+};
+
+#endif  // COMPRESSED_FILE_H
@@ -0,0 +1,192 @@
+/*
+ * content_hasher.cpp
+ *
+ * Worker pool hashing regular files with chained MurmurHash64A over large blocks,
+ * reading each file front to back with sequential-access hints.
+ */
+
+#include "content_hasher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "digest.h"
+#include "dir_level.h"
+
+namespace {
+// Size of the blocks files are read and hashed in
+constexpr size_t kHashBlock = 1 << 20;
+
+// Most files waiting in the queue before Submit() blocks
+constexpr size_t kMaxQueued = 1 << 16;
+
+// Seed of the first block's hash
+constexpr uint64_t kContentSeed = 0x6c69737465722d68;  // "lister-h"
+}  // namespace
+
+// Implementation of ContentHasher::ContentHasher
+ContentHasher::ContentHasher(std::string root, unsigned threads,
+                             uint64_t bytes_per_second)
+    : root_(std::move(root)), rate_(bytes_per_second) {
+  if (!root_.empty() && root_.back() != '/') {
+    root_ += '/';
+  }
+  next_read_ = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+    threads_.emplace_back(&ContentHasher::WorkerLoop, this);
+  }
+}
+
+// Implementation of ContentHasher::~ContentHasher
+ContentHasher::~ContentHasher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+// Implementation of ContentHasher::Submit
+void ContentHasher::Submit(std::string path, EntryInfo *info) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  space_cv_.wait(lock, [this] { return queue_.size() < kMaxQueued; });
+  queue_.emplace_back(std::move(path), info);
+  ++pending_;
+  lock.unlock();
+  work_cv_.notify_one();
+}
+
+// Implementation of ContentHasher::Wait
+void ContentHasher::Wait() {
+  std::exception_ptr error;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this] { return pending_ == 0; });
+    std::swap(error, first_error_);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// Implementation of ContentHasher::WorkerLoop
+void ContentHasher::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (stop_) {
+      return;
+    }
+    auto [path, info] = std::move(queue_.front());
+    queue_.pop_front();
+    space_cv_.notify_one();
+    lock.unlock();
+
+    // A file removed since it was listed keeps no hash
+    try {
+      uint64_t hash;
+      if (HashFile(root_ + path, this, &hash)) {
+        info->hash = hash;
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> error_lock(mutex_);
+      if (!first_error_) {
+        first_error_ = std::current_exception();
+        // Nothing else will be looked at, so drop what is still queued
+        pending_ -= queue_.size();
+        queue_.clear();
+        space_cv_.notify_all();
+      }
+    }
+
+    lock.lock();
+    if (--pending_ == 0) {
+      idle_cv_.notify_all();
+    }
+  }
+}
+
+// Implementation of ContentHasher::Throttle
+void ContentHasher::Throttle(size_t bytes) {
+  if (rate_ == 0) {
+    return;
+  }
+  // Each read books the time it is worth at the rate; a read has to wait for the
+  // bookings ahead of it
+  auto cost = std::chrono::nanoseconds(int64_t(double(bytes) * 1e9 / double(rate_)));
+  std::chrono::steady_clock::time_point start;
+  {
+    std::lock_guard<std::mutex> lock(throttle_mutex_);
+    start = std::max(next_read_, std::chrono::steady_clock::now());
+    next_read_ = start + cost;
+  }
+  std::this_thread::sleep_until(start);
+}
+
+// Implementation of ContentHasher::HashFile
+bool ContentHasher::HashFile(const std::string &path, ContentHasher *throttle,
+                             uint64_t *hash) {
+  // O_NOATIME keeps hashing from updating access times, where we are allowed to
+  int flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+  int fd = open(path.c_str(), flags | O_NOATIME);
+  if (fd < 0 && errno == EPERM) {
+    fd = open(path.c_str(), flags);
+  }
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    throw std::runtime_error("Cannot open " + path + " to hash it: " + strerror(errno));
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Every block but the last is full, so the hash doesn't depend on how reads split up
+  thread_local std::unique_ptr<char[]> block(new char[kHashBlock]);
+  uint64_t h = kContentSeed;
+  uint64_t total = 0;
+  for (bool eof = false; !eof;) {
+    size_t filled = 0;
+    while (filled < kHashBlock) {
+      ssize_t len = read(fd, block.get() + filled, kHashBlock - filled);
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        int saved_errno = errno;
+        close(fd);
+        throw std::runtime_error("Error reading " + path + " to hash it: " +
+                                 strerror(saved_errno));
+      }
+      if (len == 0) {
+        eof = true;
+        break;
+      }
+      filled += size_t(len);
+    }
+    if (filled == 0) {
+      break;
+    }
+    if (throttle) {
+      throttle->Throttle(filled);  // Holds back the next read
+    }
+    // Each block's hash seeds the next one's
+    h = HashBytes(block.get(), filled, h);
+    // The pages won't be needed again, so don't let hashing a big tree push everything
+    // else out of the page cache
+    posix_fadvise(fd, off_t(total), off_t(filled), POSIX_FADV_DONTNEED);
+    total += filled;
+  }
+  close(fd);
+  h = HashBytes(&total, sizeof(total), h);
+  *hash = h ? h : 1;
+  return true;
+}
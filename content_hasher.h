@@ -0,0 +1,109 @@
+/*
+ * content_hasher.h
+ *
+ * Header file for hashing the contents of regular files on a pool of threads while a
+ * directory scan goes on.
+ */
+
+#ifndef CONTENT_HASHER_H
+#define CONTENT_HASHER_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct EntryInfo;
+
+/**
+ * ContentHasher - Pool of threads that hash regular files handed over by a scan
+ *
+ * The scan submits each regular file as soon as its entry is stored, and a worker reads
+ * the file sequentially in large blocks and fills in the entry's hash, so reading
+ * contents overlaps with reading metadata. Jobs wait in a bounded queue: a scan that
+ * gets ahead of the disks is held back rather than queueing its whole tree. Reads can
+ * be limited to a rate shared by all workers.
+ */
+class ContentHasher {
+ public:
+  /**
+   * Constructor - Start the workers
+   *
+   * @param root: Path the submitted paths are relative to
+   * @param threads: Number of worker threads (at least 1 is started)
+   * @param bytes_per_second: Most bytes to read per second, over all workers (0 = no
+   *                          limit)
+   */
+  ContentHasher(std::string root, unsigned threads, uint64_t bytes_per_second);
+
+  // Stops the workers, dropping any files not hashed yet
+  ~ContentHasher();
+
+  ContentHasher(const ContentHasher &) = delete;
+  ContentHasher &operator=(const ContentHasher &) = delete;
+
+  /**
+   * Submit - Queue a file to be hashed
+   *
+   * @param path: Path of the file relative to the root
+   * @param info: Its entry, whose hash is set once it has been read. Must stay valid
+   *              (and not be moved) until Wait() returns.
+   *
+   * Blocks while the queue is full. May be called from any thread.
+   */
+  void Submit(std::string path, EntryInfo *info);
+
+  /**
+   * Wait - Wait until every file submitted so far has been hashed
+   *
+   * Rethrows the first failure (as std::runtime_error) once the workers are idle;
+   * after that the remaining jobs have been dropped and the hasher can be reused.
+   */
+  void Wait();
+
+  /**
+   * HashFile - Hash a file's contents on the calling thread
+   *
+   * @param path: Path of the file
+   * @param throttle: Hasher whose rate limit to honour, or nullptr
+   * @param hash: Set to the hash (never 0)
+   * @return: false if the file no longer exists
+   *
+   * Reads the file in large blocks, telling the kernel it is read sequentially and
+   * dropping the pages behind the read from the page cache. Throws std::runtime_error
+   * if it can't be read.
+   */
+  static bool HashFile(const std::string &path, ContentHasher *throttle, uint64_t *hash);
+
+ private:
+  // Main loop of the worker threads
+  void WorkerLoop();
+
+  // Wait until reading bytes more keeps to the rate limit
+  void Throttle(size_t bytes);
+
+  std::string root_;   // With trailing '/'
+  uint64_t rate_;      // Bytes per second (0 = no limit)
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;                     // Guards everything below
+  std::condition_variable work_cv_;      // Signalled when a job is queued or on stop
+  std::condition_variable space_cv_;     // Signalled when a job is taken from the queue
+  std::condition_variable idle_cv_;      // Signalled when the last job finishes
+  std::deque<std::pair<std::string, EntryInfo *>> queue_;
+  size_t pending_ = 0;                   // Jobs queued or being hashed
+  bool stop_ = false;                    // Set by the destructor
+  std::exception_ptr first_error_;       // First failure since the last Wait()
+
+  std::mutex throttle_mutex_;
+  std::chrono::steady_clock::time_point next_read_;  // When the rate allows more reads
+};
+
+#endif  // CONTENT_HASHER_H
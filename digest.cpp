@@ -0,0 +1,78 @@
+/*
+ * digest.cpp
+ *
+ * Directory digests: MurmurHash64A for names, folded together with each entry's
+ * metadata.
+ */
+
+#include "digest.h"
+
+#include <string.h>
+
+#include "dir_level.h"
+
+// Implementation of HashBytes
+uint64_t HashBytes(const void *data, size_t len, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  const unsigned char *end = p + (len & ~size_t(7));
+  for (; p != end; p += 8) {
+    uint64_t k;
+    memcpy(&k, p, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (len & 7) {
+    case 7:
+      h ^= uint64_t(p[6]) << 48;
+      [[fallthrough]];
+    case 6:
+      h ^= uint64_t(p[5]) << 40;
+      [[fallthrough]];
+    case 5:
+      h ^= uint64_t(p[4]) << 32;
+      [[fallthrough]];
+    case 4:
+      h ^= uint64_t(p[3]) << 24;
+      [[fallthrough]];
+    case 3:
+      h ^= uint64_t(p[2]) << 16;
+      [[fallthrough]];
+    case 2:
+      h ^= uint64_t(p[1]) << 8;
+      [[fallthrough]];
+    case 1:
+      h ^= uint64_t(p[0]);
+      h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// Implementation of DirDigest::Add
+void DirDigest::Add(const EntryInfo &info) {
+  uint64_t h = HashName(info.name, info.type);
+  h = Mix(h ^ info.size);
+  h = Mix(h ^ uint64_t(info.mtime.tv_sec));
+  h = Mix(h ^ uint64_t(info.mtime.tv_nsec));
+  if (info.hash) {
+    h = Mix(h ^ info.hash);  // Entries without one keep the digests they always had
+  }
+  AddHash(h);
+}
+
+// Implementation of DirDigest::Value
+uint64_t DirDigest::Value() const {
+  uint64_t value = Mix(state_ ^ count_);
+  return value ? value : 1;
+}
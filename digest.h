@@ -0,0 +1,79 @@
+/*
+ * digest.h
+ *
+ * Header file for the 64-bit digests that summarise a directory's contents, so that
+ * identical subtrees can be recognised without visiting them.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+struct EntryInfo;
+
+/**
+ * HashBytes - 64-bit hash of a byte string (MurmurHash64A)
+ *
+ * @param data: Bytes to hash
+ * @param len: Number of bytes
+ * @param seed: Value to start from
+ * @return: The hash
+ */
+uint64_t HashBytes(const void *data, size_t len, uint64_t seed);
+
+/**
+ * DirDigest - Rolls the digest of a directory up from its entries, in name order
+ *
+ * An entry counts with its name and type, and with its size and mtime unless it is a
+ * directory, for which the digest of its own contents counts instead. So two
+ * directories get the same digest exactly when DirLevel::RemoveCommon() would find
+ * nothing different anywhere below them (barring a 64-bit collision). A digest is never
+ * 0, which is left to mean "not known".
+ */
+class DirDigest {
+ public:
+  // Add a non-directory entry (with its content hash, if it has one)
+  void Add(const EntryInfo &info);
+
+  // Add a directory entry whose contents have the given digest
+  void AddDir(std::string_view name, int type, uint64_t digest) {
+    AddDir(HashName(name, type), digest);
+  }
+
+  // The same, with the name and type already hashed by HashName()
+  void AddDir(uint64_t name_hash, uint64_t digest) { AddHash(Mix(name_hash ^ digest)); }
+
+  // The digest of the entries added so far
+  uint64_t Value() const;
+
+  // Hash of an entry's name and type, its part of the entry's hash
+  static uint64_t HashName(std::string_view name, int type) {
+    return HashBytes(name.data(), name.size(), uint64_t(type));
+  }
+
+ private:
+  // Final mixing step of MurmurHash3
+  static uint64_t Mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Fold one entry's hash into the state; the order of entries matters
+  void AddHash(uint64_t hash) {
+    state_ = Mix(state_ * 0x9e3779b97f4a7c15ULL + hash);
+    ++count_;
+  }
+
+  uint64_t state_ = 0;
+  uint64_t count_ = 0;
+};
+
+#endif  // DIGEST_H
@@ -13,14 +13,211 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <stdexcept>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-// Implementation of DirLevel::CreateFromPath
-DirLevel DirLevel::CreateFromPath(const char *start_path) {
+#include "arena.h"
+#include "content_hasher.h"
+#include "digest.h"
+#include "mapped_file.h"
+#include "metadata_ring.h"
+#include "scan_governor.h"
+#include "scan_stats.h"
+#include "snapshot_writer.h"
+#include "traverse_reader.h"
+#include "work_pool.h"
+
+namespace {
+// What an entry left on one side of a comparison can be matched by (see RemoveMoved)
+struct MoveKey {
+  enum Kind : uint64_t { kInode, kContent, kDigest } kind;
+  uint64_t first, second;  // Inode and type, hash and size, or digest and 0
+
+  bool operator==(const MoveKey &) const = default;
+};
+
+struct MoveKeyHash {
+  size_t operator()(const MoveKey &key) const {
+    uint64_t parts[3] = {key.kind, key.first, key.second};
+    return size_t(HashBytes(parts, sizeof(parts), 0));
+  }
+};
+
+// Set once statx() turns out to be unavailable (old kernel or a seccomp filter)
+std::atomic<bool> statx_unavailable{false};
+
+// Submission queue depth of each thread's io_uring instance
+constexpr unsigned kRingDepth = 256;
+
+// Smallest getdents64 buffer; comfortably holds one maximal linux_dirent64 record
+constexpr size_t kMinDirentBuffer = 32 * 1024;
+
+// Most subdirectories of one directory opened ahead of time in an io_uring batch; the
+// rest are opened when their scan starts, which keeps descriptor use bounded
+constexpr size_t kMaxBatchOpens = 64;
+
+// Descriptors left alone for stdio, the root directory and the like
+constexpr long kReservedFds = 8;
+
+// Longest relative path handed to a single openat when reopening a directory via an
+// ancestor; longer chains are opened piecewise
+constexpr size_t kMaxRelativePath = 2048;
+
+// Smallest mapped listing loaded in parallel, and chunks per thread (several, so that
+// a thread that finishes early can take another)
+constexpr size_t kMinParallelLoad = 4 * 1024 * 1024;
+constexpr size_t kLoadChunksPerThread = 4;
+
+// Fewest threads hashing file contents; reading contents is bound by the disks, which
+// want more requests in flight than a small scan has threads
+constexpr unsigned kMinHashThreads = 4;
+
+/*
+ * StatMask - statx fields needed for an entry of the given getdents64 type
+ *
+ * Only the fields the scan records (the size for non-directories only), and the type
+ * when getdents64 couldn't report it, are requested, so filesystems that compute
+ * attributes lazily can skip the rest.
+ */
+unsigned StatMask(unsigned char d_type, const ScanOptions &options) {
+  unsigned mask = 0;
+  if (options.fields & kFieldMtime) {
+    mask |= STATX_MTIME;
+  }
+  if (d_type != DT_DIR && (options.fields & kFieldSize)) {
+    mask |= STATX_SIZE;
+  }
+  if (d_type == DT_UNKNOWN) {
+    mask |= STATX_TYPE;
+  }
+  if (options.fields & kFieldInode) {
+    mask |= STATX_INO;
+  }
+  return mask;
+}
+
+/*
+ * NeedsStat - Whether an entry of the given getdents64 type has to be stat'ed at all
+ *
+ * Not if the scan records nothing statx would report for it, unless it is a directory
+ * and the scan needs its device to stay on one filesystem.
+ */
+bool NeedsStat(unsigned char d_type, const ScanOptions &options) {
+  return StatMask(d_type, options) != 0 ||
+         (d_type == DT_DIR && options.filter.OneFilesystem());
+}
+
+// statx flags for the scan. AT_SYMLINK_NOFOLLOW: don't follow symbolic links
+int StatFlags(const ScanOptions &options) {
+  return AT_SYMLINK_NOFOLLOW | (options.dont_sync ? AT_STATX_DONT_SYNC : 0);
+}
+
+/*
+ * StatEntry - Fetch the attributes ReadDir needs for one directory entry
+ *
+ * Falls back to fstatat when statx isn't available. Returns -1 with errno set on
+ * failure.
+ */
+int StatEntry(int fddir, const char *name, unsigned char d_type,
+              const ScanOptions &options, struct statx *stx) {
+  if (!statx_unavailable.load(std::memory_order_relaxed)) {
+    if (statx(fddir, name, StatFlags(options), StatMask(d_type, options), stx) == 0) {
+      return 0;
+    }
+    if (errno != ENOSYS) {
+      return -1;
+    }
+    statx_unavailable.store(true, std::memory_order_relaxed);
+  }
+
+  // Full stat, converted to the statx fields that SetMetadata looks at
+  struct stat file_stat;
+  if (fstatat(fddir, name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+    return -1;
+  }
+  stx->stx_mode = uint16_t(file_stat.st_mode);
+  stx->stx_ino = file_stat.st_ino;
+  stx->stx_size = uint64_t(file_stat.st_size);
+  stx->stx_mtime.tv_sec = file_stat.st_mtim.tv_sec;
+  stx->stx_mtime.tv_nsec = uint32_t(file_stat.st_mtim.tv_nsec);
+  stx->stx_dev_major = major(file_stat.st_dev);
+  stx->stx_dev_minor = minor(file_stat.st_dev);
+  return 0;
+}
+
+/*
+ * ThreadRing - This thread's io_uring instance, created on first use
+ *
+ * Returns nullptr if io_uring can't be used, in which case the caller falls back to
+ * plain syscalls.
+ */
+MetadataRing *ThreadRing() {
+  thread_local std::unique_ptr<MetadataRing> ring;
+  thread_local bool tried = false;
+  if (!tried) {
+    tried = true;
+    ring = MetadataRing::Create(kRingDepth);
+  }
+  return ring.get();
+}
+
+/*
+ * DirentBuffer - This thread's getdents64 buffer, grown to at least the given size
+ *
+ * Reused for every directory the thread reads; it is only needed until the names have
+ * been copied into the directory's map.
+ */
+std::vector<char> &DirentBuffer(size_t size) {
+  thread_local std::vector<char> buffer;
+  if (buffer.size() < size) {
+    buffer.resize(size);
+  }
+  return buffer;
+}
+
+/*
+ * FdTokens - Number of descriptors the scan may keep open for later openat calls
+ *
+ * Every worker needs up to three descriptors of its own at any moment (the directory it
+ * is reading, an intermediate directory while reopening by path, and its io_uring
+ * instance); whatever is left of the cap, after a few for stdio and the like, is shared
+ * by directories held open for their subdirectories and by batched opens.
+ */
+long FdTokens(const ScanOptions &options) {
+  long cap = long(options.max_open_fds);
+  if (cap == 0) {
+    struct rlimit limit;
+    cap = (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+              ? long(limit.rlim_cur)
+              : 1024;
+  }
+  long tokens = cap - 3 * long(std::max(options.threads, 1u)) - kReservedFds;
+  return tokens > 0 ? tokens : 0;
+}
+
+/*
+ * Settled - Whether an mtime recorded in a snapshot can be trusted to show a change
+ *
+ * Only an mtime at least a second older than the snapshot counts; a change made right
+ * after the snapshot was taken could have left it the same.
+ */
+bool Settled(const struct timespec &mtime, const struct timespec &taken) {
+  return mtime.tv_sec + 1 < taken.tv_sec ||
+         (mtime.tv_sec + 1 == taken.tv_sec && mtime.tv_nsec <= taken.tv_nsec);
+}
+
+// Open the starting directory of a scan, throwing if it can't be read
+int OpenStartDirectory(const char *start_path) {
   // Verify directory is readable
   if (access(start_path, R_OK) < 0) {
     throw std::runtime_error("Cannot access " + std::string(start_path) + ": " +
@@ -33,302 +230,1897 @@ DirLevel DirLevel::CreateFromPath(const char *start_path) {
     throw std::runtime_error("Cannot open " + std::string(start_path) + ": " +
                              strerror(errno));
   }
+  return fddir;
+}
+
+// Device of an open directory, or 0 if it can't be found
+dev_t DeviceOf(int fddir) {
+  struct stat dir_stat;
+  return fstat(fddir, &dir_stat) == 0 ? dir_stat.st_dev : 0;
+}
+}  // namespace
+
+/*
+ * FdBudget - Shared count of descriptors the scan may still keep open
+ */
+class FdBudget {
+ public:
+  explicit FdBudget(long tokens) : available_(tokens) {}
+
+  // Take one token if any are left
+  bool TryAcquire() {
+    long available = available_.load();
+    while (available > 0) {
+      if (available_.compare_exchange_weak(available, available - 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Give back a token taken by TryAcquire
+  void Release() { available_.fetch_add(1); }
+
+ private:
+  std::atomic<long> available_;
+};
+
+/*
+ * TreeStorage - Memory holding every name, entry array and nested DirLevel of a tree
+ *
+ * Each scanning thread allocates from its own arena, indexed by its pool worker index;
+ * everything else uses arenas[0]. A tree loaded from a mapped snapshot keeps the
+ * mapping, since its names are views into it.
+ */
+struct TreeStorage {
+  std::vector<Arena> arenas = std::vector<Arena>(1);
+  std::vector<std::shared_ptr<MappedFile>> mappings;  // Snapshots names point into
+};
+
+/*
+ * ScanContext - State shared by every directory read of one scan
+ */
+struct ScanContext {
+  ScanContext(const ScanOptions &scan_options, TreeStorage &tree_storage)
+      : options(scan_options), budget(FdTokens(scan_options)), storage(tree_storage) {}
+
+  // Arena for the calling thread
+  Arena &ThreadArena() { return storage.arenas[WorkPool::CurrentWorker()]; }
+
+  // Whether a stat'ed entry is a directory on another filesystem than the root, when
+  // the scan stays on one
+  bool Foreign(const EntryInfo &info, const struct statx &stx) const {
+    return options.filter.OneFilesystem() && info.type == DT_DIR &&
+           makedev(stx.stx_dev_major, stx.stx_dev_minor) != root_dev;
+  }
+
+  const ScanOptions &options;  // Tunables
+  FdBudget budget;             // Descriptors that may still be held open
+  TreeStorage &storage;        // Arenas of the tree being built
+  WorkPool *pool = nullptr;    // Pool for subdirectory scans (nullptr = recurse in place)
+  ContentHasher *hasher = nullptr;  // Hasher for regular files (nullptr = don't hash)
+  ScanGovernor *governor = nullptr;  // Limits on the directory reads (nullptr = none)
+  dev_t root_dev = 0;  // Device of the root, if the scan stays on one filesystem
+
+  // Most subdirectories opened ahead of time by each io_uring batch
+  size_t batch_opens = kMaxBatchOpens;
+};
+
+/*
+ * TreeBuilder - Builds a tree from entries given by full path in Traverse() order
+ *
+ * Keeps the chain of directories leading to the most recent entry open, collecting
+ * each one's entries in a scratch vector, and stores a directory's sorted entry array
+ * in the arena once the input moves past it. Entries of the directory just used are a
+ * direct append; only a change of directory compares path components, and only against
+ * the open chain. Directories must be listed before their contents, but siblings may
+ * come in any order; a directory revisited after it was closed is simply reopened.
+ *
+ * For loading in parallel, a builder can also build a Fragment from a chunk of a
+ * listing in Traverse() order that starts part way through the tree, and a builder of
+ * the whole tree can then Stitch() the fragments of consecutive chunks onto its open
+ * chain.
+ */
+class TreeBuilder {
+ public:
+  // A directory on the open chain and the entries collected for it
+  struct Frame {
+    DirLevel *level;
+    std::vector<EntryInfo> pending;
+    bool changed;
+  };
+
+  // What a builder made of one chunk of a listing
+  struct Fragment {
+    // The directories of the chunk's first entry, root first, with the entries the
+    // chunk adds to them. Their levels are stand-ins for the real directories, which
+    // come from earlier chunks.
+    std::vector<Frame> heads;
+    size_t open_heads = 0;    // Number of heads still open at the end of the chunk
+    std::vector<Frame> tail;  // Directories below the heads still open at the end
+  };
+
+  /**
+   * Constructor - Start adding to a tree
+   *
+   * @param root: Root of the tree (or a stand-in, for a fragment)
+   * @param arena: Arena for names, entry arrays and subdirectory levels
+   * @param copy_names: Copy names into the arena; if false, the names passed to Add()
+   *                    must stay valid (and NUL-terminated) for the life of the tree
+   */
+  TreeBuilder(DirLevel &root, Arena &arena, bool copy_names)
+      : arena_(arena), copy_names_(copy_names) {
+    Push(&root);
+  }
+
+  /**
+   * Add - Add one entry
+   *
+   * @param record: The entry, with its path relative to the root
+   * @param missing: Set to the path of the parent directory when it doesn't exist
+   * @return: false if the parent directory wasn't found
+   */
+  bool Add(const TraverseRecord &record, std::string *missing);
+
+  // The DirLevel created by the last Add() of a directory
+  DirLevel *AddedDir() const { return added_dir_; }
+
+  // Store the entries of every directory that is still open
+  void Finish() {
+    while (depth_ > 0) {
+      Pop();
+    }
+  }
+
+  /**
+   * Attach - Start building a fragment
+   *
+   * @param fragment: Fragment to build
+   * @param dirname: Directory of the chunk's first entry (with trailing '/', or empty)
+   *
+   * Opens stand-ins for the directories leading to dirname. When a stand-in is closed
+   * (or still open at Detach()), its entries go to fragment->heads instead of being
+   * stored.
+   */
+  void Attach(Fragment *fragment, std::string_view dirname);
+
+  // Finish a fragment, handing over the directories still open
+  void Detach();
+
+  /**
+   * Stitch - Continue the tree with the fragment of the next chunk
+   *
+   * @param fragment: Fragment of the chunk following everything added so far
+   * @return: false if the fragment's directories aren't on the open chain
+   */
+  bool Stitch(Fragment &fragment);
+
+  /**
+   * LoadParallel - Load a mapped text listing in parallel chunks
+   *
+   * @param reader: Reader of the listing (used for its mapping and name only)
+   * @param threads: Number of threads to use
+   * @param root: Root to load into (freshly created)
+   * @return: false if the listing isn't in strict Traverse() order or doesn't parse, in
+   *          which case the caller falls back to the sequential loader (and its error
+   *          messages)
+   */
+  static bool LoadParallel(const TraverseReader &reader, unsigned threads,
+                           DirLevel &root);
+
+ private:
+  // Make dirname (with trailing '/', or empty for the root) the top of the open chain
+  bool Resolve(std::string_view dirname, std::string *missing);
+
+  void Push(DirLevel *level);
+  void Pop();
+
+  Arena &arena_;
+  bool copy_names_;
+  std::vector<Frame> stack_;  // Open chain; frames beyond depth_ are kept for reuse
+  size_t depth_ = 0;          // Number of open frames
+  std::string last_dir_;      // Directory part of the previous path
+  Fragment *fragment_ = nullptr;  // Fragment being built, if any
+  DirLevel *added_dir_ = nullptr;  // See AddedDir()
+};
+
+// Implementation of TreeBuilder::Push
+void TreeBuilder::Push(DirLevel *level) {
+  if (stack_.size() <= depth_) {
+    stack_.emplace_back();
+  }
+  Frame &frame = stack_[depth_++];
+  frame.level = level;
+  std::span<EntryInfo> existing = level->Entries();
+  frame.pending.assign(existing.begin(), existing.end());
+  frame.changed = false;
+}
+
+// Implementation of TreeBuilder::Pop
+void TreeBuilder::Pop() {
+  Frame &frame = stack_[--depth_];
+  if (fragment_ && depth_ < fragment_->open_heads) {
+    // A stand-in: its entries belong to a directory of an earlier chunk
+    fragment_->heads[depth_].pending.swap(frame.pending);
+    fragment_->open_heads = depth_;
+  } else if (frame.changed) {
+    frame.level->SetEntries(arena_, frame.pending);
+  }
+  frame.pending.clear();
+}
+
+// Implementation of TreeBuilder::Resolve
+bool TreeBuilder::Resolve(std::string_view dirname, std::string *missing) {
+  // Keep the open directories that match the leading components
+  size_t keep = 1;
+  size_t start = 0;
+  while (start < dirname.length()) {
+    size_t end = dirname.find('/', start);
+    std::string_view component = dirname.substr(start, end - start);
+    if (!component.empty()) {
+      if (keep >= depth_ || stack_[keep].level->name_ != component) {
+        break;
+      }
+      ++keep;
+    }
+    start = end + 1;
+  }
+  while (depth_ > keep) {
+    Pop();
+  }
+
+  // Open the rest. No need to create directories here; they must already exist in the
+  // tree since directories are listed before their contents.
+  while (start < dirname.length()) {
+    size_t end = dirname.find('/', start);
+    std::string_view component = dirname.substr(start, end - start);
+    start = end + 1;
+    if (component.empty()) {
+      continue;
+    }
+    // Find this directory, normally the entry added last
+    Frame &top = stack_[depth_ - 1];
+    const EntryInfo *found = nullptr;
+    for (auto it = top.pending.rbegin(); it != top.pending.rend(); ++it) {
+      if (it->name == component) {
+        found = &*it;
+        break;
+      }
+    }
+    if (!found || found->type != DT_DIR || !found->dir) {
+      missing->clear();
+      top.level->FullPath(*missing);
+      *missing += component;
+      return false;
+    }
+    Push(found->dir);
+  }
+  return true;
+}
+
+// Implementation of TreeBuilder::Add
+bool TreeBuilder::Add(const TraverseRecord &record, std::string *missing) {
+  // Split path into directory components and filename
+  std::string_view dirname =
+      record.path.substr(0, record.path.size() - record.name.size());
+
+  // Navigate to the appropriate directory level
+  if (dirname != last_dir_) {
+    if (!Resolve(dirname, missing)) {
+      last_dir_.clear();
+      Resolve("", missing);  // Back to a consistent state
+      return false;
+    }
+    last_dir_.assign(dirname);
+  }
+
+  // Add the file/directory entry at the current level; if it's a directory, create
+  // the nested DirLevel
+  Frame &top = stack_[depth_ - 1];
+  EntryInfo info{record.type, record.size, record.mtime,
+                 copy_names_ ? arena_.Intern(record.name) : record.name, nullptr,
+                 record.hash, record.ino};
+  if (record.type == DT_DIR) {
+    info.dir = added_dir_ = arena_.New<DirLevel>(top.level, info.name);
+  }
+  top.pending.push_back(info);
+  top.changed = true;
+  return true;
+}
+
+// Implementation of TreeBuilder::Attach
+void TreeBuilder::Attach(Fragment *fragment, std::string_view dirname) {
+  fragment_ = fragment;
+  size_t start = 0;
+  while (start < dirname.length()) {
+    size_t end = dirname.find('/', start);
+    std::string_view component = dirname.substr(start, end - start);
+    start = end + 1;
+    if (!component.empty()) {
+      Push(arena_.New<DirLevel>(stack_[depth_ - 1].level, component));
+    }
+  }
+  fragment_->heads.resize(depth_);
+  for (size_t i = 0; i < depth_; ++i) {
+    fragment_->heads[i].level = stack_[i].level;
+  }
+  fragment_->open_heads = depth_;
+  last_dir_.assign(dirname);
+}
+
+// Implementation of TreeBuilder::Detach
+void TreeBuilder::Detach() {
+  for (size_t i = 0; i < depth_; ++i) {
+    if (i < fragment_->open_heads) {
+      fragment_->heads[i].pending.swap(stack_[i].pending);
+    } else {
+      fragment_->tail.push_back(
+          Frame{stack_[i].level, std::move(stack_[i].pending), stack_[i].changed});
+    }
+    stack_[i].pending.clear();
+  }
+  depth_ = 0;
+  fragment_ = nullptr;
+}
+
+// Implementation of TreeBuilder::Stitch
+bool TreeBuilder::Stitch(Fragment &fragment) {
+  // The heads' directories must be open already, except that the last of them may
+  // have been the last entry added
+  std::vector<Frame> &heads = fragment.heads;
+  size_t keep = 1;
+  while (keep < depth_ && keep < heads.size() &&
+         stack_[keep].level->name_ == heads[keep].level->name_) {
+    ++keep;
+  }
+  while (depth_ > keep) {
+    Pop();
+  }
+  while (depth_ < heads.size()) {
+    const Frame &top = stack_[depth_ - 1];
+    if (top.pending.empty() || top.pending.back().name != heads[depth_].level->name_ ||
+        !top.pending.back().dir) {
+      return false;
+    }
+    Push(top.pending.back().dir);
+  }
+
+  // Hand the heads' entries to the real directories
+  for (size_t i = 0; i < heads.size(); ++i) {
+    Frame &frame = stack_[i];
+    for (EntryInfo &info : heads[i].pending) {
+      if (info.dir) {
+        info.dir->prev_ = frame.level;
+      }
+      frame.pending.push_back(info);
+      frame.changed = true;
+    }
+  }
+
+  // Heads closed within the chunk are complete; the tail stays open
+  while (depth_ > fragment.open_heads) {
+    Pop();
+  }
+  for (Frame &frame : fragment.tail) {
+    if (stack_.size() <= depth_) {
+      stack_.emplace_back();
+    }
+    stack_[depth_++] = std::move(frame);
+  }
+  last_dir_.clear();
+  return true;
+}
+
+// Implementation of TreeBuilder::LoadParallel
+bool TreeBuilder::LoadParallel(const TraverseReader &reader, unsigned threads,
+                               DirLevel &root) {
+  const std::shared_ptr<MappedFile> &mapping = reader.Mapping();
+  const char *data = mapping->Data();
+  size_t size = mapping->Size();
+
+  // Cut the listing at line starts. From anywhere in a line, the first '\0' ends a
+  // filename and the '\n' after it ends that line, even if filenames contain linefeeds.
+  size_t chunks = size_t(threads) * kLoadChunksPerThread;
+  std::vector<size_t> bounds(chunks + 1, size);
+  bounds[0] = 0;
+  for (size_t k = 1; k < chunks; ++k) {
+    size_t from = std::max(size / chunks * k, bounds[k - 1]);
+    auto nul = static_cast<const char *>(memchr(data + from, '\0', size - from));
+    auto lf =
+        nul ? static_cast<const char *>(memchr(nul, '\n', size_t(data + size - nul)))
+            : nullptr;
+    if (!lf) {
+      break;  // The rest stays in the previous chunk
+    }
+    bounds[k] = size_t(lf - data) + 1;
+  }
+
+  // Build a fragment of each chunk, in its own arena
+  struct Chunk {
+    Fragment fragment;
+    std::string_view first;  // First and last path (views into the mapping)
+    std::string_view last;
+    unsigned fields = ~0u;  // EntryField bits every record had
+    bool ok = false;
+  };
+  std::vector<Chunk> results(chunks);
+  std::vector<Arena> &arenas = root.Storage().arenas;
+  arenas.resize(1 + chunks);
+  {
+    WorkPool pool(threads);
+    for (size_t k = 0; k < chunks; ++k) {
+      if (bounds[k] == bounds[k + 1]) {
+        results[k].ok = true;
+        continue;
+      }
+      pool.Submit([&, k] {
+        Chunk &chunk = results[k];
+        Arena &arena = arenas[1 + k];
+        try {
+          TraverseReader part(reader.Filename(), mapping, bounds[k], bounds[k + 1]);
+          TreeBuilder builder(*arena.New<DirLevel>(), arena, false);
+          std::string missing;
+          TraverseRecord record;
+          if (!part.Next(&record)) {
+            return;
+          }
+          chunk.first = record.path;
+          std::string_view dirname =
+              record.path.substr(0, record.path.size() - record.name.size());
+          builder.Attach(&chunk.fragment, dirname);
+          do {
+            // Strict order is what guarantees that the chunks fit together
+            if (!chunk.last.empty() && ComparePaths(chunk.last, record.path) >= 0) {
+              return;
+            }
+            if (!builder.Add(record, &missing)) {
+              return;
+            }
+            chunk.last = record.path;
+          } while (part.Next(&record));
+          builder.Detach();
+          chunk.fields = part.Fields();
+          chunk.ok = true;
+        } catch (const std::exception &) {
+          // Left to the sequential loader to report
+        }
+      });
+    }
+    pool.Run();
+  }
+
+  // Put the fragments together in order
+  TreeBuilder builder(root, arenas[0], false);
+  std::string_view last;
+  unsigned fields = ~0u;
+  for (Chunk &chunk : results) {
+    if (!chunk.ok) {
+      return false;
+    }
+    fields &= chunk.fields;
+    if (chunk.first.empty()) {
+      continue;  // Nothing in this chunk
+    }
+    if ((!last.empty() && ComparePaths(last, chunk.first) >= 0) ||
+        !builder.Stitch(chunk.fragment)) {
+      return false;
+    }
+    last = chunk.last;
+  }
+  builder.Finish();
+  root.fields_ = uint8_t(fields);
+  return true;
+}
+
+/*
+ * DirHandle - A directory's descriptor, shared with the scans of its subdirectories
+ *
+ * Once a directory has been read, its descriptor is only needed as the base for its
+ * subdirectories' openat calls. It is kept open if the budget allows (or it already
+ * holds a token from a batched open); otherwise it is closed and the subdirectories are
+ * reopened relative to the nearest ancestor whose handle is still open, which is why a
+ * closed handle keeps its parent alive. The root's handle always stays open.
+ */
+struct DirHandle {
+  DirHandle(int dir_fd, bool has_token, FdBudget *fd_budget, const DirLevel *dir_level,
+            std::shared_ptr<DirHandle> parent_handle)
+      : fd(dir_fd),
+        counted(has_token),
+        budget(fd_budget),
+        level(dir_level),
+        parent(std::move(parent_handle)) {}
+
+  ~DirHandle() { Close(); }
+
+  DirHandle(const DirHandle &) = delete;
+  DirHandle &operator=(const DirHandle &) = delete;
+
+  // Close the descriptor and give back its token, if it holds one
+  void Close() {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    if (counted) {
+      budget->Release();
+      counted = false;
+    }
+  }
+
+  int fd;                             // Descriptor, or -1 once closed
+  bool counted;                       // Holds a token from budget
+  FdBudget *budget;                   // Budget to return the token to
+  const DirLevel *level;              // Directory this is the handle of
+  std::shared_ptr<DirHandle> parent;  // Parent's handle while this one is closed
+  dev_t dev = 0;  // Device of the directory, if the scan keeps a rate per filesystem
+};
+
+// Implementation of DirLevel::CreateFromPath
+DirLevel DirLevel::CreateFromPath(const char *start_path, const ScanOptions &options) {
+  int fddir = OpenStartDirectory(start_path);
 
   // Create root directory level and read entire tree rooted at fddir
   DirLevel root;
-  root.ReadDir(fddir);
+  root.ReadTree(start_path, fddir, options,
+                options.previous ? options.previous->tree : nullptr);
   return root;
 }
 
+// Implementation of DirLevel::ReadTree
+void DirLevel::ReadTree(const char *root_path, int fddir, const ScanOptions &options,
+                        const DirLevel *previous) {
+  // The context is declared before the pool so dropped tasks can still return their
+  // descriptor tokens, and the hasher before either so it outlives every submitter
+  std::unique_ptr<ContentHasher> hasher;
+  if (options.hash_contents) {
+    hasher = std::make_unique<ContentHasher>(
+        root_path, std::max(options.threads, kMinHashThreads), options.hash_rate);
+  }
+  std::unique_ptr<ScanGovernor> governor;
+  if (options.adaptive || options.call_rate) {
+    governor = std::make_unique<ScanGovernor>(options.threads, options.adaptive,
+                                              options.call_rate);
+  }
+  if (!prev_) {
+    fields_ = uint8_t(options.fields);
+  }
+  TreeStorage &storage = Storage();
+  if (storage.arenas.size() < options.threads) {
+    storage.arenas.resize(options.threads);
+  }
+  ScanContext ctx(options, storage);
+  ctx.hasher = hasher.get();
+  ctx.governor = governor.get();
+  if (options.filter.OneFilesystem()) {
+    ctx.root_dev = DeviceOf(fddir);
+  }
+  auto handle = std::make_shared<DirHandle>(fddir, false, &ctx.budget, this, nullptr);
+  if (options.call_rate) {
+    handle->dev = DeviceOf(fddir);
+  }
+  if (options.threads <= 1) {
+    ReadDir(std::move(handle), ctx, previous);
+  } else {
+    // This directory's own entries are read on this thread, then the pool drains the
+    // subdirectory tasks it queued. Run() rethrows the first failure from any task.
+    // Each worker allocates from its own arena.
+    WorkPool pool(options.threads);
+    ctx.pool = &pool;
+    ReadDir(std::move(handle), ctx, previous);
+    pool.Run();
+  }
+  if (hasher) {
+    hasher->Wait();
+  }
+}
+
+// Implementation of DirLevel::StreamFromPath
+void DirLevel::StreamFromPath(const char *start_path, const ScanOptions &options,
+                              SnapshotWriter &writer) {
+  DirStream stream(start_path, options);
+  while (const EntryInfo *info = stream.Next()) {
+    writer.Add(stream.Dir(), *info);
+  }
+}
+
 // Implementation of DirLevel::CreateFromTraverseFile
-DirLevel DirLevel::CreateFromTraverseFile(const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
-    throw std::runtime_error("Cannot open " + std::string(filename) + ": " +
-                             strerror(errno));
+DirLevel DirLevel::CreateFromTraverseFile(const char *filename, unsigned threads,
+                                          const ScanFilter *filter) {
+  TraverseReader reader(filename, threads);
+  if (filter && !filter->Active()) {
+    filter = nullptr;
+  }
+
+  // Names from a mapped file are used in place, and the tree keeps the mapping
+  const std::shared_ptr<MappedFile> &mapping = reader.Mapping();
+  if (threads > 1 && !filter && mapping && !reader.Binary() &&
+      mapping->Size() >= kMinParallelLoad) {
+    DirLevel root;
+    root.Storage().mappings.push_back(mapping);
+    if (TreeBuilder::LoadParallel(reader, threads, root)) {
+      return root;
+    }
+    // Whatever is wrong with the listing, the sequential loader reports it as usual
   }
-  // Use unique_ptr with custom deleter to ensure FILE is closed
-  std::unique_ptr<FILE, int (*)(FILE *)> file_raii(file, fclose);
 
   DirLevel root;
+  if (mapping) {
+    root.Storage().mappings.push_back(mapping);
+  }
+  TreeBuilder builder(root, root.Storage().arenas[0], !mapping);
+  std::string missing;
 
-  // buffers to be allocated by getdelim
-  char *fname = nullptr;
-  size_t fname_capacity = 0;
-  char *metadata = nullptr;
-  size_t metadata_capacity = 0;
-
-  // Use unique_ptr with custom deleter for buffers allocated by getdelim
-  auto free_deleter = [](char **ptr) { free(*ptr); };
-  std::unique_ptr<char *, decltype(free_deleter)> metadata_raii(&metadata, free_deleter);
-  std::unique_ptr<char *, decltype(free_deleter)> fname_raii(&fname, free_deleter);
-
-  // Get the line in two parts. First is the filename delimited by '\0', then the metadata
-  // delimited by '\n', This allows us to support filenames with embedded linefeeds by
-  // first using zero as delimiter before using '\n' as delimiter
-  int line_num = 0;
-  for (;;) {
-    ssize_t fname_len = getdelim(&fname, &fname_capacity, '\0', file);
-    if (fname_len <= 0) {
-      break;
+  // Directories not yet closed in a binary snapshot, to match its digests to, and the
+  // digests to set once the tree is complete
+  std::vector<DirLevel *> open{&root};
+  std::vector<std::pair<DirLevel *, uint64_t>> digests;
+  auto take_digests = [&]() {
+    for (uint64_t digest : reader.ClosedDigests()) {
+      if (open.empty()) {
+        throw std::runtime_error("Directory digests don't match the entries in '" +
+                                 reader.Filename() + "'");
+      }
+      digests.emplace_back(open.back(), digest);
+      open.pop_back();
     }
-    if (fname[fname_len - 1] != '\0') {
-      throw std::runtime_error("Missing null in '" + std::string(filename) +
-                               "' at line " + std::to_string(line_num) + " :" +
-                               strerror(errno));
+  };
+
+  // Whether the filter leaves out a record: the directory holding it isn't read, or it
+  // or (checking further up) a directory above it is excluded. What follows a directory
+  // left out in Traverse() order is skipped by its path alone.
+  std::string skipped;  // Path of the last directory left out, with trailing '/'
+  bool pruned = false;  // Something was left out (or left unread)
+  auto left_out = [&](const TraverseRecord &record, bool ancestors) {
+    if (!skipped.empty() && record.path.starts_with(skipped)) {
+      return true;
     }
-    ssize_t metadata_len = getdelim(&metadata, &metadata_capacity, '\n', file);
-    if (metadata_len <= 0) {
-      throw std::runtime_error("Cannot read linefeed from '" + std::string(filename) +
-                               "' at line " + std::to_string(line_num) + " :" +
-                               strerror(errno));
+    std::string_view dir = record.path.substr(0, record.path.size() - record.name.size());
+    unsigned depth = unsigned(std::count(dir.begin(), dir.end(), '/'));
+    bool out = !filter->ReadsBelow(depth) || filter->Excluded(record.name, dir);
+    for (size_t start = 0; ancestors && !out && start < dir.size();) {
+      size_t slash = dir.find('/', start);  // dir ends in '/'
+      out = filter->Excluded(dir.substr(start, slash - start), dir.substr(0, start));
+      start = slash + 1;
+    }
+    if (out && record.type == DT_DIR) {
+      skipped.assign(record.path);
+      skipped += '/';
+    }
+    return out;
+  };
+
+  // Add each entry under its directory
+  TraverseRecord record;
+  while (reader.Next(&record)) {
+    take_digests();
+    if (filter && left_out(record, false)) {
+      pruned = true;
+      if (record.type == DT_DIR && reader.HasDigests()) {
+        open.push_back(nullptr);  // Its digest is matched up but not used
+      }
+      continue;
+    }
+    if (!builder.Add(record, &missing)) {
+      if (filter && left_out(record, true)) {
+        pruned = true;  // Below a directory left out earlier
+        if (record.type == DT_DIR && reader.HasDigests()) {
+          open.push_back(nullptr);
+        }
+        continue;
+      }
+      throw std::runtime_error("Directory " + missing +
+                               " not found when processing line " +
+                               std::to_string(reader.LineNumber()));
+    }
+    if (record.type == DT_DIR && filter) {
+      std::string_view dir =
+          record.path.substr(0, record.path.size() - record.name.size());
+      if (!filter->ReadsBelow(unsigned(std::count(dir.begin(), dir.end(), '/')) + 1)) {
+        builder.AddedDir()->pruned_ = true;  // Listed but, as in a scan, not read
+        pruned = true;
+      }
+    }
+    if (record.type == DT_DIR && reader.HasDigests()) {
+      open.push_back(builder.AddedDir());
+    }
+  }
+  take_digests();
+  builder.Finish();
+
+  // Digests are kept only if the entries were in order, so that they describe the
+  // entries as sorted in the tree, and nothing was left out
+  if (reader.HasDigests() && reader.InOrder()) {
+    if (!open.empty()) {
+      throw std::runtime_error("Directory digests don't match the entries in '" +
+                               reader.Filename() + "'");
+    }
+    for (auto [dir, digest] : digests) {
+      if (!pruned) {
+        dir->digest_ = digest;
+      }
+    }
+  }
+  root.fields_ = uint8_t(reader.Fields());
+  return root;
+}
+
+// Implementation of DirLevel::ReadDir
+void DirLevel::ReadDir(int fddir) {
+  ScanOptions options;
+  ScanContext ctx(options, Storage());
+  ReadDir(std::make_shared<DirHandle>(fddir, false, &ctx.budget, this, nullptr), ctx);
+}
+
+// Implementation of DirLevel::ReadDir (handle-based)
+void DirLevel::ReadDir(std::shared_ptr<DirHandle> handle, ScanContext &ctx,
+                       const DirLevel *previous, bool unchanged) {
+  Subdirs subdirs;
+  ReadEntries(handle, ctx, ctx.ThreadArena(), subdirs, previous, unchanged);
+
+  // Recursively process the contents of each subdirectory
+  for (Subdir &subdir : subdirs) {
+    DirLevel *child = subdir.level;
+    if (ctx.pool) {
+      // Let any worker pick it up. The task holds this directory's handle only until
+      // its own descriptor is open (or for longer if it has to close that again).
+      ctx.pool->Submit([child, handle, subdir = std::move(subdir), &ctx]() mutable {
+        child->ReadSubdir(std::move(handle), std::move(subdir), ctx);
+      });
+    } else {
+      child->ReadSubdir(handle, std::move(subdir), ctx);  // Recursive call
     }
-    if (metadata[metadata_len - 1] != '\n') {
-      fclose(file);
-      throw std::runtime_error("Missing linefeed in '" + std::string(filename) +
-                               "' at line " + std::to_string(line_num) + " :" +
+  }
+}
+
+// Implementation of DirLevel::Previous
+const DirLevel *DirLevel::Previous(const DirLevel *previous, const EntryInfo &info,
+                                   const ScanContext &ctx, bool *unchanged) {
+  *unchanged = false;
+  const EntryInfo *before = previous ? previous->Find(info.name) : nullptr;
+  if (!before || before->type != DT_DIR || !before->dir) {
+    return nullptr;
+  }
+  if (!(ctx.options.fields & kFieldMtime) || !(ctx.options.previous->tree->fields_ &
+                                                 kFieldMtime)) {
+    return before->dir;  // Without mtimes, nothing can be shown to be unchanged
+  }
+  const struct timespec &mtime = before->mtime;
+  *unchanged = Settled(mtime, ctx.options.previous->taken) &&
+               mtime.tv_sec == info.mtime.tv_sec && mtime.tv_nsec == info.mtime.tv_nsec;
+  return before->dir;
+}
+
+// Implementation of DirLevel::ReadNames
+size_t DirLevel::ReadNames(int fddir, const ScanOptions &options, Arena &arena,
+                           std::vector<EntryInfo> &added) const {
+  // Every name is copied into the arena so the whole directory can then be stat'ed as
+  // one batch. getdents64 fills a large per-thread buffer with linux_dirent64 records,
+  // which are parsed in place.
+  std::vector<char> &buffer =
+      DirentBuffer(std::max(options.dirent_buffer, kMinDirentBuffer));
+  for (size_t calls = 1;; ++calls) {
+    uint64_t start = options.stats ? ScanStats::Now() : 0;
+    ssize_t len = getdents64(fddir, buffer.data(), buffer.size());
+    if (options.stats) {
+      options.stats->Record(ScanCall::kGetdents, start, len < 0);
+    }
+    if (len < 0) {
+      std::string path;
+      FullPath(path);
+      throw std::runtime_error("Error reading directory " + path + ": " +
                                strerror(errno));
     }
-    line_num++;
+    if (len == 0) {
+      return calls;  // End of directory
+    }
+    for (size_t pos = 0; pos < size_t(len);) {
+      const struct dirent64 *entry =
+          static_cast<const struct dirent64 *>(static_cast<void *>(buffer.data() + pos));
+      pos += entry->d_reclen;
+      // Skip "." and ".." entries to avoid infinite loops or errors
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      // The type may be DT_UNKNOWN until SetMetadata
+      added.push_back(
+          EntryInfo{entry->d_type, 0, {}, arena.Intern(entry->d_name), nullptr, 0, 0});
+    }
+  }
+}
 
-    // Parse the line: ' type size YYYY-MM-DD HH:MM:SS.nnnnnnnnn'
-    int type;
-    unsigned long size;
-    struct tm tm_time = {};
-    long nsec;
+// Implementation of DirLevel::ReadEntries
+void DirLevel::ReadEntries(std::shared_ptr<DirHandle> &handle, ScanContext &ctx,
+                           Arena &arena, Subdirs &subdirs, const DirLevel *previous,
+                           bool unchanged) {
+  const ScanOptions &options = ctx.options;
+  const ScanFilter &filter = options.filter;
+  int fddir = handle->fd;
+  // Fields recorded both by this scan and the previous one, which trusted files keep
+  bool trust = options.previous && options.previous->trust;
+  unsigned reused =
+      options.previous ? options.fields & options.previous->tree->fields_ : 0;
+  uint64_t read_start = options.stats ? ScanStats::Now() : 0;
+  unsigned depth = 0;
+  for (const DirLevel *level = prev_; level; level = level->prev_) {
+    ++depth;
+  }
+  bool descend = filter.ReadsBelow(depth + 1);  // Whether subdirectories are read
+  std::string dir_path;                         // Path for the filter, if it needs one
+  if (filter.NeedsPath()) {
+    FullPath(dir_path);
+  }
 
-    // The path may contain spaces so search backwards from EOL for the final 4 fields
-    size_t ofs = size_t(metadata_len);
-    int remain = 4;
-    while (ofs > 0) {
-      if (metadata[--ofs] == ' ' && --remain == 0) {
-        break;
+  // The names of an unchanged directory are taken from the previous scan. Should one
+  // of them have gone after all, the directory is read like any other.
+  thread_local std::vector<EntryInfo> added;
+  thread_local std::vector<char> foreign;  // Subdirectories on another filesystem
+  thread_local std::vector<dev_t> devices;  // Their devices, with a rate per filesystem
+  std::vector<std::shared_ptr<DirHandle>> prefetched;
+  ScanGovernor::Read read(ctx.governor, handle->dev);
+  for (bool reuse = previous && unchanged;; reuse = false) {
+    added.clear();
+    if (reuse) {
+      for (const EntryInfo &before : previous->Entries()) {
+        EntryInfo info{before.type, 0, {}, arena.Intern(before.name), nullptr, 0, 0};
+        if (trust && before.type != DT_DIR) {
+          info.size = (reused & kFieldSize) ? before.size : 0;
+          info.mtime = (reused & kFieldMtime) ? before.mtime : timespec{};
+          info.ino = (reused & kFieldInode) ? before.ino : 0;
+        }
+        added.push_back(info);
       }
+    } else {
+      // How many getdents64 calls a directory takes is only known once they are made
+      read.Calls(ReadNames(fddir, options, arena, added));
     }
-    if (remain != 0) {
-      fclose(file);
-      throw std::runtime_error("Parse error at line " + std::to_string(line_num) +
-                               ": reading final four fields");
-    }
-
-    // scan the four fields
-    int matched = sscanf(metadata + ofs, "%d %lu %d-%d-%d %d:%d:%d.%ld", &type, &size,
-                         &tm_time.tm_year, &tm_time.tm_mon, &tm_time.tm_mday,
-                         &tm_time.tm_hour, &tm_time.tm_min, &tm_time.tm_sec, &nsec);
-    if (matched != 9) {
-      fclose(file);
-      throw std::runtime_error("Parse error at line " + std::to_string(line_num) +
-                               ": expected 9 fields, got " + std::to_string(matched));
-    }
-    tm_time.tm_year -= 1900;
-    tm_time.tm_mon -= 1;
-
-    // Split path into directory components and filename
-    std::string_view fullpath(fname, size_t(fname_len - 1));
-    size_t last_slash = fullpath.rfind('/');
-
-    std::string_view dirname =
-        (last_slash != std::string_view::npos) ? fullpath.substr(0, last_slash + 1) : "";
-    std::string_view file_name = (last_slash != std::string_view::npos)
-                                     ? fullpath.substr(last_slash + 1)
-                                     : fullpath;
-
-    // Navigate to the appropriate directory level. No need to create directories here;
-    // they must already exist in the tree since directories are listed before their
-    // contents.
-    DirLevel *current_dir = &root;
-    if (!dirname.empty()) {
-      size_t start = 0;
-      while (start < dirname.length()) {
-        size_t end = dirname.find('/', start);
-        if (end == std::string_view::npos) break;
-
-        std::string_view component = dirname.substr(start, end - start);
-        if (!component.empty()) {
-          // Find  this directory
-          auto it = current_dir->entries_.find(component);
-          if (it == current_dir->entries_.end() || it->second.type != DT_DIR ||
-              !it->second.dir) {
-            std::string path;
-            current_dir->FullPath(path);
-            throw std::runtime_error("Directory " + path + std::string(component) +
-                                     " not found when processing line " +
-                                     std::to_string(line_num));
-          } else {
-            current_dir = it->second.dir.get();
-          }
+    // Excluded entries are dropped before they are stat'ed or opened
+    if (filter.HasPatterns()) {
+      std::erase_if(added, [&](const EntryInfo &info) {
+        return filter.Excluded(info.name, dir_path);
+      });
+    }
+
+    // Get file metadata relative to the directory fd (avoids race conditions). Trusted
+    // files keep what the previous scan found, unless it lacks a field wanted.
+    auto needs_stat = [&](const EntryInfo &info) {
+      if (reuse && trust && info.type != DT_DIR && reused == options.fields &&
+          (!(reused & kFieldInode) || info.ino)) {
+        return false;
+      }
+      return NeedsStat((unsigned char)info.type, options);
+    };
+    int failed = 0;  // errno of the first entry that couldn't be stat'ed
+    size_t failed_index = 0;
+    prefetched.assign(added.size(), nullptr);
+    foreign.assign(added.size(), false);
+    devices.assign(added.size(), handle->dev);
+    MetadataRing *ring = options.io_uring ? ThreadRing() : nullptr;
+    if (ring) {
+      // Queue every statx, plus an openat for (a bounded number of) the subdirectories.
+      // Each batched open takes a descriptor token up front.
+      thread_local std::vector<MetadataRequest> requests;
+      thread_local std::vector<size_t> indices;
+      requests.clear();
+      indices.clear();
+      size_t opens = 0;
+      for (size_t i = 0; i < added.size(); ++i) {
+        if (!needs_stat(added[i])) {
+          continue;
         }
-        start = end + 1;
+        MetadataRequest request;
+        request.name = added[i].name.data();
+        request.mask = StatMask((unsigned char)added[i].type, options);
+        request.open_dir = added[i].type == DT_DIR && descend &&
+                           opens < ctx.batch_opens && ctx.budget.TryAcquire();
+        opens += request.open_dir;
+        request.stat_result = request.open_result = -1;
+        requests.push_back(request);
+        indices.push_back(i);
+      }
+      read.Calls(requests.size() + opens);
+      uint64_t start = options.stats ? ScanStats::Now() : 0;
+      ring->Process(fddir, StatFlags(options), requests.data(), requests.size());
+      if (options.stats) {
+        uint64_t stat_failed = 0, open_failed = 0;
+        for (const MetadataRequest &request : requests) {
+          stat_failed += request.stat_result < 0;
+          open_failed += request.open_dir && request.open_result < 0;
+        }
+        options.stats->Record(ScanCall::kRingBatch, start, false);
+        options.stats->Count(ScanCall::kStat, requests.size(), stat_failed);
+        options.stats->Count(ScanCall::kOpen, opens, open_failed);
+      }
+
+      // Record the results before anything can fail so no new descriptor leaks
+      for (size_t r = 0; r < requests.size(); ++r) {
+        if (!requests[r].open_dir) {
+          continue;
+        }
+        if (requests[r].open_result >= 0) {
+          prefetched[indices[r]] = std::make_shared<DirHandle>(
+              requests[r].open_result, true, &ctx.budget, nullptr, nullptr);
+        } else {
+          ctx.budget.Release();
+        }
+      }
+      for (size_t r = 0; r < requests.size(); ++r) {
+        if (requests[r].stat_result < 0) {
+          failed = -requests[r].stat_result;
+          failed_index = indices[r];
+          break;
+        }
+        SetMetadata(&added[indices[r]], requests[r].stx, options.fields);
+        foreign[indices[r]] = ctx.Foreign(added[indices[r]], requests[r].stx);
+        devices[indices[r]] = makedev(requests[r].stx.stx_dev_major,
+                                      requests[r].stx.stx_dev_minor);
+      }
+    } else {
+      struct statx file_stat;
+      for (size_t i = 0; i < added.size(); ++i) {
+        EntryInfo &info = added[i];
+        if (!needs_stat(info)) {
+          continue;
+        }
+        read.Calls(1);
+        uint64_t start = options.stats ? ScanStats::Now() : 0;
+        int result = StatEntry(fddir, info.name.data(), (unsigned char)info.type,
+                               options, &file_stat);
+        if (options.stats) {
+          int saved_errno = errno;
+          options.stats->Record(ScanCall::kStat, start, result == -1);
+          errno = saved_errno;
+        }
+        if (result == -1) {
+          failed = errno;
+          failed_index = i;
+          break;
+        }
+        SetMetadata(&info, file_stat, options.fields);
+        foreign[i] = ctx.Foreign(info, file_stat);
+        devices[i] = makedev(file_stat.stx_dev_major, file_stat.stx_dev_minor);
       }
     }
+    if (!failed) {
+      break;
+    }
+    if (!reuse || failed != ENOENT) {
+      std::string path;
+      FullPath(path);
+      throw std::runtime_error("Can't stat " + path +
+                               std::string(added[failed_index].name) + ": " +
+                               strerror(failed));
+    }
+  }
+  read.Done();
 
-    // Add the file/directory entry at the current level
-    auto inserted = current_dir->entries_.emplace(file_name, EntryInfo{}).first;
-    EntryInfo &info = inserted->second;
-    info.type = type;
-    info.size = size;
-    info.name = &inserted->first;
+  // Create a DirLevel for each subdirectory, remembering them (with any descriptor
+  // opened by the batch) in the order they were read. Those the filter keeps the scan
+  // out of stay empty.
+  for (size_t i = 0; i < added.size(); ++i) {
+    if (added[i].type == DT_DIR) {
+      added[i].dir = arena.New<DirLevel>(this, added[i].name);
+      if (!descend || foreign[i]) {
+        added[i].dir->pruned_ = true;
+        continue;
+      }
+      bool subdir_unchanged;
+      const DirLevel *before = Previous(previous, added[i], ctx, &subdir_unchanged);
+      subdirs.push_back(Subdir{added[i].dir, std::move(prefetched[i]), before,
+                               subdir_unchanged, devices[i]});
+    }
+  }
 
-    // Convert timestamp to timespec
-    info.mtime.tv_sec = timegm(&tm_time);
-    info.mtime.tv_nsec = nsec;
+  // Store the entries, sorted by name, in one contiguous array
+  SetEntries(arena, added);
+  if (options.stats) {
+    uint64_t elapsed = ScanStats::Now() - read_start;
+    if (options.stats->DirectoryRead(depth, count_, elapsed)) {
+      std::string path;
+      FullPath(path);
+      options.stats->AddSlow(path.empty() ? "." : path, count_, elapsed);
+    }
+  }
 
-    // If it's a directory, create the nested DirLevel
-    if (type == DT_DIR) {
-      info.dir.reset(new DirLevel(current_dir, &info));
+  // Hand the regular files to the hasher, except those the previous scan hashed with
+  // the same size and an mtime old enough to trust
+  if (ctx.hasher) {
+    std::string dir;
+    bool have_dir = false;
+    for (EntryInfo &info : Entries()) {
+      if (info.type != DT_REG) {
+        continue;
+      }
+      const EntryInfo *before = previous ? previous->Find(info.name) : nullptr;
+      if (before && before->hash && (reused & kDefaultFields) == kDefaultFields &&
+          SameFile(*before, info) &&
+          Settled(before->mtime, options.previous->taken)) {
+        info.hash = before->hash;
+        continue;
+      }
+      if (!have_dir) {
+        FullPath(dir);
+        have_dir = true;
+      }
+      ctx.hasher->Submit(dir + std::string(info.name), &info);
     }
   }
 
-  // unique_ptrs will automatically free the buffers and FILE when they go out of scope
-  return root;
+  // This directory has now been read in full. Keep it open for the subdirectories'
+  // openat calls if the descriptor budget allows, otherwise close it before descending
+  // so that descriptor use doesn't grow with the depth of the tree.
+  // A handle without a parent (the root, or one opened by a batch with a token already
+  // taken) always stays open.
+  if (subdirs.empty()) {
+    handle.reset();
+  } else if (handle->parent && ctx.budget.TryAcquire()) {
+    handle->counted = true;
+    handle->parent.reset();  // Descendants never need to look further up
+  } else if (handle->parent) {
+    handle->Close();
+  }
 }
 
-// Implementation of DirLevel::ReadDir
-void DirLevel::ReadDir(int fddir) {
-  // Convert file descriptor to DIR stream (takes ownership of fd)
-  DIR *raw_dir = fdopendir(fddir);
-  if (raw_dir == NULL) {
-    std::string path;
-    FullPath(path);
-    close(fddir);  // Close fd if fdopendir fails
-    throw std::runtime_error("Error opening directory " + path + ": " + strerror(errno));
+// Implementation of DirLevel::ReadSubdir
+void DirLevel::ReadSubdir(std::shared_ptr<DirHandle> parent, Subdir subdir,
+                          ScanContext &ctx) {
+  std::shared_ptr<DirHandle> self = std::move(subdir.handle);
+  if (self) {
+    self->level = this;  // Opened by the parent's batch
+  } else {
+    if (ctx.governor) {
+      ctx.governor->Throttle(parent->dev, 1);
+    }
+    uint64_t start = ctx.options.stats ? ScanStats::Now() : 0;
+    int fd = OpenFromHandle(*parent);  // A failure ends the scan, so isn't counted
+    if (ctx.options.stats) {
+      ctx.options.stats->Record(ScanCall::kOpen, start, false);
+    }
+    self = std::make_shared<DirHandle>(fd, false, &ctx.budget, this, std::move(parent));
   }
+  self->dev = subdir.dev;
+  parent.reset();
+  ReadDir(std::move(self), ctx, subdir.previous, subdir.unchanged);
+}
 
-  // Use RAII to automatically close directory on scope exit
-  std::unique_ptr<DIR, int (*)(DIR *)> dir(raw_dir, closedir);
+// Implementation of DirLevel::OpenFromHandle
+int DirLevel::OpenFromHandle(const DirHandle &parent) const {
+  // Collect names from this directory up to the nearest ancestor that is still open
+  std::vector<std::string_view> names{name_};
+  const DirHandle *base = &parent;
+  while (base->fd < 0) {
+    names.push_back(base->level->name_);
+    base = base->parent.get();
+  }
 
-  // Iterate through all directory entries
-  struct dirent *entry;
-  struct stat file_stat;
-  while ((entry = readdir(dir.get())) != NULL) {
-    // Skip "." and ".." entries to avoid infinite loops or errors
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+  // Open subdirectory using openat relative to that ancestor, in pieces if the relative
+  // path would get long
+  int fd = -1;
+  int at = base->fd;
+  std::string relative;
+  for (size_t i = names.size(); i-- > 0;) {
+    relative += names[i];
+    if (i > 0 && relative.size() + names[i - 1].size() < kMaxRelativePath) {
+      relative += '/';
       continue;
     }
-
-    // Get file metadata using fstatat (avoids race conditions)
-    // AT_SYMLINK_NOFOLLOW: don't follow symbolic links
-    if (fstatat(dirfd(dir.get()), entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+    int next = openat(at, relative.c_str(), O_RDONLY | O_DIRECTORY);
+    int saved_errno = errno;
+    if (fd >= 0) {
+      close(fd);  // Done with the intermediate directory
+    }
+    if (next < 0) {
       std::string path;
-      FullPath(path);
-      throw std::runtime_error("Can't stat " + path + entry->d_name + ": " +
-                               strerror(errno));
+      prev_->FullPath(path);
+      throw std::runtime_error("Can't open directory " + path + std::string(name_) +
+                               ": " + strerror(saved_errno));
     }
+    fd = at = next;
+    relative.clear();
+  }
+  return fd;
+}
+
+// Implementation of DirStream::DirStream
+DirStream::DirStream(const char *start_path, const ScanOptions &options)
+    : options_(options), arenas_(1) {
+  // Everything happens on the calling thread. Directories are opened one at a time as
+  // they are reached, so none are opened ahead by io_uring batches.
+  options_.threads = 1;
+  root_.fields_ = uint8_t(options_.fields);
+  int fddir = OpenStartDirectory(start_path);
+  ctx_.reset(new ScanContext(options_, root_.Storage()));
+  ctx_->batch_opens = 0;
+  if (options_.filter.OneFilesystem()) {
+    ctx_->root_dev = DeviceOf(fddir);
+  }
+  if (options_.hash_contents) {
+    hasher_ = std::make_unique<ContentHasher>(
+        start_path, std::max(options.threads, kMinHashThreads), options_.hash_rate);
+    ctx_->hasher = hasher_.get();
+  }
+  auto handle = std::make_shared<DirHandle>(fddir, false, &ctx_->budget, &root_, nullptr);
+  if (options_.call_rate) {
+    // One directory at a time, so only the rate applies
+    governor_ = std::make_unique<ScanGovernor>(1, false, options_.call_rate);
+    ctx_->governor = governor_.get();
+    handle->dev = DeviceOf(fddir);
+  }
+  const DirLevel *previous = options.previous ? options.previous->tree : nullptr;
+  root_.ReadEntries(handle, *ctx_, arenas_[0], subdirs_, previous, false);
+  if (hasher_) {
+    hasher_->Wait();
+  }
+  chain_.push_back(Frame{&root_, std::move(handle), 0, 0, previous});
+}
+
+// Implementation of DirStream::~DirStream (the handles go before the budget they use)
+DirStream::~DirStream() { chain_.clear(); }
 
-    // Add entry to this directory's map
-    EntryInfo *info = AddEntry(entry, &file_stat);
+// Implementation of DirStream::Next
+const EntryInfo *DirStream::Next() {
+  if (descend_) {
+    // Read the directory returned last and make it the end of the chain. Each depth has
+    // its own arena, cleared when the next directory at that depth is read; a
+    // directory's subdirectory levels live in its own arena, so they stay valid while
+    // the directory is on the chain.
+    const EntryInfo *info = descend_;
+    descend_ = nullptr;
+    size_t depth = chain_.size();
+    if (arenas_.size() <= depth) {
+      arenas_.emplace_back();
+    } else {
+      arenas_[depth].Clear();
+    }
+    const Frame &top = chain_.back();
+    if (governor_) {
+      governor_->Throttle(top.handle->dev, 1);
+    }
+    int fd = info->dir->OpenFromHandle(*top.handle);
+    auto handle =
+        std::make_shared<DirHandle>(fd, false, &ctx_->budget, info->dir, top.handle);
+    if (governor_) {
+      handle->dev = DeviceOf(fd);  // The parent's Subdirs, which have it, are gone
+    }
+    bool unchanged;
+    const DirLevel *previous = DirLevel::Previous(top.previous, *info, *ctx_, &unchanged);
+    subdirs_.clear();  // Unused; subdirectories are visited in sorted order
+    info->dir->ReadEntries(handle, *ctx_, arenas_[depth], subdirs_, previous, unchanged);
+    if (hasher_) {
+      hasher_->Wait();
+    }
+    size_t prevlen = dir_.length();
+    dir_ += info->name;
+    dir_ += '/';
+    chain_.push_back(Frame{info->dir, std::move(handle), 0, prevlen, previous});
+  }
 
-    // If the entry is a directory, recursively process its contents
-    if (entry->d_type == DT_DIR) {
-      // Open subdirectory using openat (relative to current dir fd)
-      int nextfd = openat(dirfd(dir.get()), entry->d_name, O_RDONLY | O_DIRECTORY);
-      if (nextfd < 0) {
-        std::string path;
-        FullPath(path);
-        throw std::runtime_error("Can't open directory " + path + entry->d_name + ": " +
-                                 strerror(errno));
+  while (!chain_.empty()) {
+    Frame &top = chain_.back();
+    if (top.next < top.level->count_) {
+      const EntryInfo *info = &top.level->entries_[top.next++];
+      if (info->dir && !info->dir->pruned_) {
+        descend_ = info;
       }
-      // Create new DirLevel for subdirectory and read its contents
-      info->dir.reset(new DirLevel(this, info));
-      info->dir->ReadDir(nextfd);  // Recursive call
+      return info;
     }
+    dir_.resize(top.path_len);  // Back to the parent directory
+    chain_.pop_back();
   }
-  // Directory automatically closed when unique_ptr goes out of scope
+  return nullptr;
 }
 
 // Implementation of DirLevel::Traverse
 void DirLevel::Traverse(const DirLevel *dir_level, std::string &path) {
-  // Iterate through all entries in sorted order (map keeps keys sorted)
-  for (const auto &[name, info] : dir_level->entries_) {
-    // Convert modification time to human-readable format
-    time_t seconds = (time_t)info.mtime.tv_sec;
-    struct tm *tt = gmtime(&seconds);
-    if (tt == NULL) {
-      std::string fullpath;
-      dir_level->FullPath(fullpath);
-      throw std::runtime_error("gmtime failed for " + fullpath + name);
+  SnapshotWriter writer(stdout, SnapshotWriter::Format::kText);
+  writer.SetFields(dir_level->Fields());
+  Write(dir_level, path, writer);
+  writer.Finish();
+}
+
+// Implementation of DirLevel::Write
+void DirLevel::Write(const DirLevel *dir_level, std::string &path,
+                     SnapshotWriter &writer) {
+  for (const EntryInfo &info : dir_level->Entries()) {
+    writer.Add(path, info);
+    if (info.dir) {
+      size_t prevlen = path.length();
+      path += info.name;
+      path += '/';
+      Write(info.dir, path, writer);
+      path.resize(prevlen);
+    }
+  }
+}
+
+// Implementation of DirLevel::WriteDelta
+void DirLevel::WriteDelta(DirLevel *tree, DirLevel *base, std::string &path,
+                          SnapshotWriter &writer) {
+  unsigned fields = tree->Fields() & base->Fields();
+  auto unchanged = [fields](const EntryInfo &info1, const EntryInfo &info2) {
+    return SameFile(info1, info2, fields) && info1.hash == info2.hash &&
+           (!(fields & kFieldInode) || info1.ino == info2.ino);
+  };
+
+  // Directories being walked that haven't been written yet, as each is only needed
+  // once something below it is: the length of its parent's path, and its entry
+  std::vector<std::pair<size_t, const EntryInfo *>> pending;
+  auto add = [&](const EntryInfo &info) {
+    for (auto [len, dir] : pending) {
+      writer.Add(std::string_view(path).substr(0, len), *dir);
+    }
+    pending.clear();
+    writer.Add(path, info);
+  };
+
+  std::function<void(DirLevel *, DirLevel *)> walk = [&](DirLevel *dir1,
+                                                         DirLevel *dir2) {
+    std::span<EntryInfo> entries1 = dir1->Entries(), entries2 = dir2->Entries();
+    size_t i = 0, j = 0;
+    while (i < entries1.size() || j < entries2.size()) {
+      int order = i == entries1.size()   ? 1
+                  : j == entries2.size() ? -1
+                                         : entries1[i].name.compare(entries2[j].name);
+      if (order > 0) {
+        add(EntryInfo{DT_WHT, 0, {}, entries2[j++].name, nullptr, 0, 0});
+        continue;
+      }
+      const EntryInfo &info = entries1[i++];
+      const EntryInfo *old = order == 0 ? &entries2[j++] : nullptr;
+      size_t prevlen = path.length();
+      if (old && info.dir && old->dir) {
+        if (unchanged(info, *old)) {
+          pending.emplace_back(prevlen, &info);
+        } else {
+          add(info);
+        }
+        if (!info.dir->pruned_ && !old->dir->pruned_) {
+          path += info.name;
+          path += '/';
+          walk(info.dir, old->dir);  // Recursive call
+          path.resize(prevlen);
+        }
+        if (!pending.empty() && pending.back().second == &info) {
+          pending.pop_back();  // Nothing below it changed
+        }
+        continue;
+      }
+      if (old && !info.dir && !old->dir && unchanged(info, *old)) {
+        continue;
+      }
+      add(info);
+      if (info.dir) {
+        path += info.name;
+        path += '/';
+        Write(info.dir, path, writer);
+        path.resize(prevlen);
+      }
+    }
+  };
+  walk(tree, base);
+}
+
+// Implementation of DirLevel::ApplyDelta
+void DirLevel::ApplyDelta(DirLevel *tree, DirLevel *delta) {
+  // The delta's entries and names stay where they were loaded, in storage the tree
+  // takes over
+  TreeStorage &storage = tree->Storage();
+  TreeStorage &taken = delta->Storage();
+  for (Arena &arena : taken.arenas) {
+    storage.arenas.push_back(std::move(arena));
+  }
+  for (auto &mapping : taken.mappings) {
+    storage.mappings.push_back(std::move(mapping));
+  }
+  delta->storage_.reset();
+  tree->fields_ &= delta->fields_;
+  Arena &arena = tree->MainArena();
+
+  std::vector<EntryInfo> merged;
+  std::function<void(DirLevel *, const DirLevel *)> apply = [&](DirLevel *dir,
+                                                              const DirLevel *changes) {
+    // The subdirectories changed too are applied first, as merged is reused
+    std::span<EntryInfo> old = dir->Entries();
+    size_t i = 0;
+    for (const EntryInfo &change : changes->Entries()) {
+      while (i < old.size() && old[i].name < change.name) {
+        ++i;
+      }
+      if (change.dir && i < old.size() && old[i].name == change.name && old[i].dir) {
+        apply(old[i].dir, change.dir);  // Recursive call
+      }
+    }
+
+    merged.clear();
+    merged.reserve(old.size() + changes->count_);
+    i = 0;
+    for (const EntryInfo &change : changes->Entries()) {
+      while (i < old.size() && old[i].name < change.name) {
+        merged.push_back(old[i++]);
+      }
+      const EntryInfo *replaced =
+          i < old.size() && old[i].name == change.name ? &old[i++] : nullptr;
+      if (change.type == DT_WHT) {
+        continue;  // Removed
+      }
+      merged.push_back(change);
+      if (change.dir && replaced && replaced->dir) {
+        merged.back().dir = replaced->dir;  // Keeps its contents, changed above
+      }
     }
+    merged.insert(merged.end(), old.begin() + long(i), old.end());
+    dir->SetEntries(arena, merged);
+    dir->digest_ = 0;  // No longer what it was
+    dir->AdoptChildren();
+  };
+  apply(tree, delta);
+  delta->entries_ = nullptr;
+  delta->count_ = 0;
+}
+
+// Implementation of DirLevel::CompareMany
+void DirLevel::CompareMany(std::span<DirLevel *const> trees,
+                           const AgreementReport &report) {
+  unsigned fields = ~0u;
+  for (const DirLevel *tree : trees) {
+    fields &= tree->Fields();
+  }
+  auto same = [fields](const EntryInfo &info1, const EntryInfo &info2) {
+    return info1.type == DT_DIR ? info2.type == DT_DIR : SameFile(info1, info2, fields);
+  };
+  size_t count = trees.size();
+  std::vector<unsigned> groups(count);
+  std::string path;
+
+  // dirs holds each tree's directory at path, nullptr for those that don't take part
+  std::function<void(const std::vector<DirLevel *> &)> walk =
+      [&](const std::vector<DirLevel *> &dirs) {
+        // Directories with the same digest hold the same entries
+        DirLevel *first = nullptr;
+        bool differ = false;
+        for (DirLevel *dir : dirs) {
+          if (dir && !first) {
+            first = dir;
+          } else if (dir) {
+            differ |= dir->Digest() != first->Digest();
+          }
+        }
+        if (!differ) {
+          return;
+        }
+
+        std::vector<size_t> pos(count, 0);
+        std::vector<const EntryInfo *> here(count);
+        std::vector<DirLevel *> below(count);
+        for (;;) {
+          // The next name in any of them
+          std::string_view name;
+          bool any = false;
+          for (size_t k = 0; k < count; ++k) {
+            if (dirs[k] && pos[k] < dirs[k]->count_ &&
+                (!any || dirs[k]->entries_[pos[k]].name < name)) {
+              name = dirs[k]->entries_[pos[k]].name;
+              any = true;
+            }
+          }
+          if (!any) {
+            break;
+          }
 
-    // Print: full_path type size timestamp_with_nanoseconds. After the full path, we
-    // output a null byte before the metadata. This allows us to support filenames with
-    // embedded linefeeds by first using zero as delimiter before using '\n' as delimiter
-    printf("%s%s%c %d %lu %04u-%02u-%02u %02u:%02u:%02u.%09lu\n", path.c_str(),
-           name.c_str(), 0, info.type, info.size, 1900 + tt->tm_year, tt->tm_mon + 1,
-           tt->tm_mday, tt->tm_hour, tt->tm_min, tt->tm_sec, info.mtime.tv_nsec);
+          // Group the trees by their entries of that name
+          unsigned next_group = 0;
+          bool agree = true;
+          size_t dirs_below = 0;
+          for (size_t k = 0; k < count; ++k) {
+            here[k] = nullptr;
+            below[k] = nullptr;
+            groups[k] = 0;
+            if (!dirs[k]) {
+              continue;
+            }
+            if (pos[k] < dirs[k]->count_ && dirs[k]->entries_[pos[k]].name == name) {
+              here[k] = &dirs[k]->entries_[pos[k]++];
+            }
+            if (!here[k]) {
+              agree = false;
+              continue;
+            }
+            for (size_t m = 0; m < k && !groups[k]; ++m) {
+              if (here[m] && same(*here[k], *here[m])) {
+                groups[k] = groups[m];
+              }
+            }
+            if (!groups[k]) {
+              groups[k] = ++next_group;
+            }
+            const EntryInfo &info = *here[k];
+            if (info.type == DT_DIR && info.dir && !info.dir->pruned_) {
+              below[k] = info.dir;
+              ++dirs_below;
+            }
+          }
+          size_t prevlen = path.length();
+          path += name;
+          if (!agree || next_group > 1) {
+            report(path, groups);
+          }
+          // Nothing below a directory only one tree has can disagree
+          if (dirs_below > 1) {
+            path += '/';
+            walk(below);  // Recursive call
+          }
+          path.resize(prevlen);
+        }
+      };
+  walk(std::vector<DirLevel *>(trees.begin(), trees.end()));
+}
 
-    // If this is a directory, recursively traverse it
+// Implementation of DirLevel::Totals
+Rollup DirLevel::Totals(const DirLevel *dir_level, std::string &path,
+                        const RollupReport &report) {
+  Rollup rollup;
+  for (const EntryInfo &info : dir_level->Entries()) {
+    rollup.Add(info);
     if (info.dir) {
-      size_t prevlen = path.length();  // Save current path length
-      path += name;                    // Append directory name
+      size_t prevlen = path.length();
+      path += info.name;
       path += '/';
-      Traverse(info.dir.get(), path);  // Recursive traversal
-      path.resize(prevlen);            // Restore path for next sibling
+      rollup.Add(Totals(info.dir, path, report));  // Recursive call
+      path.resize(prevlen);
     }
   }
+  report(path, rollup);
+  return rollup;
 }
 
 // Implementation of DirLevel::FullPath
 void DirLevel::FullPath(std::string &path) const {
   if (prev_) {
     prev_->FullPath(path);  // Recursively get parent path
-    path += *info_->name;
+    path += name_;
     path += '/';  // Append this directory's name and separator
   }
 }
 
-// Implementation of DirLevel::AddEntry
-EntryInfo *DirLevel::AddEntry(struct dirent *entry, struct stat *file_stat) {
-  // Insert new entry into map, get iterator to inserted element
-  auto it = entries_.emplace(entry->d_name, EntryInfo{}).first;
-  EntryInfo &info = it->second;
+// Implementation of DirLevel::DirLevel
+DirLevel::DirLevel() : prev_(nullptr) {}
 
-  // Populate entry metadata
-  info.type = entry->d_type;  // File type
-  info.size =
-      entry->d_type == DT_DIR ? 0 : (size_t)file_stat->st_size;  // Size (0 for dirs)
-  info.mtime = file_stat->st_mtim;                               // Modification time
-  info.name = &it->first;                                        // Point to key in map
+// Implementation of DirLevel::DirLevel (subdirectory)
+DirLevel::DirLevel(const DirLevel *prev, std::string_view name)
+    : prev_(prev), name_(name) {}
 
-  return &info;
+// Implementation of DirLevel::~DirLevel (frees the arenas, and with them the tree)
+DirLevel::~DirLevel() = default;
+
+// Implementation of DirLevel::DirLevel (move)
+DirLevel::DirLevel(DirLevel &&other) noexcept
+    : entries_(other.entries_),
+      count_(other.count_),
+      digest_(other.digest_),
+      prev_(other.prev_),
+      name_(other.name_),
+      storage_(std::move(other.storage_)),
+      pruned_(other.pruned_),
+      fields_(other.fields_) {
+  other.entries_ = nullptr;
+  other.count_ = 0;
+  AdoptChildren();
+}
+
+// Implementation of DirLevel::operator= (move)
+DirLevel &DirLevel::operator=(DirLevel &&other) noexcept {
+  if (this != &other) {
+    entries_ = other.entries_;
+    count_ = other.count_;
+    digest_ = other.digest_;
+    prev_ = other.prev_;
+    name_ = other.name_;
+    storage_ = std::move(other.storage_);
+    pruned_ = other.pruned_;
+    fields_ = other.fields_;
+    other.entries_ = nullptr;
+    other.count_ = 0;
+    AdoptChildren();
+  }
+  return *this;
+}
+
+// Implementation of DirLevel::Fields
+unsigned DirLevel::Fields() const {
+  const DirLevel *root = this;
+  while (root->prev_) {
+    root = root->prev_;
+  }
+  return root->fields_;
+}
+
+// Implementation of DirLevel::AdoptChildren
+void DirLevel::AdoptChildren() {
+  for (EntryInfo &info : Entries()) {
+    if (info.dir) {
+      info.dir->prev_ = this;
+    }
+  }
+}
+
+// Implementation of DirLevel::Storage
+TreeStorage &DirLevel::Storage() {
+  DirLevel *root = this;
+  while (root->prev_) {
+    root = const_cast<DirLevel *>(root->prev_);
+  }
+  if (!root->storage_) {
+    root->storage_.reset(new TreeStorage);
+  }
+  return *root->storage_;
+}
+
+// Implementation of DirLevel::MainArena
+Arena &DirLevel::MainArena() { return Storage().arenas[0]; }
+
+// Implementation of DirLevel::Footprint
+size_t DirLevel::Footprint() {
+  size_t footprint = 0;
+  for (const Arena &arena : Storage().arenas) {
+    footprint += arena.Footprint();
+  }
+  return footprint;
+}
+
+// Implementation of DirLevel::Find
+EntryInfo *DirLevel::Find(std::string_view name) const {
+  EntryInfo *end = entries_ + count_;
+  EntryInfo *it = std::lower_bound(
+      entries_, end, name, [](const EntryInfo &info, std::string_view key) {
+        return info.name < key;
+      });
+  return (it != end && it->name == name) ? it : nullptr;
+}
+
+// Implementation of DirLevel::SetEntries
+void DirLevel::SetEntries(Arena &arena, std::span<EntryInfo> entries) {
+  // Listings and most filesystems already give the entries in order
+  auto by_name = [](const EntryInfo &a, const EntryInfo &b) { return a.name < b.name; };
+  if (!std::is_sorted(entries.begin(), entries.end(), by_name)) {
+    std::stable_sort(entries.begin(), entries.end(), by_name);
+  }
+  EntryInfo *array = arena.AllocateArray<EntryInfo>(entries.size());
+  size_t count = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    // Of a run of equal names keep the last, as re-inserting into a map used to
+    if (i + 1 < entries.size() && entries[i + 1].name == entries[i].name) {
+      continue;
+    }
+    array[count++] = entries[i];
+  }
+  entries_ = array;
+  count_ = count;
+}
+
+// Implementation of DirLevel::SetMetadata
+void DirLevel::SetMetadata(EntryInfo *info, const struct statx &file_stat,
+                           unsigned fields) {
+  // The type comes from getdents64 unless it didn't know it
+  if (info->type == DT_UNKNOWN) {
+    info->type = IFTODT(file_stat.stx_mode);
+  }
+  if (fields & kFieldSize) {
+    info->size = info->type == DT_DIR ? 0 : (size_t)file_stat.stx_size;  // 0 for dirs
+  }
+  if (fields & kFieldMtime) {
+    info->mtime.tv_sec = file_stat.stx_mtime.tv_sec;  // Modification time
+    info->mtime.tv_nsec = file_stat.stx_mtime.tv_nsec;
+  }
+  if (fields & kFieldInode) {
+    info->ino = file_stat.stx_ino;
+  }
+}
+
+// Implementation of DirLevel::Digest
+uint64_t DirLevel::Digest() {
+  if (digest_ == 0) {
+    DirDigest digest;
+    for (const EntryInfo &info : Entries()) {
+      if (info.type == DT_DIR) {
+        uint64_t contents = info.dir ? info.dir->Digest() : DirDigest().Value();
+        digest.AddDir(info.name, info.type, contents);
+      } else {
+        digest.Add(info);
+      }
+    }
+    digest_ = digest.Value();
+  }
+  return digest_;
+}
+
+// Implementation of DirLevel::MergeCommon
+template <class Visit>
+void DirLevel::MergeCommon(DirLevel *dir1, DirLevel *dir2, Visit visit) {
+  EntryInfo *entries1 = dir1->entries_, *entries2 = dir2->entries_;
+  size_t count1 = dir1->count_, count2 = dir2->count_;
+  size_t i = 0, j = 0, out1 = 0, out2 = 0;
+  while (i < count1 && j < count2) {
+    EntryInfo info1 = entries1[i], info2 = entries2[j];
+    int order = info1.name.compare(info2.name);
+    if (order < 0) {
+      entries1[out1++] = info1;
+      ++i;
+      continue;
+    }
+    if (order > 0) {
+      entries2[out2++] = info2;
+      ++j;
+      continue;
+    }
+    if (info1.type == DT_DIR && info2.type == DT_DIR && (!info1.dir || !info2.dir)) {
+      std::string fullpath;
+      dir1->FullPath(fullpath);
+      throw std::runtime_error("missing directory pointer for " + fullpath +
+                               std::string(info1.name));
+    }
+    auto [drop1, drop2] = visit(info1, info2);
+    if (!drop1) {
+      entries1[out1++] = info1;
+    }
+    if (!drop2) {
+      entries2[out2++] = info2;
+    }
+    ++i;
+    ++j;
+  }
+  // Keep the rest of whichever side is left
+  out1 = size_t(std::copy(entries1 + i, entries1 + count1, entries1 + out1) - entries1);
+  out2 = size_t(std::copy(entries2 + j, entries2 + count2, entries2 + out2) - entries2);
+  dir1->count_ = out1;
+  dir2->count_ = out2;
+  dir1->digest_ = dir2->digest_ = 0;  // No longer what they were
+}
+
+// Implementation of DirLevel::Prune
+bool DirLevel::Prune(const ScanFilter &filter, std::string &path, unsigned depth) {
+  bool changed = false;
+  size_t count = 0;
+  for (size_t i = 0; i < count_; ++i) {
+    EntryInfo &info = entries_[i];
+    if (filter.Excluded(info.name, path)) {
+      changed = true;
+      continue;
+    }
+    if (info.dir && !filter.ReadsBelow(depth + 1)) {
+      changed |= info.dir->count_ > 0;
+      info.dir->count_ = 0;
+      info.dir->digest_ = 0;
+      info.dir->pruned_ = true;
+    } else if (info.dir) {
+      size_t prevlen = path.length();
+      path += info.name;
+      path += '/';
+      changed |= info.dir->Prune(filter, path, depth + 1);  // Recursive call
+      path.resize(prevlen);
+    }
+    entries_[count++] = info;
+  }
+  count_ = count;
+  if (changed) {
+    digest_ = 0;  // No longer what it was
+  }
+  return changed;
 }
 
 // Implementation of DirLevel::RemoveCommon
-void DirLevel::RemoveCommon(DirLevel *dir1, DirLevel *dir2) {
-  // Iterate through entries in dir1
-  for (auto it = dir1->entries_.begin(), next = it; it != dir1->entries_.end();
-       it = next) {
-    ++next;
-    auto &[name, info1] = *it;
-
-    // Check if this entry exists in dir2
-    auto it2 = dir2->entries_.find(name);
-    if (it2 != dir2->entries_.end()) {
-      const EntryInfo &info2 = it2->second;
-      // If both are directories (with same name) then recurse always
-      if (info1.type == DT_DIR && info2.type == DT_DIR) {
-        if (!info1.dir.get() || !info2.dir.get()) {
-          std::string fullpath;
-          dir1->FullPath(fullpath);
-          throw std::runtime_error("missing directory pointer for " + fullpath + name);
+void DirLevel::RemoveCommon(DirLevel *dir1, DirLevel *dir2, unsigned threads,
+                            const ScanFilter *filter) {
+  if (filter && filter->Active()) {
+    std::string path;
+    dir1->Prune(*filter, path, 0);
+    dir2->Prune(*filter, path, 0);
+  }
+
+  // Files (and other non-directories) are identical if type, size, mtime and any
+  // content hashes agree, as far as both trees record them. (Digests need no such
+  // care: a field one tree lacks is 0 in its digests, which then differ.)
+  unsigned fields = dir1->Fields() & dir2->Fields();
+  auto identical = [fields](const EntryInfo &info1, const EntryInfo &info2) {
+    bool same = SameFile(info1, info2, fields);
+    return std::pair(same, same);
+  };
+
+  // Directories found on both sides are compared recursively. Without a pool that
+  // happens right away, so they can be dropped here if left empty. Otherwise each pair
+  // is merged in its own task, as they share nothing, and whether a directory ends up
+  // empty is only known once all of them have finished.
+  std::unique_ptr<WorkPool> pool;
+  if (threads > 1) {
+    pool = std::make_unique<WorkPool>(threads);
+  }
+  std::function<void(DirLevel *, DirLevel *)> merge = [&](DirLevel *a, DirLevel *b) {
+    MergeCommon(a, b, [&](const EntryInfo &info1, const EntryInfo &info2) {
+      if (info1.type != DT_DIR || info2.type != DT_DIR) {
+        return identical(info1, info2);
+      }
+      if (info1.dir->pruned_ || info2.dir->pruned_) {
+        return std::pair(true, true);  // Contents unknown on one side, as if the same
+      }
+      if (info1.dir->Digest() == info2.dir->Digest()) {
+        return std::pair(true, true);  // Everything below would be removed
+      }
+      if (!pool) {
+        merge(info1.dir, info2.dir);  // Recursive call
+        return std::pair(info1.dir->count_ == 0, info2.dir->count_ == 0);
+      }
+      pool->Submit([&merge, sub1 = info1.dir, sub2 = info2.dir] { merge(sub1, sub2); });
+      return std::pair(false, false);
+    });
+  };
+  if (dir1->Digest() == dir2->Digest()) {
+    dir1->count_ = dir2->count_ = 0;
+    return;
+  }
+  if (!pool) {
+    merge(dir1, dir2);
+    return;
+  }
+  pool->Submit([&] { merge(dir1, dir2); });
+  pool->Run();
+
+  // Then drop the directories that were left empty, deepest first
+  std::function<void(DirLevel *, DirLevel *)> prune = [&](DirLevel *a, DirLevel *b) {
+    MergeCommon(a, b, [&](const EntryInfo &info1, const EntryInfo &info2) {
+      if (info1.type != DT_DIR || info2.type != DT_DIR) {
+        return std::pair(false, false);
+      }
+      prune(info1.dir, info2.dir);
+      return std::pair(info1.dir->count_ == 0, info2.dir->count_ == 0);
+    });
+  };
+  prune(dir1, dir2);
+}
+
+// Implementation of DirLevel::RemoveMoved
+void DirLevel::RemoveMoved(DirLevel *dir1, DirLevel *dir2, const MoveReport &report) {
+  unsigned fields = dir1->Fields() & dir2->Fields();  // Compared by SameFile()
+
+  // The keys an entry can be matched by, best first. A directory a ScanFilter left
+  // unread has none, as its contents are unknown.
+  auto keys = [](const EntryInfo &info, MoveKey found[2]) {
+    size_t count = 0;
+    if (info.dir && info.dir->pruned_) {
+      return count;
+    }
+    if (info.ino) {
+      found[count++] = MoveKey{MoveKey::kInode, info.ino, uint64_t(info.type)};
+    }
+    if (info.type == DT_REG && info.hash && info.size) {
+      found[count++] = MoveKey{MoveKey::kContent, info.hash, info.size};
+    } else if (info.type == DT_DIR && info.dir && info.dir->count_) {
+      found[count++] = MoveKey{MoveKey::kDigest, info.dir->Digest(), 0};
+    }
+    return count;
+  };
+
+  // Index what dir2 has where dir1 has nothing of the same name
+  struct Place {
+    DirLevel *dir;
+    std::string_view name;
+  };
+  std::unordered_multimap<MoveKey, Place, MoveKeyHash> left;
+  std::function<void(DirLevel *, DirLevel *)> index = [&](DirLevel *dir,
+                                                          DirLevel *other) {
+    for (const EntryInfo &info : dir->Entries()) {
+      const EntryInfo *pair = other ? other->Find(info.name) : nullptr;
+      if (!pair) {
+        MoveKey found[2];
+        for (size_t k = 0, count = keys(info, found); k < count; ++k) {
+          left.emplace(found[k], Place{dir, info.name});
         }
-        RemoveCommon(info1.dir.get(), info2.dir.get());
-        // Remove directory entries only if they are now empty
-        if (info1.dir.get()->entries_.empty()) {
-          dir1->entries_.erase(it);
+      }
+      if (info.dir) {
+        index(info.dir, pair ? pair->dir : nullptr);  // Recursive call
+      }
+    }
+  };
+  index(dir2, dir1);
+
+  // A candidate may have been removed since, or lie in a subtree that was
+  auto attached = [](const DirLevel *dir) {
+    for (; dir->prev_; dir = dir->prev_) {
+      const EntryInfo *entry = dir->prev_->Find(dir->name_);
+      if (!entry || entry->dir != dir) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto remove = [](DirLevel *dir, std::string_view name) {
+    EntryInfo *entry = dir->Find(name);
+    std::copy(entry + 1, dir->entries_ + dir->count_, entry);
+    --dir->count_;
+    for (DirLevel *level = dir; level; level = const_cast<DirLevel *>(level->prev_)) {
+      level->digest_ = 0;  // No longer what they were
+    }
+  };
+
+  // The best candidate still there for dir1's entry, if any, and the kind of key it
+  // was found by
+  std::unordered_set<const DirLevel *> moved_from;  // Directories matched already
+  auto match = [&](const EntryInfo &info, MoveKey::Kind *kind) -> const Place * {
+    MoveKey found[2];
+    for (size_t k = 0, count = keys(info, found); k < count; ++k) {
+      *kind = found[k].kind;
+      const Place *best = nullptr;
+      auto [begin, end] = left.equal_range(found[k]);
+      for (auto it = begin; it != end; ++it) {
+        const EntryInfo *old = it->second.dir->Find(it->second.name);
+        if (!old || old->type != info.type || !attached(it->second.dir) ||
+            (old->dir && moved_from.count(old->dir))) {
+          continue;
         }
-        if (info2.dir.get()->entries_.empty()) {
-          dir2->entries_.erase(it2);
+        if (found[k].kind == MoveKey::kInode && info.type != DT_DIR &&
+            !SameFile(info, *old, fields)) {
+          continue;  // The inode number was reused
+        }
+        if (found[k].kind == MoveKey::kDigest && old->dir->Digest() != found[k].first) {
+          continue;  // Changed by an earlier move
+        }
+        if (old->name == info.name) {
+          return &it->second;
+        }
+        if (!best) {
+          best = &it->second;
         }
-        continue;
       }
-
-      // Check if the entries are identical (same type, size, and modification time)
-      if (info2.type == info1.type && info2.size == info1.size &&
-          info2.mtime.tv_sec == info1.mtime.tv_sec &&
-          info2.mtime.tv_nsec == info1.mtime.tv_nsec) {
-        dir1->entries_.erase(it);
-        dir2->entries_.erase(it2);
+      if (best) {
+        return best;
       }
     }
-  }
+    return nullptr;
+  };
+
+  // Look up dir1's entries, parents first. Below a moved directory, its old place is
+  // the other side.
+  std::function<void(DirLevel *, DirLevel *, std::string &)> find =
+      [&](DirLevel *dir, DirLevel *other, std::string &path) {
+        for (size_t i = 0; i < dir->count_;) {
+          EntryInfo info = dir->entries_[i];
+          const EntryInfo *pair = other ? other->Find(info.name) : nullptr;
+          DirLevel *below = pair ? pair->dir : nullptr;
+          MoveKey::Kind kind = MoveKey::kInode;
+          if (const Place *place = pair ? nullptr : match(info, &kind)) {
+            const EntryInfo &moved = *place->dir->Find(place->name);
+            DirLevel *old = moved.dir;
+            // A directory made after one was removed may get its inode number. Unless it
+            // kept its mtime when moved, it only counts if they have something in common.
+            bool renamed = !old || kind != MoveKey::kInode ||
+                           (info.mtime.tv_sec == moved.mtime.tv_sec &&
+                            info.mtime.tv_nsec == moved.mtime.tv_nsec);
+            uint64_t digest = old ? info.dir->Digest() : 0;
+            if (old) {
+              RemoveCommon(info.dir, old);
+            }
+            if (renamed || info.dir->Digest() != digest) {
+              std::string from, to = path;
+              place->dir->FullPath(from);
+              from += place->name;
+              to += info.name;
+              report(from, to, info);
+              if (!old || (info.dir->count_ == 0 && old->count_ == 0)) {
+                remove(place->dir, place->name);
+                remove(dir, info.name);
+                continue;
+              }
+              moved_from.insert(old);
+              below = old;
+            }
+          }
+          if (info.dir) {
+            size_t prevlen = path.length();
+            path += info.name;
+            path += '/';
+            find(info.dir, below, path);  // Recursive call
+            path.resize(prevlen);
+          }
+          ++i;
+        }
+      };
+  std::string path;
+  find(dir1, dir2, path);
 }
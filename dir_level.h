@@ -8,68 +8,263 @@
 #define DIR_LEVEL_H
 
 #include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 
-#include <map>
+#include <functional>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "scan_filter.h"
+
+class Arena;
+class ContentHasher;
+class ScanGovernor;
+class ScanStats;
+struct DirHandle;
+struct ScanContext;
+class SnapshotWriter;
+struct TreeStorage;
+
+/**
+ * PreviousScan - An earlier snapshot of the tree being scanned, for an incremental scan
+ *
+ * A directory whose mtime is the same as in the snapshot has had no entries added,
+ * removed or renamed since, so its names are taken from the snapshot instead of being
+ * read again; only its entries are stat'ed. A directory modified less than a second
+ * before the snapshot was taken is read anyway, as a change made right after could
+ * have left its mtime the same.
+ */
+struct PreviousScan {
+  const class DirLevel *tree = nullptr;  // Root of the snapshot
+  struct timespec taken = {};            // When the snapshot was written
+  bool trust = false;  // Also take the unchanged directories' files from the snapshot,
+                       // stat'ing only their subdirectories
+};
+
+/**
+ * EntryField - Metadata an entry may carry besides its name and type
+ *
+ * A scan records a chosen set of these (ScanOptions::fields), asks statx for those
+ * alone (and, when it records none and getdents64 reported the type, makes no statx
+ * call at all), and snapshots store only those. Fields not recorded are 0 in EntryInfo
+ * and are left out of comparisons.
+ */
+enum EntryField : unsigned {
+  kFieldSize = 1,   // EntryInfo::size
+  kFieldMtime = 2,  // EntryInfo::mtime
+  kFieldInode = 4,  // EntryInfo::ino
+};
+
+// Fields a scan records unless told otherwise
+inline constexpr unsigned kDefaultFields = kFieldSize | kFieldMtime;
+
+/**
+ * ScanOptions - Tunables for DirLevel::CreateFromPath
+ *
+ * The defaults reproduce the original single-threaded depth-first scan.
+ */
+struct ScanOptions {
+  unsigned threads = 1;    // Worker threads for the scan (1 = scan on the calling thread)
+  size_t dirent_buffer = 1 << 20;  // Per-thread getdents64 buffer size in bytes
+  bool dont_sync = false;  // Stat with AT_STATX_DONT_SYNC (accept cached attributes on
+                           // network filesystems instead of revalidating with the server)
+  bool io_uring = false;   // Batch each directory's statx/openat calls through io_uring
+                           // (falls back to plain syscalls if the kernel refuses)
+  unsigned max_open_fds = 0;  // Cap on descriptors used by the scan (0 = RLIMIT_NOFILE);
+                              // should leave room for 3 per thread plus a few spare
+  const PreviousScan *previous = nullptr;  // Snapshot to reuse unchanged directories
+                                           // from (nullptr = read everything)
+  bool hash_contents = false;  // Hash regular files' contents (see ContentHasher), on
+                               // max(threads, 4) extra threads; with a previous scan,
+                               // only files whose size or mtime changed are read
+  uint64_t hash_rate = 0;      // Most bytes per second to read for hashing (0 = no limit)
+  bool adaptive = false;       // Adapt the number of directories read at once (up to
+                               // threads) to the latency of their calls (ScanGovernor)
+  uint64_t call_rate = 0;      // Most metadata calls per second on each filesystem
+                               // (0 = no limit)
+  ScanStats *stats = nullptr;  // Where to count calls and time them (nullptr = don't)
+  ScanFilter filter;           // Entries to leave out (see ScanFilter)
+  unsigned fields = kDefaultFields;  // Metadata to record (EntryField bits)
+};
 
 /**
  * EntryInfo - Stores metadata for a single filesystem entry
  *
  * Holds information about files and directories including type, size,
- * modification time, and a pointer to the entry's name (stored in the map).
- * For directories, contains a unique_ptr to the nested DirLevel structure.
+ * modification time, and the entry's name (interned in the tree's arena).
+ * For directories, points to the nested DirLevel structure (also in the arena).
+ * A regular file may also carry a hash of its contents, and any entry its inode number,
+ * which stays the same when it is renamed or moved within its filesystem.
  */
 struct EntryInfo {
-  int type;                 // Entry type (DT_REG, DT_DIR, etc.)
-  size_t size;              // File size in bytes (0 for directories)
-  struct timespec mtime;    // Last modification timestamp
-  const std::string *name;  // Pointer to name in parent's map
+  int type;               // Entry type (DT_REG, DT_DIR, etc.)
+  size_t size;            // File size in bytes (0 for directories, or if not recorded)
+  struct timespec mtime;  // Last modification timestamp (0 if not recorded)
+  std::string_view name;  // Entry name, NUL-terminated in the tree's arena
 
   // If this entry is for a directory (type == DT_DIR), this points to it
-  std::unique_ptr<class DirLevel> dir;
+  class DirLevel *dir;
+
+  uint64_t hash;  // Hash of a regular file's contents (see ContentHasher), 0 if unknown
+  uint64_t ino;   // Inode number, 0 unless the scan or snapshot recorded it
+};
+
+/**
+ * SameFile - Whether two non-directory entries describe the same file
+ *
+ * @param fields: EntryField bits recorded on both sides; the others aren't compared
+ * @return: true if type, size and mtime agree, and so do the content hashes when both
+ *          entries have one
+ */
+inline bool SameFile(const EntryInfo &a, const EntryInfo &b,
+                     unsigned fields = kDefaultFields) {
+  return a.type == b.type && (!(fields & kFieldSize) || a.size == b.size) &&
+         (!(fields & kFieldMtime) ||
+          (a.mtime.tv_sec == b.mtime.tv_sec && a.mtime.tv_nsec == b.mtime.tv_nsec)) &&
+         (!a.hash || !b.hash || a.hash == b.hash);
+}
+
+/**
+ * Rollup - Totals for everything below a directory, as du would report them
+ */
+struct Rollup {
+  uint64_t bytes = 0;           // Sum of the sizes of the non-directories
+  uint64_t files = 0;           // Number of non-directories
+  uint64_t dirs = 0;            // Number of directories (not counting the top one)
+  struct timespec newest = {};  // Latest mtime of any entry (zero if there are none)
+
+  // Count one entry (a directory's own entry, not what it holds)
+  void Add(const EntryInfo &info) {
+    if (info.type == DT_DIR) {
+      ++dirs;
+    } else {
+      ++files;
+      bytes += info.size;
+    }
+    Touch(info.mtime);
+  }
+
+  // Add in the totals of a subdirectory
+  void Add(const Rollup &below) {
+    bytes += below.bytes;
+    files += below.files;
+    dirs += below.dirs;
+    Touch(below.newest);
+  }
+
+  // Make mtime the newest if it is later
+  void Touch(const struct timespec &mtime) {
+    if (mtime.tv_sec > newest.tv_sec ||
+        (mtime.tv_sec == newest.tv_sec && mtime.tv_nsec > newest.tv_nsec)) {
+      newest = mtime;
+    }
+  }
 };
 
+// Called with each directory's path (with trailing '/', empty for the root) and totals
+using RollupReport = std::function<void(const std::string &path, const Rollup &rollup)>;
+
+// Called with an entry's old and new paths (without trailing '/') and the entry at the
+// new one, for each move DirLevel::RemoveMoved() finds
+using MoveReport = std::function<void(const std::string &from, const std::string &to,
+                                      const EntryInfo &info)>;
+
+// Called with the path (without trailing '/') of each entry the trees given to
+// DirLevel::CompareMany() disagree about, and for each tree the number of the group of
+// trees whose entries there are the same as its own: from 1, in the order of each
+// group's first tree, or 0 if the tree has no entry there
+using AgreementReport =
+    std::function<void(const std::string &path, std::span<const unsigned> groups)>;
+
 /**
  * DirLevel - Represents a directory level in the filesystem hierarchy
  *
- * Maintains a map of entries (files/subdirectories) and links to parent directory.
- * Provides methods to recursively read directory contents and traverse the tree.
+ * Keeps its entries (files/subdirectories) sorted by name in one contiguous array and
+ * links to its parent directory. The root DirLevel owns the arenas holding every name,
+ * entry array and nested DirLevel of the tree, so destroying a tree is a handful of
+ * frees. Provides methods to recursively read directory contents and traverse the tree.
  */
 class DirLevel {
  public:
-  // Default constructor
-  DirLevel() : prev_(nullptr), info_(nullptr) {}
+  // Default constructor (an empty root)
+  DirLevel();
+
+  // Constructor: links this directory to its parent under the given (interned) name
+  DirLevel(const DirLevel *prev, std::string_view name);
+
+  ~DirLevel();
 
-  // Constructor: links this directory to its parent and corresponding EntryInfo
-  DirLevel(DirLevel *const prev, EntryInfo *const info) : prev_(prev), info_(info) {}
+  // Roots are movable (children are re-pointed at the new object), not copyable
+  DirLevel(DirLevel &&other) noexcept;
+  DirLevel &operator=(DirLevel &&other) noexcept;
+  DirLevel(const DirLevel &) = delete;
+  DirLevel &operator=(const DirLevel &) = delete;
 
   /**
    * CreateFromPath - Factory function to create and initialize a root DirLevel
    *
    * @param start_path: Path to the directory to read
+   * @param options: Scan tunables (thread count etc.)
    * @return: Initialized DirLevel containing the entire directory tree
    *
    * Opens the directory, creates a root DirLevel, and recursively reads all contents.
+   * With options.threads > 1, subdirectories are handed to a work-stealing pool and each
+   * one is filled in by whichever thread picks it up; the resulting tree is the same.
    * Throws std::runtime_error on any failure.
    */
-  static DirLevel CreateFromPath(const char *start_path);
+  static DirLevel CreateFromPath(const char *start_path,
+                                 const ScanOptions &options = ScanOptions());
+
+  /**
+   * StreamFromPath - Write a snapshot of a directory tree as it is read, without
+   * keeping it
+   *
+   * @param start_path: Path to the directory to read
+   * @param options: Scan tunables
+   * @param writer: Snapshot to add the entries to (Finish() is left to the caller)
+   *
+   * Produces the same snapshot as Write() on the tree CreateFromPath() would build, but
+   * writes each directory's entries as soon as it has been read (see DirStream), so
+   * output starts immediately and memory use doesn't grow with the size of the tree.
+   * Directories are read on the calling thread (options.threads is ignored). Throws
+   * std::runtime_error on any failure, possibly after part of the output has been
+   * written.
+   */
+  static void StreamFromPath(const char *start_path, const ScanOptions &options,
+                             SnapshotWriter &writer);
 
   /**
-   * CreateFromTraverseFile - Factory function to create DirLevel from Traverse() output
+   * CreateFromTraverseFile - Factory function to create DirLevel from a snapshot
    *
-   * @param filename: Path to file containing output from Traverse()
+   * @param filename: Path to file containing output from Traverse(), or a binary
+   *                  snapshot (see snapshot_writer.h), either maybe compressed
+   * @param threads: Number of threads to parse a large text file with, and to
+   *                 decompress a compressed one on
+   * @param filter: Entries to leave out, as a scan with the same filter would (a
+   *                directory at the depth limit is kept, but empty), or nullptr
    * @return: Initialized DirLevel reconstructed from the file
    *
    * Parses a file containing lines in the format:
    *   path type size YYYY-MM-DD HH:MM:SS.nnnnnnnnn
-   * and reconstructs the directory tree structure.
+   * or binary records (detected from the first byte) and reconstructs the directory
+   * tree structure.
+   * A large text file in strict Traverse() order is split into chunks at line
+   * boundaries that are parsed in parallel and joined afterwards; anything else is read
+   * sequentially, as are binary snapshots, whose records depend on the one before.
+   * A filter makes the load sequential, and drops the snapshot's digests if it leaves
+   * anything out.
    * Throws std::runtime_error on parse errors or file access failures.
    */
-  static DirLevel CreateFromTraverseFile(const char *filename);
+  static DirLevel CreateFromTraverseFile(const char *filename, unsigned threads = 1,
+                                         const ScanFilter *filter = nullptr);
 
   /**
    * ReadDir - Recursively read directory contents from an open file descriptor
@@ -88,24 +283,153 @@ class DirLevel {
    * @param path: Current path string (modified during traversal)
    *
    * Prints each entry with format: path name type size timestamp
-   * Recursively descends into subdirectories.
+   * Recursively descends into subdirectories. The listing is written to stdout through
+   * a text SnapshotWriter; throws std::runtime_error if it can't be written.
    */
   static void Traverse(const DirLevel *dir_level, std::string &path);
 
+  /**
+   * Write - Static method to recursively write a directory tree as a snapshot
+   *
+   * @param dir_level: Directory level to write
+   * @param path: Current path string (modified during traversal)
+   * @param writer: Snapshot to add the entries to, in Traverse() order
+   */
+  static void Write(const DirLevel *dir_level, std::string &path, SnapshotWriter &writer);
+
   /**
    * RemoveCommon - Static method to remove identical non-directory entries and empty
    * directories recursively from two DirLevel objects
    *
    * @param dir1: First DirLevel object pointer. Must not be nullptr.
    * @param dir2: Second DirLevel object pointer. Must not be nullptr.
+   * @param filter: Entries to leave out of both sides first (see Prune()), or nullptr
    *
    * Compares entries in both directory levels and removes non-directory entries (files)
    * that are identical in both objects. Two entries are considered identical if they have
-   * the same name, type (and not DT_DIR), size, and modification time.
+   * the same name, type (and not DT_DIR), size, and modification time, and the same
+   * content hash if both sides have one (see SameFile()); a size or mtime either tree
+   * lacks (see Fields()) isn't compared.
    * Handles directories recursively and removes directory entries only if they become
    * empty.
+   * A pair of directories whose digests match (see Digest()) holds nothing different,
+   * so it is emptied without visiting it; digests loaded from a binary snapshot make
+   * that free on the snapshot's side.
+   * Each pair of directories is compared in one merge of their sorted entries. With
+   * threads > 1 the pairs of subdirectories are compared in parallel on a work pool,
+   * and the directories left empty are removed in a final pass.
+   * A directory a ScanFilter left unread on either side has unknown contents, so it is
+   * treated as holding nothing different.
    */
-  static void RemoveCommon(DirLevel *dir1, DirLevel *dir2);
+  static void RemoveCommon(DirLevel *dir1, DirLevel *dir2, unsigned threads = 1,
+                           const ScanFilter *filter = nullptr);
+
+  /**
+   * RemoveMoved - Static method to remove the entries of two trees that moved from one
+   * path to another, before RemoveCommon() removes the rest of what they have in common
+   *
+   * @param dir1: Root of the tree the entries moved to (e.g. the scanned one). Must not
+   *              be nullptr.
+   * @param dir2: Root of the tree they moved from (e.g. the snapshot). Must not be
+   *              nullptr.
+   * @param report: Called for each move, in Traverse() order of the new paths
+   *
+   * An entry at a path only one tree has is matched with one at a path only the other
+   * has by, best first:
+   *  - its inode number, if both have one; a non-directory must also be the same file
+   *    (see SameFile()), while a directory must have kept its mtime or have something
+   *    in common with the other one, as new contents change its mtime
+   *  - for a non-empty regular file hashed in both, its content hash and size
+   *  - for a non-empty directory, its digest (nothing below it changed)
+   * preferring a match with the same name. dir2's candidates are put in a hash table
+   * by each key they have, then dir1's entries are looked up in it, parents first.
+   * A moved file is dropped from both trees. A moved directory's two sides are compared
+   * with RemoveCommon(), and are only dropped if that empties both; what is left of
+   * them stays at their paths, and entries in the same place below both aren't reported
+   * as moved themselves. A directory a ScanFilter left unread isn't matched.
+   */
+  static void RemoveMoved(DirLevel *dir1, DirLevel *dir2, const MoveReport &report);
+
+  /**
+   * WriteDelta - Static method to write what changed between two trees as a delta, a
+   * snapshot that ApplyDelta() turns the old tree into the new one with
+   *
+   * @param tree: The new tree (e.g. the scanned one)
+   * @param base: The old tree (e.g. the snapshot it is compared with)
+   * @param path: Current path string (modified during traversal)
+   * @param writer: Snapshot to add the delta's entries to, in Traverse() order
+   *
+   * The delta holds tree's entries that RemoveCommon() would leave: each one added or
+   * changed (a new directory with everything below it) and each directory above one,
+   * plus a whiteout (an entry of type DT_WHT, as union filesystems mark deletions) for
+   * each name only base has. Unlike RemoveCommon() it also keeps a directory whose own
+   * metadata changed, and compares content hashes and inode numbers exactly, so that
+   * the delta applied to base gives tree as it is; for the same reason every pair of
+   * directories is visited, as digests cover neither. A directory a ScanFilter left
+   * unread on either side is taken to hold nothing different.
+   */
+  static void WriteDelta(DirLevel *tree, DirLevel *base, std::string &path,
+                         SnapshotWriter &writer);
+
+  /**
+   * ApplyDelta - Static method to apply a delta written by WriteDelta() to a tree
+   *
+   * @param tree: Root of the tree to change (e.g. loaded from the delta's base)
+   * @param delta: Root of the delta, loaded with CreateFromTraverseFile(). Its storage
+   *               is taken over by tree, and it is left empty.
+   *
+   * Each of the delta's entries replaces the one of the same name in tree, or is
+   * added, and a whiteout removes it (and everything below it). A directory that
+   * replaces a directory keeps its contents, and the delta's entries below it are
+   * applied to them in turn. Only the directories the delta has are visited, each
+   * merged with its own in one pass, and the delta's new subtrees are linked in where
+   * they were loaded.
+   */
+  static void ApplyDelta(DirLevel *tree, DirLevel *delta);
+
+  /**
+   * CompareMany - Static method to compare any number of trees in one walk
+   *
+   * @param trees: Roots of the trees (live scans and snapshots alike)
+   * @param report: Called for each path where they disagree, in Traverse() order
+   *
+   * Walks the sorted entries of every tree's directory at a path together, once, so
+   * each tree is read a single time however many there are. Entries are the same if
+   * both are directories or SameFile() says so, comparing the fields every tree
+   * records. A path is reported when the trees holding its directory don't all have
+   * the same entry there; below a directory, only the trees that have it take part.
+   * Directories that two or more trees have are compared in turn, unless their
+   * digests all match. A directory a ScanFilter left unread (its contents unknown)
+   * takes no part below it. Neither tree is modified (their digests are computed).
+   */
+  static void CompareMany(std::span<DirLevel *const> trees,
+                          const AgreementReport &report);
+
+  /**
+   * Totals - Static method to total up every directory of a tree, bottom up
+   *
+   * @param dir_level: Directory level to total up
+   * @param path: Its path, with trailing '/' (modified during traversal)
+   * @param report: Called for each directory below dir_level and then for dir_level
+   *                itself, each after everything below it (as du lists them)
+   * @return: dir_level's totals
+   *
+   * One walk of the tree in memory, in Traverse() order of the directories, adding
+   * each directory's totals into its parent's as it is left.
+   */
+  static Rollup Totals(const DirLevel *dir_level, std::string &path,
+                       const RollupReport &report);
+
+  // Whether a ScanFilter left this directory unread (its contents are unknown)
+  bool Pruned() const { return pruned_; }
+
+  /**
+   * Fields - Metadata the entries of this directory's tree carry
+   *
+   * @return: EntryField bits: those the scan recorded, or those every record of the
+   *          snapshot had
+   */
+  unsigned Fields() const;
 
  private:
   /**
@@ -118,21 +442,272 @@ class DirLevel {
   void FullPath(std::string &path) const;
 
   /**
-   * AddEntry - Add a new entry to this directory's map
+   * Prune - Drop what a filter leaves out from the tree below this directory
+   *
+   * @param filter: The filter
+   * @param path: Path of this directory from the root, with trailing '/' (modified
+   *              during traversal, then restored)
+   * @param depth: Levels this directory is below the root
+   * @return: Whether anything was dropped
+   *
+   * Directories at the depth limit are emptied and marked as left unread.
+   */
+  bool Prune(const ScanFilter &filter, std::string &path, unsigned depth);
+
+  // This directory's entries, sorted by name
+  std::span<EntryInfo> Entries() const { return {entries_, count_}; }
+
+  /**
+   * Find - Look up an entry by name
    *
-   * @param entry: Directory entry from readdir
-   * @param file_stat: File statistics from fstatat
-   * @return: Pointer to the created EntryInfo
+   * @param name: Entry name
+   * @return: Pointer to the entry, or nullptr if there is none (binary search)
+   */
+  EntryInfo *Find(std::string_view name) const;
+
+  /**
+   * SetEntries - Replace this directory's entries with a sorted copy of the given ones
+   *
+   * @param arena: Arena to store the array in
+   * @param entries: Entries in any order; modified (sorted) in place
+   *
+   * Of several entries with the same name, the last one wins.
+   */
+  void SetEntries(Arena &arena, std::span<EntryInfo> entries);
+
+  /**
+   * Digest - The DirDigest of this directory's contents (see digest.h)
+   *
+   * @return: The digest, computed (for every subdirectory that lacks one too) and kept
+   *          on first use unless a snapshot supplied it
+   */
+  uint64_t Digest();
+
+  /**
+   * MergeCommon - Walk the sorted entries of two directories together
+   *
+   * @param dir1: First directory
+   * @param dir2: Second directory
+   * @param visit: Called as visit(info1, info2) for each name found in both; returns a
+   *               std::pair of bools saying whether to drop info1 and info2
+   *
+   * Entries found on one side only are kept. Throws std::runtime_error for a directory
+   * entry without its DirLevel.
+   */
+  template <class Visit>
+  static void MergeCommon(DirLevel *dir1, DirLevel *dir2, Visit visit);
+
+  /**
+   * ReadTree - Read the tree below this directory
+   *
+   * @param root_path: Path of the tree's root, to open files to hash by
+   * @param fddir: Open file descriptor for this directory (ownership transferred)
+   * @param options: Scan tunables
+   * @param previous: This directory in a previous scan to reuse, or nullptr
+   *
+   * Stores everything in the storage of the tree this directory belongs to. Throws
+   * std::runtime_error on any failure.
+   */
+  void ReadTree(const char *root_path, int fddir, const ScanOptions &options,
+                const DirLevel *previous);
+
+  // Point every subdirectory's parent link at this object (after a move)
+  void AdoptChildren();
+
+  /**
+   * Storage - The arenas of the tree this directory belongs to
    *
-   * Creates a new EntryInfo in the map and populates it with metadata.
+   * Walks up to the root, creating the storage if the root doesn't have any yet.
    */
-  EntryInfo *AddEntry(struct dirent *entry, struct stat *file_stat);
+  TreeStorage &Storage();
+
+  // Arena for additions made on one thread after the tree was built
+  Arena &MainArena();
+
+  // Bytes obtained for the tree's storage so far
+  size_t Footprint();
+
+  // A subdirectory found by ReadEntries
+  struct Subdir {
+    DirLevel *level;
+    std::shared_ptr<DirHandle> handle;  // Descriptor opened by an io_uring batch, if any
+    const DirLevel *previous;  // The same directory in the previous scan, if any
+    bool unchanged;            // Its mtime is the same as in the previous scan
+    dev_t dev;                 // Its device, if the scan keeps a rate per filesystem
+  };
+  using Subdirs = std::vector<Subdir>;
+
+  /**
+   * Previous - Look up an entry's directory in the previous scan
+   *
+   * @param previous: This directory in the previous scan, or nullptr
+   * @param info: A subdirectory's entry, with its current metadata
+   * @param ctx: State of the scan
+   * @param unchanged: Set to whether the subdirectory is unchanged since the scan
+   * @return: The subdirectory in the previous scan, or nullptr
+   */
+  static const DirLevel *Previous(const DirLevel *previous, const EntryInfo &info,
+                                  const ScanContext &ctx, bool *unchanged);
+
+  /**
+   * ReadNames - Read the names in a directory
+   *
+   * @param fddir: The directory (this one)
+   * @param options: Scan tunables
+   * @param arena: Arena to copy the names into
+   * @param added: Entries appended with their name and getdents64 type only
+   * @return: Number of getdents64 calls made
+   */
+  size_t ReadNames(int fddir, const ScanOptions &options, Arena &arena,
+                   std::vector<EntryInfo> &added) const;
+
+  /**
+   * ReadEntries - Read, stat and store this directory's own entries
+   *
+   * @param handle: This directory's open descriptor; reset afterwards if there are no
+   *                subdirectories, otherwise kept open or closed as the descriptor
+   *                budget allows
+   * @param ctx: State of the scan (options, descriptor budget)
+   * @param arena: Arena for the names, the entry array and the subdirectory levels
+   * @param subdirs: Filled with the new subdirectory levels in the order they were read
+   * @param previous: This directory in the previous scan, or nullptr
+   * @param unchanged: Whether this directory is unchanged since the previous scan
+   *
+   * Reads all names with getdents64 into a per-thread buffer of options.dirent_buffer
+   * bytes and stats them, so each directory is read in one pass before any descent.
+   * The names of an unchanged directory come from the previous scan instead (unless an
+   * entry turns out to be missing after all). With a hasher in ctx, regular files are
+   * submitted to it once stored, unless the previous scan has a hash for the same size
+   * and mtime.
+   */
+  void ReadEntries(std::shared_ptr<DirHandle> &handle, ScanContext &ctx, Arena &arena,
+                   Subdirs &subdirs, const DirLevel *previous, bool unchanged);
+
+  /**
+   * ReadDir - Read directory contents, optionally handing subdirectories to a pool
+   *
+   * @param handle: This directory's open descriptor, shared with subdirectory scans
+   * @param ctx: State of the scan (options, descriptor budget, pool)
+   * @param previous: This directory in the previous scan, or nullptr
+   * @param unchanged: Whether this directory is unchanged since the previous scan
+   *
+   * Reads this directory with ReadEntries, then its subdirectories. When ctx has a
+   * pool, this returns as soon as this directory's own entries are read and the
+   * subdirectories are read by pool tasks.
+   */
+  void ReadDir(std::shared_ptr<DirHandle> handle, ScanContext &ctx,
+               const DirLevel *previous = nullptr, bool unchanged = false);
+
+  /**
+   * ReadSubdir - Open this (non-root) directory if necessary, then read it
+   *
+   * @param parent: The parent directory's handle
+   * @param subdir: This directory as found by the parent's ReadEntries
+   * @param ctx: State of the scan
+   */
+  void ReadSubdir(std::shared_ptr<DirHandle> parent, Subdir subdir, ScanContext &ctx);
+
+  /**
+   * OpenFromHandle - Open this (non-root) directory relative to its parent
+   *
+   * @param parent: The parent directory's handle
+   * @return: New file descriptor for this directory
+   *
+   * If the parent's descriptor has been closed, opens relative to the nearest ancestor
+   * that is still open instead. Throws std::runtime_error if the directory can't be
+   * opened.
+   */
+  int OpenFromHandle(const DirHandle &parent) const;
+
+  /**
+   * SetMetadata - Fill in an entry's metadata from statx results
+   *
+   * @param info: Entry whose name and getdents64 type (possibly DT_UNKNOWN) are set
+   * @param file_stat: File statistics from statx (only type, size, mtime and inode
+   *                   number are used)
+   * @param fields: EntryField bits to record (requested from statx); the others are
+   *                left as they are
+   */
+  static void SetMetadata(EntryInfo *info, const struct statx &file_stat,
+                          unsigned fields);
+
+  friend class DirStream;
+  friend class TreeBuilder;
+  friend class TreeWatcher;
 
   // Member variables
-  std::map<std::string, EntryInfo, std::less<void>>
-      entries_;            // Map of entries (automatically sorted by name)
-  const DirLevel *prev_;   // Pointer to parent directory (nullptr for root)
-  const EntryInfo *info_;  // Pointer to this dir's entry in parent (nullptr for root)
+  EntryInfo *entries_ = nullptr;  // Entries sorted by name (in the tree's arena)
+  size_t count_ = 0;              // Number of entries
+  uint64_t digest_ = 0;           // DirDigest of the entries (0 until known)
+  const DirLevel *prev_;          // Pointer to parent directory (nullptr for root)
+  std::string_view name_;         // This directory's name in its parent (empty for root)
+  std::unique_ptr<TreeStorage> storage_;  // Arenas holding the tree (root only)
+  bool pruned_ = false;  // Left unread by a ScanFilter (its contents are unknown)
+  uint8_t fields_ = kDefaultFields;  // EntryField bits of the tree's entries (root only)
+};
+
+/**
+ * DirStream - Reads a directory tree one directory at a time, in Traverse() order
+ *
+ * Entries are handed out one by one in the order Traverse() would print them; a
+ * directory is read when the caller moves past its own entry. Only the directories on
+ * the path from the root to the current one are held in memory, so memory use is
+ * bounded by the depth of the tree times the size of its largest directories.
+ */
+class DirStream {
+ public:
+  /**
+   * Constructor - Open the starting directory and read its entries
+   *
+   * @param start_path: Path to the directory to read
+   * @param options: Scan tunables (options.threads is ignored; all reading happens on
+   *                 the calling thread)
+   *
+   * Throws std::runtime_error if the directory can't be read.
+   */
+  DirStream(const char *start_path, const ScanOptions &options);
+
+  ~DirStream();
+
+  DirStream(const DirStream &) = delete;
+  DirStream &operator=(const DirStream &) = delete;
+
+  /**
+   * Next - Advance to the next entry
+   *
+   * @return: The entry, valid until the next call, or nullptr after the last one
+   *
+   * Throws std::runtime_error if a directory can't be read.
+   */
+  const EntryInfo *Next();
+
+  /**
+   * Dir - Path of the directory holding the entry returned last
+   *
+   * @return: Path relative to the start, with trailing '/' (empty for the start itself)
+   */
+  const std::string &Dir() const { return dir_; }
+
+ private:
+  // A directory on the chain from the root to the current one
+  struct Frame {
+    DirLevel *level;
+    std::shared_ptr<DirHandle> handle;  // Base for opening subdirectories
+    size_t next;                        // Index of the next entry to return
+    size_t path_len;                    // Length of dir_ before this directory's name
+    const DirLevel *previous;           // The directory in the previous scan, if any
+  };
+
+  ScanOptions options_;
+  DirLevel root_;
+  std::unique_ptr<ScanContext> ctx_;  // Descriptor budget etc.
+  std::vector<Arena> arenas_;         // One per depth
+  std::unique_ptr<ContentHasher> hasher_;  // If hashing; waited for after each directory
+  std::unique_ptr<ScanGovernor> governor_;  // If the calls per filesystem are limited
+  std::vector<Frame> chain_;
+  DirLevel::Subdirs subdirs_;         // Scratch for ReadEntries
+  const EntryInfo *descend_ = nullptr;  // Directory to read on the next call
+  std::string dir_;
 };
 
 #endif  // DIR_LEVEL_H
@@ -0,0 +1,318 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dir_level.h"
+#include "snapshot_writer.h"
+#include "tool_options.h"
+#include "tree_generator.h"
+
+namespace {
+// Files holding the id of the tracepoint hit on entry to every system call
+constexpr const char *kSysEnterIds[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+};
+
+/**
+ * SyscallCounter - Counts the system calls made by this process and its threads
+ *
+ * Uses a perf event on the raw_syscalls:sys_enter tracepoint, inherited by threads
+ * started after it was opened (their counts are added in as they exit). Needs tracefs
+ * and permission to open tracepoint events; without them nothing is counted.
+ */
+class SyscallCounter {
+ public:
+  SyscallCounter() {
+    for (const char *path : kSysEnterIds) {
+      FILE *file = fopen(path, "r");
+      unsigned long long id;
+      if (!file) {
+        continue;
+      }
+      bool read = fscanf(file, "%llu", &id) == 1;
+      fclose(file);
+      if (!read) {
+        continue;
+      }
+      struct perf_event_attr attr = {};
+      attr.type = PERF_TYPE_TRACEPOINT;
+      attr.size = sizeof(attr);
+      attr.config = id;
+      attr.inherit = 1;
+      fd_ = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+      if (fd_ >= 0) {
+        return;
+      }
+    }
+  }
+
+  ~SyscallCounter() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  SyscallCounter(const SyscallCounter &) = delete;
+  SyscallCounter &operator=(const SyscallCounter &) = delete;
+
+  // System calls so far, or -1 if they can't be counted
+  int64_t Count() const {
+    uint64_t value;
+    if (fd_ < 0 || read(fd_, &value, sizeof(value)) != sizeof(value)) {
+      return -1;
+    }
+    return int64_t(value);
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+// Best run of a phase: its time, and the system calls made and peak RSS reached in it
+struct PhaseResult {
+  const char *name;
+  double seconds = -1;  // -1 until measured
+  int64_t syscalls = -1;
+  long peak_kib = -1;
+};
+
+// Start measuring the peak RSS afresh (where the kernel allows it)
+void ResetPeakRss() {
+  int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    if (write(fd, "5", 1) != 1) {
+      // Older kernels: the peak stays that of the whole run
+    }
+    close(fd);
+  }
+}
+
+// Peak RSS in KiB since the last ResetPeakRss(), or -1 if unknown
+long PeakRssKib() {
+  FILE *file = fopen("/proc/self/status", "r");
+  if (!file) {
+    return -1;
+  }
+  char line[256];
+  long kib = -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "VmHWM:", 6) == 0) {
+      kib = strtol(line + 6, nullptr, 10);
+      break;
+    }
+  }
+  fclose(file);
+  return kib;
+}
+
+// Run one phase and keep it in result if it is the fastest run so far
+template <typename Run>
+void Measure(const SyscallCounter &counter, PhaseResult *result, Run run) {
+  ResetPeakRss();
+  int64_t syscalls = counter.Count();
+  auto start = std::chrono::steady_clock::now();
+  run();
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  int64_t syscalls_after = counter.Count();
+  if (result->seconds < 0 || seconds < result->seconds) {
+    result->seconds = seconds;
+    result->syscalls = syscalls < 0 ? -1 : syscalls_after - syscalls;
+    result->peak_kib = PeakRssKib();
+  }
+}
+
+// Write a tree as a snapshot file
+void WriteSnapshot(const DirLevel &tree, const std::string &path,
+                   SnapshotWriter::Format format) {
+  FILE *out = fopen(path.c_str(), "w");
+  if (!out) {
+    throw std::runtime_error("Cannot create " + path + ": " + strerror(errno));
+  }
+  try {
+    SnapshotWriter writer(out, format);
+    std::string basedir;
+    DirLevel::Write(&tree, basedir, writer);
+    writer.Finish();
+  } catch (...) {
+    fclose(out);
+    throw;
+  }
+  if (fclose(out) != 0) {
+    throw std::runtime_error("Cannot write " + path + ": " + strerror(errno));
+  }
+}
+
+/**
+ * BenchShape - Build a tree of one shape and measure every phase on it
+ *
+ * @param work: Directory to build the tree and its snapshots in
+ * @param shape: The shape
+ * @param options: Scan options for the scan and thread count for the other phases
+ * @param runs: Times to run each phase (the fastest run is reported)
+ * @param keep: Leave the tree and snapshots behind
+ */
+void BenchShape(const std::string &work, const TreeShape &shape,
+                const ScanOptions &options, unsigned runs, bool keep) {
+  std::string top = work + "/" + shape.name;
+  std::string text_path = top + ".txt";
+  std::string binary_path = top + ".bin";
+  if (mkdir(top.c_str(), 0755) != 0) {
+    throw std::runtime_error("Cannot create " + top + ": " + strerror(errno));
+  }
+  auto start = std::chrono::steady_clock::now();
+  size_t created = GenerateTree(top, shape);
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  fprintf(stderr, "%s: generated %zu entries in %.2f s\n", shape.name.c_str(), created,
+          seconds);
+
+  SyscallCounter counter;
+  PhaseResult results[] = {{"scan"},       {"write-text"},   {"write-binary"},
+                           {"parse-text"}, {"parse-binary"}, {"compare"}};
+  size_t entries = created;
+  for (unsigned run = 0; run < runs; ++run) {
+    DirLevel scanned, parsed;
+    Measure(counter, &results[0],
+            [&] { scanned = DirLevel::CreateFromPath(top.c_str(), options); });
+    Measure(counter, &results[1], [&] {
+      WriteSnapshot(scanned, text_path, SnapshotWriter::Format::kText);
+    });
+    Measure(counter, &results[2], [&] {
+      WriteSnapshot(scanned, binary_path, SnapshotWriter::Format::kBinary);
+    });
+    Measure(counter, &results[3], [&] {
+      parsed = DirLevel::CreateFromTraverseFile(text_path.c_str(), options.threads);
+    });
+    Measure(counter, &results[4], [&] {
+      parsed = DirLevel::CreateFromTraverseFile(binary_path.c_str(), options.threads);
+    });
+    Measure(counter, &results[5],
+            [&] { DirLevel::RemoveCommon(&scanned, &parsed, options.threads); });
+  }
+
+  for (const PhaseResult &result : results) {
+    char syscalls[32] = "-";
+    if (result.syscalls >= 0 && entries > 0) {
+      snprintf(syscalls, sizeof(syscalls), "%.2f",
+               double(result.syscalls) / double(entries));
+    }
+    char peak[32] = "-";
+    if (result.peak_kib >= 0) {
+      snprintf(peak, sizeof(peak), "%.1f", double(result.peak_kib) / 1024);
+    }
+    printf("%-8s %-13s %9zu %9.4f %12.0f %11s %9s\n", shape.name.c_str(), result.name,
+           entries, result.seconds,
+           result.seconds > 0 ? double(entries) / result.seconds : 0.0, syscalls, peak);
+  }
+  fflush(stdout);
+
+  if (!keep) {
+    RemoveTree(top);
+    unlink(text_path.c_str());
+    unlink(binary_path.c_str());
+  }
+}
+}  // namespace
+
+/**
+ * main - Program entry point
+ *
+ * Usage: file-bench [-k] [-n entries] [-r runs] [-t shapes] [scan options] [directory]
+ *
+ * Builds a synthetic tree of each shape (see StandardShapes) in a new directory below
+ * the given one (default $TMPDIR or /tmp), then times each phase on it: scanning it,
+ * writing it as a text and a binary snapshot, parsing each snapshot back, and comparing
+ * the scanned tree with the parsed one. For the fastest of the runs of each phase it
+ * prints entries per second, system calls per entry and peak RSS. The tree is freshly
+ * written, so scans are of a warm cache. The work directory is removed afterwards
+ * unless -k is given.
+ */
+int main(int argc, char *argv[]) {
+  ScanOptions options;
+  size_t entries = 100000;
+  unsigned runs = 3;
+  std::string only;
+  bool keep = false;
+  int opt;
+  bool usage = false;
+  while (!usage && (opt = getopt(argc, argv, SCAN_OPTION_CHARS "kn:r:t:")) != -1) {
+    if (opt == 'k') {
+      keep = true;
+    } else if (opt == 'n') {
+      long count = atol(optarg);
+      usage = count < 1;
+      entries = size_t(count);
+    } else if (opt == 'r') {
+      int count = atoi(optarg);
+      usage = count < 1;
+      runs = unsigned(count);
+    } else if (opt == 't') {
+      only = std::string(",") + optarg + ",";
+    } else {
+      usage = !ParseScanOption(opt, optarg, &options);
+    }
+  }
+  if (usage) {
+    fprintf(stderr,
+            "Usage: %s [-k] [-n entries] [-r runs] [-t shapes] [scan options] "
+            "[directory]\n"
+            "  -k          Keep the generated trees and snapshots\n"
+            "  -n entries  Entries in each tree (default 100000)\n"
+            "  -r runs     Runs of each phase, the fastest reported (default 3)\n"
+            "  -t shapes   Comma-separated shapes to measure (default all: wide,deep,"
+            "tiny,long,unicode)\n%s",
+            argv[0], kScanOptionsHelp);
+    return 1;
+  }
+
+  // Make the work directory
+  const char *tmpdir = getenv("TMPDIR");
+  std::string parent = optind < argc ? argv[optind] : tmpdir && *tmpdir ? tmpdir : "/tmp";
+  std::string work = parent + "/file-bench.XXXXXX";
+  if (!mkdtemp(work.data())) {
+    fprintf(stderr, "Error: Cannot create a directory in %s: %s\n", parent.c_str(),
+            strerror(errno));
+    return 1;
+  }
+
+  printf("%-8s %-13s %9s %9s %12s %11s %9s\n", "shape", "phase", "entries", "seconds",
+         "entries/s", "syscalls/e", "peak MiB");
+  fflush(stdout);
+  int status = 0;
+  try {
+    for (const TreeShape &shape : StandardShapes(entries)) {
+      if (only.empty() || only.find("," + shape.name + ",") != std::string::npos) {
+        BenchShape(work, shape, options, runs, keep);
+      }
+    }
+  } catch (const std::exception &e) {
+    fflush(stdout);
+    fprintf(stderr, "Error: %s\n", e.what());
+    status = 1;
+  }
+  if (!keep) {
+    try {
+      RemoveTree(work);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error: %s\n", e.what());
+      status = 1;
+    }
+  } else {
+    fprintf(stderr, "Trees kept in %s\n", work.c_str());
+  }
+  return status;
+}
@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "dir_level.h"
+#include "snapshot_writer.h"
+
+/**
+ * main - Program entry point
+ *
+ * Usage: file-compact [-B] [-z] [-i index] [-j threads] base [delta...]
+ *
+ * Loads the snapshot base, applies each delta written by file-comparer -D to it in
+ * turn (see DirLevel::ApplyDelta), the oldest first, and writes the result to stdout
+ * as a full snapshot: the one a scan of the tree would have given when the last delta
+ * was written. The snapshots may be in either format and compressed; without deltas
+ * the base is just rewritten, e.g. in another format.
+ * With -B the result is written in the binary format, and with -z compressed. With -i
+ * its index is written to the given file too (see file-lister -i). With -j the large
+ * snapshots are loaded (and decompressed) on that many threads.
+ */
+int main(int argc, char *argv[]) {
+  SnapshotWriter::Format format = SnapshotWriter::Format::kText;
+  bool compress = false;
+  const char *index_file = nullptr;
+  unsigned threads = 1;
+  int opt;
+  bool usage = false;
+  while (!usage && (opt = getopt(argc, argv, "Bzi:j:")) != -1) {
+    if (opt == 'B') {
+      format = SnapshotWriter::Format::kBinary;
+    } else if (opt == 'z') {
+      compress = true;
+    } else if (opt == 'i') {
+      index_file = optarg;
+    } else if (opt == 'j' && atoi(optarg) >= 1) {
+      threads = unsigned(atoi(optarg));
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || argc - optind < 1) {
+    fprintf(stderr,
+            "Usage: %s [-B] [-z] [-i index] [-j threads] base [delta...]\n"
+            "  -B          Write a binary snapshot instead of text\n"
+            "  -z          Compress the snapshot\n"
+            "  -i FILE     Also write an index of the snapshot to FILE\n"
+            "  -j threads  Load the snapshots with this many threads\n",
+            argv[0]);
+    return 1;
+  }
+
+  DirLevel root;
+  try {
+    root = DirLevel::CreateFromTraverseFile(argv[optind], threads);
+    for (int i = optind + 1; i < argc; ++i) {
+      DirLevel delta = DirLevel::CreateFromTraverseFile(argv[i], threads);
+      DirLevel::ApplyDelta(&root, &delta);
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error loading snapshots: %s\n", e.what());
+    return 1;
+  }
+
+  SnapshotWriter writer(stdout, format);
+  writer.SetFields(root.Fields());
+  std::unique_ptr<FILE, int (*)(FILE *)> index(nullptr, fclose);
+  if (index_file) {
+    index.reset(fopen(index_file, "w"));
+    if (!index) {
+      fprintf(stderr, "Error: Cannot create %s: %s\n", index_file, strerror(errno));
+      return 1;
+    }
+    writer.WriteIndex(index.get());
+  }
+  if (compress) {
+    writer.Compress(std::max(threads, 2u));
+  }
+  try {
+    std::string basedir;
+    DirLevel::Write(&root, basedir, writer);
+    writer.Finish();
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -1,48 +1,285 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include "dir_level.h"
+#include "rollup.h"
+#include "snapshot_writer.h"
+#include "stream_compare.h"
+#include "tool_options.h"
+
+namespace {
+/**
+ * CompareInputs - Compare any number of trees and snapshots, printing where they
+ * disagree (see DirLevel::CompareMany)
+ *
+ * @param count: Number of inputs
+ * @param inputs: Their paths: a directory is scanned, anything else loaded as a
+ *                snapshot
+ * @param options: Scan tunables
+ * @return: Exit status
+ */
+int CompareInputs(size_t count, char *const *inputs, ScanOptions options) {
+  // Snapshots first, so that the scans record no more fields than they all have
+  std::vector<DirLevel> trees(count);
+  std::vector<bool> live(count);
+  for (size_t i = 0; i < count; ++i) {
+    struct stat input_stat;
+    live[i] = stat(inputs[i], &input_stat) == 0 && S_ISDIR(input_stat.st_mode);
+  }
+  try {
+    for (size_t i = 0; i < count; ++i) {
+      if (!live[i]) {
+        trees[i] =
+            DirLevel::CreateFromTraverseFile(inputs[i], options.threads, &options.filter);
+        options.fields &= trees[i].Fields();
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (live[i]) {
+        trees[i] = DirLevel::CreateFromPath(inputs[i], options);
+      }
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error initializing: %s\n", e.what());
+    return 1;
+  }
+
+  std::vector<DirLevel *> roots;
+  printf("Inputs: ----------------------------------------\n");
+  for (size_t i = 0; i < count; ++i) {
+    roots.push_back(&trees[i]);
+    printf("%zu %s\n", i + 1, inputs[i]);
+  }
+  printf("Differences: ----------------------------------------\n");
+  try {
+    DirLevel::CompareMany(roots, [](const std::string &path,
+                                    std::span<const unsigned> groups) {
+      fwrite(path.data(), 1, path.size(), stdout);
+      putchar('\0');
+      for (unsigned group : groups) {
+        printf(" %u", group);
+      }
+      putchar('\n');
+    });
+  } catch (const std::exception &e) {
+    fflush(stdout);
+    fprintf(stderr, "Error comparing: %s\n", e.what());
+    return 1;
+  }
+  if (fflush(stdout) != 0) {
+    fprintf(stderr, "Error printing: %s\n", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+}  // namespace
 
 /**
  * main - Program entry point
  *
- * Usage: file-comparer [directory_path] [input_file]
+ * Usage: file-comparer [-s | -m | -D [-B] [-z]] [-u] [scan options] [directory_path]
+ *                      [input_file] [delta...]
+ *        file-comparer -n [scan options] input...
  *
- * Recursively reads directory tree and compares all entries with input file.
+ * Recursively reads directory tree and compares all entries with input file, with each
+ * delta given after it applied in turn (see DirLevel::ApplyDelta).
+ * The scan options (see tool_options.h) change how the tree is read, not the output;
+ * entries the scan leaves out (-e, -d, -x) are left out of the input file too.
+ * With -s both are compared in one streaming pass instead of being loaded into memory
+ * first; the input file must then be in the order file-lister writes.
+ * With -u each side's differences are summed up per directory instead of being listed,
+ * in the report format of file-lister -u (see rollup.h).
+ * With -m entries that moved are recognised (see DirLevel::RemoveMoved) and listed
+ * afterwards, one line each as "from\0 to\0 type", instead of as differences on both
+ * sides; what changed inside a moved directory is still listed. The scan records inode
+ * numbers to match them by (-N), so the input file should have them too, or content
+ * hashes (-H) for matching files by; unchanged directories are recognised anyway.
+ * The scan records only the fields (-f, -N) the input file has as well.
+ * With -D the differences are written to stdout as a delta that turns the input file
+ * into a snapshot of the tree (see DirLevel::WriteDelta), in the binary format with -B
+ * and compressed with -z; file-compact folds deltas into their base. A delta describes
+ * the whole tree, so it can't be written of a scan that leaves anything out.
+ * With -n any number of inputs, directories to scan and snapshots alike, are compared
+ * in one walk of them all (see DirLevel::CompareMany). The inputs are listed first,
+ * numbered from 1, then each path they disagree about as "path\0" and, for each input,
+ * ' ' and the number of the group of inputs whose entries there are the same as its
+ * own (numbered in order of their first input), or 0 if it has none. Below a
+ * directory some inputs lack, only the others are compared; directories' own
+ * metadata isn't.
  */
 int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s [directory_path] [input_file]\n", argv[0]);
+  ScanOptions options;
+  bool stream = false;
+  bool rollups = false;
+  bool moves = false;
+  bool delta = false;
+  bool many = false;
+  SnapshotWriter::Format format = SnapshotWriter::Format::kText;
+  bool compress = false;
+  int opt;
+  bool usage = false;
+  while (!usage && (opt = getopt(argc, argv, SCAN_OPTION_CHARS "BDmnsuz")) != -1) {
+    if (opt == 's') {
+      stream = true;
+    } else if (opt == 'u') {
+      rollups = true;
+    } else if (opt == 'm') {
+      moves = true;
+    } else if (opt == 'n') {
+      many = true;
+    } else if (opt == 'D') {
+      delta = true;
+    } else if (opt == 'B') {
+      format = SnapshotWriter::Format::kBinary;
+    } else if (opt == 'z') {
+      compress = true;
+    } else {
+      usage = !ParseScanOption(opt, optarg, &options);
+    }
+  }
+  bool binary = format == SnapshotWriter::Format::kBinary;
+  if (usage || argc - optind < 2 || (stream && (rollups || moves || argc - optind > 2)) ||
+      (delta && (stream || moves || rollups || options.filter.Active())) ||
+      ((binary || compress) && !delta) ||
+      (many && (stream || moves || rollups || delta))) {
+    fprintf(stderr,
+            "Usage: %s [-s | -m | -D [-B] [-z]] [-u] [scan options] [directory_path] "
+            "[input_file] [delta...]\n"
+            "       %s -n [scan options] input...\n"
+            "  -s          Compare in one streaming pass (needs file-lister order)\n"
+            "  -m          List moved entries as moves rather than differences\n"
+            "  -D          Write the differences as a delta of input_file\n"
+            "  -B          With -D, write a binary delta instead of text\n"
+            "  -z          With -D, compress the delta\n"
+            "  -u          Print per-directory totals of the differences\n"
+            "  -n          Compare all the inputs (directories or snapshots) at once\n%s",
+            argv[0], argv[0], kScanOptionsHelp);
     return 1;
   }
+  if (many) {
+    return CompareInputs(size_t(argc - optind), argv + optind, options);
+  }
+
   // Determine starting directory: argument or current directory
-  const char *start_path = argv[1];
-  const char *input_file = argv[2];
+  const char *start_path = argv[optind];
+  const char *input_file = argv[optind + 1];
+
+  if (stream) {
+    try {
+      StreamCompare(start_path, input_file, options);
+    } catch (const std::exception &e) {
+      fflush(stdout);
+      fprintf(stderr, "Error comparing: %s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
 
   DirLevel root, from_file;
+  if (moves) {
+    options.fields |= kFieldInode;
+  }
   try {
-    // Create and initialize directory tree from starting path
-    root = DirLevel::CreateFromPath(start_path);
-    // Create and initialize directory tree from input file
-    from_file = DirLevel::CreateFromTraverseFile(input_file);
+    // Create and initialize directory tree from input file, leaving out what the scan
+    // does
+    from_file =
+        DirLevel::CreateFromTraverseFile(input_file, options.threads, &options.filter);
+    for (int i = optind + 2; i < argc; ++i) {
+      DirLevel changes =
+          DirLevel::CreateFromTraverseFile(argv[i], options.threads, &options.filter);
+      DirLevel::ApplyDelta(&from_file, &changes);
+    }
+    // Then from starting path, recording no more than the file has, as nothing else
+    // could be compared
+    options.fields &= from_file.Fields();
+    root = DirLevel::CreateFromPath(start_path, options);
   } catch (const std::exception &e) {
     fprintf(stderr, "Error initializing: %s\n", e.what());
     return 1;
   }
 
+  if (delta) {
+    try {
+      SnapshotWriter writer(stdout, format);
+      writer.SetFields(root.Fields());
+      if (compress) {
+        writer.Compress(std::max(options.threads, 2u));
+      }
+      std::string basedir;
+      DirLevel::WriteDelta(&root, &from_file, basedir, writer);
+      writer.Finish();
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error writing delta: %s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
+  struct Move {
+    std::string from, to;
+    int type;
+  };
+  std::vector<Move> moved;
+  if (moves) {
+    // While the trees are whole, a path only one of them has is a real difference
+    try {
+      auto record = [&moved](const std::string &from, const std::string &to,
+                             const EntryInfo &info) {
+        moved.push_back(Move{from, to, info.type});
+      };
+      DirLevel::RemoveMoved(&root, &from_file, record);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error finding moves: %s\n", e.what());
+      return 1;
+    }
+  }
   try {
-    DirLevel::RemoveCommon(&root, &from_file);
+    DirLevel::RemoveCommon(&root, &from_file, options.threads);
   } catch (const std::exception &e) {
     fprintf(stderr, "Error removing common: %s\n", e.what());
     return 1;
   }
   // Traverse and print the complete directory tree
   std::string basedir1, basedir2;
-  printf("From Path: ----------------------------------------\n");
-  DirLevel::Traverse(&root, basedir1);
-  printf("From File: ----------------------------------------\n");
-  DirLevel::Traverse(&from_file, basedir2);
+  try {
+    auto print = [](const std::string &path, const Rollup &rollup) {
+      WriteRollup(stdout, path, rollup);
+    };
+    printf("From Path: ----------------------------------------\n");
+    if (rollups) {
+      DirLevel::Totals(&root, basedir1, print);
+    } else {
+      DirLevel::Traverse(&root, basedir1);
+    }
+    printf("From File: ----------------------------------------\n");
+    if (rollups) {
+      DirLevel::Totals(&from_file, basedir2, print);
+    } else {
+      DirLevel::Traverse(&from_file, basedir2);
+    }
+    if (moves) {
+      printf("Moved: --------------------------------------------\n");
+      for (const Move &move : moved) {
+        fwrite(move.from.data(), 1, move.from.size(), stdout);
+        putchar('\0');
+        putchar(' ');
+        fwrite(move.to.data(), 1, move.to.size(), stdout);
+        printf("%c %d\n", 0, move.type);
+      }
+    }
+  } catch (const std::exception &e) {
+    fflush(stdout);
+    fprintf(stderr, "Error printing: %s\n", e.what());
+    return 1;
+  }
 
   return 0;
 }
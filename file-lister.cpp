@@ -1,32 +1,253 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 #include "dir_level.h"
+#include "rollup.h"
+#include "scan_stats.h"
+#include "snapshot_writer.h"
+#include "tool_options.h"
+
+namespace {
+/**
+ * Summarize - Stop the progress line and write the JSON summary of a finished scan
+ *
+ * @param stats: The scan's counters, or nullptr if none were kept
+ * @param summary_file: File to write the summary to ("-" = stderr), or nullptr
+ * @return: Exit status (1 if the summary couldn't be written)
+ */
+int Summarize(ScanStats *stats, const char *summary_file) {
+  if (!stats) {
+    return 0;
+  }
+  stats->StopProgress();
+  if (!summary_file) {
+    return 0;
+  }
+  bool to_stderr = strcmp(summary_file, "-") == 0;
+  FILE *out = to_stderr ? stderr : fopen(summary_file, "w");
+  if (!out) {
+    fprintf(stderr, "Error: Cannot create %s: %s\n", summary_file, strerror(errno));
+    return 1;
+  }
+  stats->WriteJson(out);
+  if (to_stderr ? fflush(out) != 0 : fclose(out) != 0) {
+    fprintf(stderr, "Error: Cannot write %s: %s\n", summary_file, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * PrintRollups - Print the du-style report of a tree (see rollup.h) to stdout
+ *
+ * @param start_path: Path to the directory to read
+ * @param options: Scan tunables
+ * @param stream: Total up the directories as they are read (see DirStream) instead of
+ *                building the tree first
+ *
+ * Throws std::runtime_error on any failure.
+ */
+void PrintRollups(const char *start_path, const ScanOptions &options, bool stream) {
+  auto print = [](const std::string &path, const Rollup &rollup) {
+    WriteRollup(stdout, path, rollup);
+  };
+  if (stream) {
+    DirStream dir_stream(start_path, options);
+    RollupBuilder builder(print);
+    while (const EntryInfo *info = dir_stream.Next()) {
+      builder.Add(dir_stream.Dir(), *info);
+    }
+    builder.Finish();
+  } else {
+    DirLevel root = DirLevel::CreateFromPath(start_path, options);
+    std::string basedir;
+    DirLevel::Totals(&root, basedir, print);
+  }
+  if (fflush(stdout) != 0) {
+    throw std::runtime_error(std::string("Cannot write report: ") + strerror(errno));
+  }
+}
+}  // namespace
 
 /**
  * main - Program entry point
  *
- * Usage: file-lister [directory_path]
+ * Usage: file-lister [-s] [-B | -u] [-z] [-i index] [-p snapshot [-P]] [-v]
+ *                    [-S summary] [scan options] [directory_path]
  *
  * If no path is provided, lists current directory "."
  * Recursively reads directory tree and outputs all entries with metadata.
+ * The scan options (see tool_options.h) change how the tree is read, not the output,
+ * except that with -H each regular file's line also carries a hash of its contents,
+ * with -N each line an inode number, and -f chooses which of the size and mtime are
+ * recorded (those left out are never stat'ed for).
+ * With -s the tree is printed while it is read instead of being built in memory first.
+ * With -B the listing is written in the binary snapshot format (see snapshot_writer.h).
+ * With -z it is compressed, in frames (see compressed_file.h) compressed on threads of
+ * their own while the tree is written; every tool reads such snapshots directly.
+ * With -u each directory's total size, file and directory counts and newest mtime are
+ * printed instead, du-style (see rollup.h).
+ * With -i a sparse index of the listing is written to the given file as well, for
+ * file-query to look paths up in it (see snapshot_index.h); stdout must then be a file.
+ * With -p the scan is incremental: directories unchanged since the given snapshot of the
+ * same tree aren't read again, only their entries stat'ed (see PreviousScan); -P also
+ * takes their files' metadata from the snapshot. The snapshot's own mtime must be the
+ * time it was written, and mtimes must be recorded.
+ * With -v a progress line is printed to stderr every second, and with -S the scan's
+ * counters and call latencies (see ScanStats) are written as JSON to the given file
+ * ("-" for stderr) once it is done.
  */
 int main(int argc, char *argv[]) {
+  ScanOptions options;
+  bool stream = false;
+  SnapshotWriter::Format format = SnapshotWriter::Format::kText;
+  const char *previous_file = nullptr;
+  PreviousScan previous;
+  bool progress = false;
+  const char *summary_file = nullptr;
+  bool rollups = false;
+  const char *index_file = nullptr;
+  bool compress = false;
+  int opt;
+  bool usage = false;
+  while (!usage && (opt = getopt(argc, argv, SCAN_OPTION_CHARS "BsPS:i:p:uvz")) != -1) {
+    if (opt == 's') {
+      stream = true;
+    } else if (opt == 'B') {
+      format = SnapshotWriter::Format::kBinary;
+    } else if (opt == 'u') {
+      rollups = true;
+    } else if (opt == 'i') {
+      index_file = optarg;
+    } else if (opt == 'p') {
+      previous_file = optarg;
+    } else if (opt == 'P') {
+      previous.trust = true;
+    } else if (opt == 'v') {
+      progress = true;
+    } else if (opt == 'S') {
+      summary_file = optarg;
+    } else if (opt == 'z') {
+      compress = true;
+    } else {
+      usage = !ParseScanOption(opt, optarg, &options);
+    }
+  }
+  bool binary = format == SnapshotWriter::Format::kBinary;
+  if (usage || (rollups && (binary || index_file || compress)) ||
+      (previous_file && !(options.fields & kFieldMtime))) {
+    fprintf(stderr,
+            "Usage: %s [-s] [-B | -u] [-z] [-i index] [-p snapshot [-P]] [-v] "
+            "[-S summary] [scan options] [directory_path]\n"
+            "  -s          Print each directory as it is read (single thread)\n"
+            "  -B          Write a binary snapshot instead of text\n"
+            "  -z          Compress the snapshot (gzip -d can read it)\n"
+            "  -u          Print each directory's totals (bytes, files, directories, "
+            "newest mtime)\n"
+            "  -i FILE     Also write an index of the listing to FILE\n"
+            "  -p FILE     Skip rereading directories unchanged since snapshot FILE\n"
+            "  -P          With -p, also reuse their files' metadata (no stat)\n"
+            "  -v          Print a progress line to stderr every second\n"
+            "  -S FILE     Write a JSON summary of the scan to FILE (- for stderr)\n%s",
+            argv[0], kScanOptionsHelp);
+    return 1;
+  }
+
+  // Load the previous snapshot for an incremental scan
+  DirLevel previous_tree;
+  if (previous_file) {
+    struct stat file_stat;
+    try {
+      previous_tree = DirLevel::CreateFromTraverseFile(previous_file, options.threads);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error loading previous snapshot: %s\n", e.what());
+      return 1;
+    }
+    if (stat(previous_file, &file_stat) != 0) {
+      fprintf(stderr, "Error: Cannot stat %s: %s\n", previous_file, strerror(errno));
+      return 1;
+    }
+    previous.tree = &previous_tree;
+    previous.taken = file_stat.st_mtim;
+    options.previous = &previous;
+  }
+
   // Determine starting directory: argument or current directory
-  const char *start_path = (argc > 1) ? argv[1] : ".";
+  const char *start_path = (optind < argc) ? argv[optind] : ".";
+
+  // Keep counters for the progress line and summary
+  std::unique_ptr<ScanStats> stats;
+  if (progress || summary_file) {
+    stats = std::make_unique<ScanStats>();
+    options.stats = stats.get();
+    if (progress) {
+      stats->StartProgress(stderr, 1000);
+    }
+  }
+
+  if (rollups) {
+    try {
+      PrintRollups(start_path, options, stream);
+    } catch (const std::exception &e) {
+      fflush(stdout);
+      fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+    return Summarize(stats.get(), summary_file);
+  }
+
+  SnapshotWriter writer(stdout, format, options.stats);
+  writer.SetFields(options.fields);
+  if (compress) {
+    writer.Compress(std::max(options.threads, 2u));
+  }
+  std::unique_ptr<FILE, int (*)(FILE *)> index(nullptr, fclose);
+  if (index_file) {
+    index.reset(fopen(index_file, "w"));
+    if (!index) {
+      fprintf(stderr, "Error: Cannot create %s: %s\n", index_file, strerror(errno));
+      return 1;
+    }
+    writer.WriteIndex(index.get());
+  }
+  if (stream) {
+    try {
+      DirLevel::StreamFromPath(start_path, options, writer);
+      writer.Finish();
+    } catch (const std::exception &e) {
+      fflush(stdout);
+      fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+    return Summarize(stats.get(), summary_file);
+  }
 
   DirLevel root;
   try {
     // Create and initialize directory tree from starting path
-    root = DirLevel::CreateFromPath(start_path);
+    root = DirLevel::CreateFromPath(start_path, options);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+  // Write the complete directory tree
+  try {
+    std::string basedir;
+    DirLevel::Write(&root, basedir, writer);
+    writer.Finish();
   } catch (const std::exception &e) {
     fprintf(stderr, "Error: %s\n", e.what());
     return 1;
   }
-  // Traverse and print the complete directory tree
-  std::string basedir;
-  DirLevel::Traverse(&root, basedir);
 
-  return 0;
+  return Summarize(stats.get(), summary_file);
 }
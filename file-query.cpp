@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "snapshot_index.h"
+#include "snapshot_writer.h"
+
+namespace {
+/**
+ * Print - Write a snapshot's record as a line of a text listing
+ *
+ * @param record: The record
+ * @param writer: Text writer to add the line to
+ */
+void Print(const TraverseRecord &record, SnapshotWriter &writer) {
+  writer.SetFields(record.fields);
+  EntryInfo info{record.type, record.size, record.mtime, record.name, nullptr,
+                 record.hash, record.ino};
+  writer.Add(record.path.substr(0, record.path.size() - record.name.size()), info);
+}
+}  // namespace
+
+/**
+ * main - Program entry point
+ *
+ * Usage: file-query [-i index] [-l] snapshot path...
+ *
+ * Looks up each path (relative to the snapshot's root, as in the listing) in a snapshot
+ * written by file-lister -i, through its index (snapshot.idx unless -i names another),
+ * and prints its line as file-lister would. With -l everything below it is printed too;
+ * "." is the whole tree. Only the parts of the snapshot near each path are read.
+ * Paths not in the snapshot are reported on stderr, and the exit status is 1 if there
+ * were any.
+ */
+int main(int argc, char *argv[]) {
+  const char *index_file = nullptr;
+  bool list = false;
+  int opt;
+  bool usage = false;
+  while (!usage && (opt = getopt(argc, argv, "i:l")) != -1) {
+    if (opt == 'i') {
+      index_file = optarg;
+    } else if (opt == 'l') {
+      list = true;
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || argc - optind < 2) {
+    fprintf(stderr,
+            "Usage: %s [-i index] [-l] snapshot path...\n"
+            "  -i FILE     Index of the snapshot (default: snapshot.idx)\n"
+            "  -l          Also print everything below each path\n",
+            argv[0]);
+    return 1;
+  }
+  const char *snapshot = argv[optind++];
+  std::string default_index = std::string(snapshot) + ".idx";
+  if (!index_file) {
+    index_file = default_index.c_str();
+  }
+
+  int status = 0;
+  try {
+    SnapshotIndex index(snapshot, index_file);
+    SnapshotWriter writer(stdout, SnapshotWriter::Format::kText);
+    for (; optind < argc; ++optind) {
+      std::string_view path = argv[optind];
+      while (path.size() > 1 && path.back() == '/') {
+        path.remove_suffix(1);
+      }
+      if (path == ".") {
+        path = "";  // The root, which has no record of its own
+      }
+      size_t found = 0;
+      if (list) {
+        found = index.List(path, [&writer](const TraverseRecord &record) {
+          Print(record, writer);
+        });
+      } else {
+        TraverseRecord record;
+        if (!path.empty() && index.Find(path, &record)) {
+          Print(record, writer);
+          found = 1;
+        }
+      }
+      if (!found && !(list && path.empty())) {
+        // Keep the output in order with the message
+        writer.Flush();
+        fflush(stdout);
+        fprintf(stderr, "%s: not in %s\n", argv[optind], snapshot);
+        status = 1;
+      }
+    }
+    writer.Finish();
+  } catch (const std::exception &e) {
+    fflush(stdout);
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+  return status;
+}
@@ -0,0 +1,197 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dir_level.h"
+#include "shard_plan.h"
+#include "snapshot_writer.h"
+#include "traverse_reader.h"
+
+namespace {
+/**
+ * WritePlan - Balance the top-level entries of a snapshot over shards
+ *
+ * @param count: Number of shards
+ * @param filename: The snapshot, e.g. the last scan of the tree
+ * @param threads: Threads to decompress it on
+ *
+ * Each of the root's entries weighs as many entries as its subtree has, itself
+ * included. Writes the plan to stdout and each shard's weight to stderr.
+ */
+void WritePlan(unsigned count, const char *filename, unsigned threads) {
+  TraverseReader reader(filename, threads);
+  TraverseRecord record;
+  std::vector<std::pair<std::string, uint64_t>> weights;
+  while (reader.Next(&record)) {
+    std::string_view top = record.path.substr(0, record.path.find('/'));
+    if (weights.empty() || weights.back().first != top) {
+      weights.emplace_back(std::string(top), 0);
+    }
+    ++weights.back().second;
+  }
+
+  ShardPlan plan = ShardPlan::Make(count, std::move(weights));
+  plan.Write(stdout);
+  for (unsigned shard = 1; shard <= plan.Count(); ++shard) {
+    fprintf(stderr, "Shard %u: %llu entries\n", shard,
+            (unsigned long long)plan.Weight(shard));
+  }
+}
+
+/**
+ * Merge - Merge the snapshots of the shards of a tree into one
+ *
+ * @param count: Number of snapshots
+ * @param parts: Their paths
+ * @param threads: Threads to decompress them on
+ * @param writer: Snapshot to add the entries to, fields not yet set
+ *
+ * The parts are read side by side and their records written in Traverse() order, so
+ * the result is the snapshot one scan of the whole tree would have written (the
+ * writer works out the directory digests afresh). Throws std::runtime_error if a part
+ * can't be read, isn't sorted, or has an entry another part has as well.
+ */
+void Merge(size_t count, char *const *parts, unsigned threads, SnapshotWriter &writer) {
+  std::vector<std::unique_ptr<TraverseReader>> readers;
+  std::vector<TraverseRecord> records(count);
+  std::vector<size_t> live;  // Parts not yet read to the end
+  unsigned fields = ~0u;
+  for (size_t i = 0; i < count; ++i) {
+    readers.push_back(std::make_unique<TraverseReader>(parts[i], threads));
+    if (readers[i]->Next(&records[i])) {
+      live.push_back(i);
+      fields &= readers[i]->Fields();
+    }
+  }
+  writer.SetFields(fields);
+
+  std::string previous;
+  while (!live.empty()) {
+    size_t first = 0;
+    for (size_t j = 1; j < live.size(); ++j) {
+      if (ComparePaths(records[live[j]].path, records[live[first]].path) < 0) {
+        first = j;
+      }
+    }
+    size_t i = live[first];
+    const TraverseRecord &record = records[i];
+    if (!previous.empty() && ComparePaths(previous, record.path) >= 0) {
+      throw std::runtime_error(
+          ComparePaths(previous, record.path) == 0
+              ? "'" + std::string(record.path) + "' is in more than one part"
+              : "'" + readers[i]->Filename() + "' is not in sorted order at line " +
+                    std::to_string(readers[i]->LineNumber()));
+    }
+    previous.assign(record.path);
+    size_t name_start = record.path.size() - record.name.size();
+    writer.Add(record.path.substr(0, name_start),
+               EntryInfo{record.type, record.size, record.mtime, record.name, nullptr,
+                         record.hash, record.ino});
+    if (!readers[i]->Next(&records[i])) {
+      live.erase(live.begin() + ptrdiff_t(first));
+    }
+  }
+}
+}  // namespace
+
+/**
+ * main - Program entry point
+ *
+ * Usage: file-shard -n shards [-j threads] snapshot
+ *        file-shard -m [-B] [-z] [-i index] [-j threads] part...
+ *
+ * Splits the scan of a large tree into shards that are scanned on their own, e.g. on
+ * several hosts at once, and puts the results back together.
+ * With -n the root's entries in snapshot (the last scan of the tree) are balanced
+ * over that many shards by the size of their subtrees, and the plan is written to
+ * stdout (see shard_plan.h). Each shard is then scanned with file-lister -K N:plan;
+ * root entries made since the snapshot are given to a shard by their name.
+ * With -m the snapshots of the shards are merged in Traverse() order and written to
+ * stdout: the snapshot file-lister would have written for the whole tree, given the
+ * same options. With -B it is written in the binary format, and with -z compressed.
+ * With -i its index is written to the given file too (see file-lister -i). With -j the
+ * snapshots are read (and decompressed) on that many threads.
+ */
+int main(int argc, char *argv[]) {
+  unsigned shards = 0;
+  bool merge = false;
+  SnapshotWriter::Format format = SnapshotWriter::Format::kText;
+  bool compress = false;
+  const char *index_file = nullptr;
+  unsigned threads = 1;
+  int opt;
+  bool usage = false;
+  while (!usage && (opt = getopt(argc, argv, "Bmzi:j:n:")) != -1) {
+    if (opt == 'n' && atoi(optarg) >= 1) {
+      shards = unsigned(atoi(optarg));
+    } else if (opt == 'm') {
+      merge = true;
+    } else if (opt == 'B') {
+      format = SnapshotWriter::Format::kBinary;
+    } else if (opt == 'z') {
+      compress = true;
+    } else if (opt == 'i') {
+      index_file = optarg;
+    } else if (opt == 'j' && atoi(optarg) >= 1) {
+      threads = unsigned(atoi(optarg));
+    } else {
+      usage = true;
+    }
+  }
+  bool writes = format != SnapshotWriter::Format::kText || compress || index_file;
+  if (usage || merge == (shards > 0) || (shards && (writes || argc - optind != 1)) ||
+      argc - optind < 1) {
+    fprintf(stderr,
+            "Usage: %s -n shards [-j threads] snapshot\n"
+            "       %s -m [-B] [-z] [-i index] [-j threads] part...\n"
+            "  -n shards   Plan shards balancing the top-level entries of snapshot\n"
+            "  -m          Merge the snapshots of the shards into one\n"
+            "  -B          Write a binary snapshot instead of text\n"
+            "  -z          Compress the snapshot\n"
+            "  -i FILE     Also write an index of the snapshot to FILE\n"
+            "  -j threads  Read the snapshots with this many threads\n",
+            argv[0], argv[0]);
+    return 1;
+  }
+
+  if (shards) {
+    try {
+      WritePlan(shards, argv[optind], threads);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
+  SnapshotWriter writer(stdout, format);
+  std::unique_ptr<FILE, int (*)(FILE *)> index(nullptr, fclose);
+  if (index_file) {
+    index.reset(fopen(index_file, "w"));
+    if (!index) {
+      fprintf(stderr, "Error: Cannot create %s: %s\n", index_file, strerror(errno));
+      return 1;
+    }
+    writer.WriteIndex(index.get());
+  }
+  if (compress) {
+    writer.Compress(std::max(threads, 2u));
+  }
+  try {
+    Merge(size_t(argc - optind), argv + optind, threads, writer);
+    writer.Finish();
+  } catch (const std::exception &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
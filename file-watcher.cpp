@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot_writer.h"
+#include "tool_options.h"
+#include "tree_watcher.h"
+
+/**
+ * main - Program entry point
+ *
+ * Usage: file-watcher [-I] [-l] [scan options] [directory_path]
+ *
+ * If no path is provided, watches current directory "."
+ * Reads the directory tree once, then keeps it current from filesystem change events
+ * and prints a change record for every difference, until killed (see tree_watcher.h
+ * for the record format). With -l the initial tree is printed first, as records of
+ * entries added. With -I inotify is used even where fanotify is available.
+ */
+int main(int argc, char *argv[]) {
+  ScanOptions options;
+  bool fanotify = true;
+  bool list = false;
+  int opt;
+  while ((opt = getopt(argc, argv, SCAN_OPTION_CHARS "Il")) != -1) {
+    if (opt == 'I') {
+      fanotify = false;
+    } else if (opt == 'l') {
+      list = true;
+    } else if (!ParseScanOption(opt, optarg, &options)) {
+      fprintf(stderr,
+              "Usage: %s [-I] [-l] [scan options] [directory_path]\n"
+              "  -I          Watch with inotify even where fanotify is available\n"
+              "  -l          Print the initial tree as added entries first\n%s",
+              argv[0], kScanOptionsHelp);
+      return 1;
+    }
+  }
+
+  // Determine starting directory: argument or current directory
+  const char *start_path = (optind < argc) ? argv[optind] : ".";
+
+  try {
+    TreeWatcher watcher(start_path, options, fanotify);
+    SnapshotWriter changes(stdout, SnapshotWriter::Format::kText);
+    changes.SetFields(options.fields);
+    if (list) {
+      watcher.Report(changes, '+');
+      changes.Flush();
+    }
+    for (;;) {
+      watcher.Poll(changes, -1);
+    }
+  } catch (const std::exception &e) {
+    fflush(stdout);
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+  }
+}
@@ -0,0 +1,45 @@
+/*
+ * mapped_file.cpp
+ *
+ * Read-only file mappings.
+ */
+
+#include "mapped_file.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdexcept>
+#include <string>
+
+// Implementation of MappedFile::Map
+std::shared_ptr<MappedFile> MappedFile::Map(int fd) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) ||
+      file_stat.st_size <= 0) {
+    return nullptr;
+  }
+  size_t size = size_t(file_stat.st_size);
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  // Readers go through the file front to back
+  madvise(data, size, MADV_SEQUENTIAL);
+  return std::shared_ptr<MappedFile>(
+      new MappedFile(static_cast<const char *>(data), size));
+}
+
+// Implementation of MappedFile::Allocate
+std::shared_ptr<MappedFile> MappedFile::Allocate(size_t size, char **data) {
+  void *memory =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Cannot allocate " + std::to_string(size) + " bytes");
+  }
+  *data = static_cast<char *>(memory);
+  return std::shared_ptr<MappedFile>(new MappedFile(*data, size));
+}
+
+// Implementation of MappedFile::~MappedFile
+MappedFile::~MappedFile() { munmap(const_cast<char *>(data_), size_); }
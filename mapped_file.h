@@ -0,0 +1,60 @@
+/*
+ * mapped_file.h
+ *
+ * Header file for a read-only memory mapping of a whole file, or of memory standing in
+ * for one.
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+
+#include <memory>
+
+/**
+ * MappedFile - A file mapped read-only into memory, unmapped on destruction
+ *
+ * Shared so that views into the mapping (e.g. the names of a tree loaded from a
+ * snapshot) can keep it alive after the reader is gone.
+ */
+class MappedFile {
+ public:
+  /**
+   * Map - Factory function to map an open file
+   *
+   * @param fd: Open file descriptor (not taken over; may be closed afterwards)
+   * @return: The mapping, or nullptr if the file can't be mapped (not a regular file,
+   *          empty, ...) so the caller can fall back to reading it
+   */
+  static std::shared_ptr<MappedFile> Map(int fd);
+
+  /**
+   * Allocate - Factory function for anonymous memory to fill in, e.g. with the
+   *            decompressed contents of a file
+   *
+   * @param size: Bytes to allocate (more than 0)
+   * @param data: Set to the memory, writable until the contents are used
+   * @return: The mapping
+   *
+   * Throws std::runtime_error if the memory can't be mapped.
+   */
+  static std::shared_ptr<MappedFile> Allocate(size_t size, char **data);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Contents of the file
+  const char *Data() const { return data_; }
+  size_t Size() const { return size_; }
+
+ private:
+  MappedFile(const char *data, size_t size) : data_(data), size_(size) {}
+
+  const char *data_;
+  size_t size_;
+};
+
+#endif  // MAPPED_FILE_H
@@ -0,0 +1,208 @@
+/*
+ * metadata_ring.cpp
+ *
+ * Minimal io_uring submission/completion handling for batched statx and openat. Only
+ * the handful of ring operations the directory scanner needs are implemented.
+ */
+
+#include "metadata_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace {
+// Locate a ring field at a kernel-supplied byte offset within a mapping
+template <class T>
+T *RingPtr(void *base, unsigned offset) {
+  return static_cast<T *>(static_cast<void *>(static_cast<char *>(base) + offset));
+}
+
+// Synchronous fallbacks, returning results in the same convention as the CQEs
+int SyncStatx(int fddir, int flags, MetadataRequest &request) {
+  return statx(fddir, request.name, flags, request.mask, &request.stx) == 0 ? 0 : -errno;
+}
+
+int SyncOpen(int fddir, MetadataRequest &request) {
+  int fd = openat(fddir, request.name, O_RDONLY | O_DIRECTORY);
+  return fd >= 0 ? fd : -errno;
+}
+}  // namespace
+
+// Implementation of MetadataRing::Create
+std::unique_ptr<MetadataRing> MetadataRing::Create(unsigned depth) {
+  // A request may need two entries (statx + openat)
+  if (depth < 2) {
+    depth = 2;
+  }
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = int(syscall(__NR_io_uring_setup, depth, &params));
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  std::unique_ptr<MetadataRing> ring(new MetadataRing);
+  ring->ring_fd_ = fd;  // From here on the destructor cleans up
+
+  ring->sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    // Both rings live in one mapping
+    if (ring->cq_ring_size_ > ring->sq_ring_size_) {
+      ring->sq_ring_size_ = ring->cq_ring_size_;
+    }
+    ring->cq_ring_size_ = 0;
+  }
+
+  void *sq_ring = mmap(nullptr, ring->sq_ring_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    return nullptr;
+  }
+  ring->sq_ring_ = sq_ring;
+
+  void *cq_ring = sq_ring;
+  if (!single_mmap) {
+    cq_ring = mmap(nullptr, ring->cq_ring_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return nullptr;
+    }
+    ring->cq_ring_ = cq_ring;
+  }
+
+  ring->sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, ring->sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    ring->sqes_size_ = 0;
+    return nullptr;
+  }
+  ring->sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+  ring->sq_head_ = RingPtr<unsigned>(sq_ring, params.sq_off.head);
+  ring->sq_tail_ = RingPtr<unsigned>(sq_ring, params.sq_off.tail);
+  ring->sq_mask_ = *RingPtr<unsigned>(sq_ring, params.sq_off.ring_mask);
+  ring->sq_entries_ = *RingPtr<unsigned>(sq_ring, params.sq_off.ring_entries);
+  ring->sq_array_ = RingPtr<unsigned>(sq_ring, params.sq_off.array);
+
+  ring->cq_head_ = RingPtr<unsigned>(cq_ring, params.cq_off.head);
+  ring->cq_tail_ = RingPtr<unsigned>(cq_ring, params.cq_off.tail);
+  ring->cq_mask_ = *RingPtr<unsigned>(cq_ring, params.cq_off.ring_mask);
+  ring->cqes_ = RingPtr<struct io_uring_cqe>(cq_ring, params.cq_off.cqes);
+  return ring;
+}
+
+// Implementation of MetadataRing::~MetadataRing
+MetadataRing::~MetadataRing() {
+  if (sqes_size_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  close(ring_fd_);
+}
+
+// Implementation of MetadataRing::GetSqe
+struct io_uring_sqe *MetadataRing::GetSqe() {
+  unsigned tail = *sq_tail_;  // Only we write the tail
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (tail - head >= sq_entries_) {
+    return nullptr;
+  }
+  unsigned index = tail & sq_mask_;
+  struct io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++to_submit_;
+  return sqe;
+}
+
+// Implementation of MetadataRing::Enter
+void MetadataRing::Enter(unsigned wait_nr) {
+  for (;;) {
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    long ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, wait_nr, flags, nullptr,
+                       0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+    }
+    to_submit_ -= unsigned(ret);
+    if (to_submit_ == 0) {
+      return;
+    }
+  }
+}
+
+// Implementation of MetadataRing::Process
+void MetadataRing::Process(int fddir, int flags, MetadataRequest *requests,
+                           size_t count) {
+  // user_data is the request index shifted left by one, with the low bit set for opens
+  size_t next = 0;       // Next request to queue
+  unsigned inflight = 0;  // Operations queued but not yet reaped
+  while (next < count || inflight > 0) {
+    // Fill the submission queue. A request's statx and openat are queued together so
+    // that neither waits for the other.
+    while (next < count) {
+      MetadataRequest &request = requests[next];
+      unsigned needed = request.open_dir ? 2 : 1;
+      if (inflight + needed > sq_entries_) {
+        break;
+      }
+      struct io_uring_sqe *sqe = GetSqe();
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = fddir;
+      sqe->addr = reinterpret_cast<uintptr_t>(request.name);
+      sqe->len = request.mask;
+      sqe->off = reinterpret_cast<uintptr_t>(&request.stx);
+      sqe->statx_flags = unsigned(flags);
+      sqe->user_data = uint64_t(next) << 1;
+      if (request.open_dir) {
+        sqe = GetSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = fddir;
+        sqe->addr = reinterpret_cast<uintptr_t>(request.name);
+        sqe->open_flags = O_RDONLY | O_DIRECTORY;
+        sqe->user_data = (uint64_t(next) << 1) | 1;
+      }
+      inflight += needed;
+      ++next;
+    }
+
+    Enter(inflight > 0 ? 1 : 0);
+
+    // Reap every completion that is ready
+    unsigned head = *cq_head_;  // Only we write the head
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      MetadataRequest &request = requests[cqe.user_data >> 1];
+      if (cqe.user_data & 1) {
+        // EINVAL from an older kernel means the opcode isn't supported
+        request.open_result = cqe.res == -EINVAL ? SyncOpen(fddir, request) : cqe.res;
+      } else {
+        request.stat_result =
+            cqe.res == -EINVAL ? SyncStatx(fddir, flags, request) : cqe.res;
+      }
+      --inflight;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+}
@@ -0,0 +1,105 @@
+/*
+ * metadata_ring.h
+ *
+ * Header file for a minimal io_uring wrapper that issues batches of statx and openat
+ * calls for the entries of one directory.
+ */
+
+#ifndef METADATA_RING_H
+#define METADATA_RING_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <memory>
+
+/**
+ * MetadataRequest - One entry's worth of metadata work for MetadataRing::Process
+ *
+ * The caller fills in the inputs; Process() fills in the results. The name must stay
+ * valid until Process() returns.
+ */
+struct MetadataRequest {
+  // Inputs
+  const char *name;  // Entry name relative to the directory fd
+  unsigned mask;     // statx mask to request
+  bool open_dir;     // Also openat(O_RDONLY | O_DIRECTORY) the entry
+
+  // Results
+  struct statx stx;  // statx buffer
+  int stat_result;   // 0 on success, negative errno on failure
+  int open_result;   // New fd on success, negative errno on failure (if open_dir)
+};
+
+/**
+ * MetadataRing - Per-thread io_uring instance for metadata syscalls
+ *
+ * Talks to the kernel through the raw io_uring_setup/io_uring_enter syscalls so that no
+ * extra library is needed. Not thread-safe; each scanning thread owns its own ring.
+ */
+class MetadataRing {
+ public:
+  /**
+   * Create - Factory function to set up a ring
+   *
+   * @param depth: Number of submission queue entries (requests kept in flight)
+   * @return: The ring, or nullptr if io_uring is unavailable (old kernel, disabled by
+   *          sysctl or seccomp, ...) so the caller can fall back to plain syscalls
+   */
+  static std::unique_ptr<MetadataRing> Create(unsigned depth);
+
+  ~MetadataRing();
+
+  MetadataRing(const MetadataRing &) = delete;
+  MetadataRing &operator=(const MetadataRing &) = delete;
+
+  /**
+   * Process - Run the statx (and optional openat) calls for a batch of entries
+   *
+   * @param fddir: Directory the names are relative to
+   * @param flags: statx flags (AT_SYMLINK_NOFOLLOW etc.)
+   * @param requests: Array of requests to process
+   * @param count: Number of requests
+   *
+   * Keeps up to the ring depth in flight at once and returns when every request has
+   * completed. Requests the kernel rejects as unsupported are completed with plain
+   * syscalls instead. Throws std::runtime_error if the ring itself fails.
+   */
+  void Process(int fddir, int flags, MetadataRequest *requests, size_t count);
+
+ private:
+  MetadataRing() = default;
+
+  // Get a zeroed submission queue entry, or nullptr if the queue is full
+  struct io_uring_sqe *GetSqe();
+
+  // Submit everything queued and wait for at least wait_nr completions
+  void Enter(unsigned wait_nr);
+
+  int ring_fd_ = -1;
+
+  // Submission queue (pointers into the shared mappings)
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned *sq_array_ = nullptr;
+  struct io_uring_sqe *sqes_ = nullptr;
+
+  // Completion queue
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe *cqes_ = nullptr;
+
+  // Mappings to unmap on destruction
+  void *sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void *cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  size_t sqes_size_ = 0;
+
+  unsigned to_submit_ = 0;  // SQEs queued but not yet passed to io_uring_enter
+};
+
+#endif  // METADATA_RING_H
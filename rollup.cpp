@@ -0,0 +1,81 @@
+/*
+ * rollup.cpp
+ *
+ * Totals of the directories of a streamed tree, and the lines of the report.
+ */
+
+#include "rollup.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <stdexcept>
+#include <utility>
+
+// Implementation of RollupBuilder::RollupBuilder
+RollupBuilder::RollupBuilder(RollupReport report)
+    : report_(std::move(report)), open_(1, Frame{0, Rollup()}) {}
+
+// Implementation of RollupBuilder::Add
+void RollupBuilder::Add(std::string_view dir, const EntryInfo &info) {
+  // Leave the directories that don't contain this entry
+  while (open_.size() > 1 && dir != path_) {
+    Close();
+  }
+  if (dir != path_) {
+    throw std::runtime_error("Directory " + std::string(dir) +
+                             " isn't the last one listed or one of its parents");
+  }
+  open_.back().rollup.Add(info);
+  if (info.type == DT_DIR) {
+    // Its entries, if any, come next
+    open_.push_back(Frame{path_.size(), Rollup()});
+    path_ += info.name;
+    path_ += '/';
+  }
+}
+
+// Implementation of RollupBuilder::Finish
+Rollup RollupBuilder::Finish() {
+  while (open_.size() > 1) {
+    Close();
+  }
+  Rollup root = open_.back().rollup;
+  report_(path_, root);
+  open_.back().rollup = Rollup();
+  return root;
+}
+
+// Implementation of RollupBuilder::Close
+void RollupBuilder::Close() {
+  Frame frame = open_.back();
+  open_.pop_back();
+  report_(path_, frame.rollup);
+  path_.resize(frame.parent_len);
+  open_.back().rollup.Add(frame.rollup);
+}
+
+// Implementation of WriteRollup
+void WriteRollup(FILE *out, const std::string &path, const Rollup &rollup) {
+  time_t seconds = (time_t)rollup.newest.tv_sec;
+  struct tm tm_buf;
+  struct tm *tt = gmtime_r(&seconds, &tm_buf);
+  if (tt == NULL) {
+    throw std::runtime_error("gmtime failed for " + path);
+  }
+
+  // The path, without its trailing '/', then a null byte as in a listing
+  if (path.empty()) {
+    fputs(".", out);
+  } else {
+    fwrite(path.data(), 1, path.size() - 1, out);
+  }
+  fprintf(out, "%c %llu %llu %llu %04u-%02u-%02u %02u:%02u:%02u.%09lu\n", 0,
+          (unsigned long long)rollup.bytes, (unsigned long long)rollup.files,
+          (unsigned long long)rollup.dirs, 1900 + tt->tm_year, tt->tm_mon + 1,
+          tt->tm_mday, tt->tm_hour, tt->tm_min, tt->tm_sec, rollup.newest.tv_nsec);
+  if (ferror(out)) {
+    throw std::runtime_error(std::string("Cannot write report: ") + strerror(errno));
+  }
+}
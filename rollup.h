@@ -0,0 +1,84 @@
+/*
+ * rollup.h
+ *
+ * Header file for totalling up the subtrees of a tree given entry by entry, and for
+ * the du-style report of the totals.
+ *
+ * Report format: one line per directory, each after everything below it:
+ *   path '\0' ' ' bytes ' ' files ' ' dirs ' ' YYYY-MM-DD HH:MM:SS.nnnnnnnnn '\n'
+ * with the fields of its Rollup in decimal and the newest mtime in UTC, as in a
+ * listing (see snapshot_writer.h). The path has no trailing '/'; the root's is ".".
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdio.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dir_level.h"
+
+/**
+ * RollupBuilder - Totals up the directories of a tree given in Traverse() order
+ *
+ * Keeps the totals of each directory on the path to the latest entry. When the input
+ * moves out of a directory, its totals are complete: they are reported and added into
+ * its parent's. Memory use is bounded by the depth of the tree, so a scan being
+ * streamed (see DirStream) or a snapshot being read can be totalled up without
+ * building the tree.
+ */
+class RollupBuilder {
+ public:
+  // Reports each directory's totals to report (see RollupReport)
+  explicit RollupBuilder(RollupReport report);
+
+  /**
+   * Add - Count one entry
+   *
+   * @param dir: Path of the directory holding the entry, with trailing '/' (empty for
+   *             the root)
+   * @param info: The entry
+   *
+   * Throws std::runtime_error if dir is neither a directory added earlier nor the
+   * root, or the input has left it already (the entries aren't in Traverse() order).
+   */
+  void Add(std::string_view dir, const EntryInfo &info);
+
+  /**
+   * Finish - Report the directories still open, the root last
+   *
+   * @return: The root's totals
+   */
+  Rollup Finish();
+
+ private:
+  // Report the innermost open directory and add it into its parent
+  void Close();
+
+  // A directory on the path to the latest entry
+  struct Frame {
+    size_t parent_len;  // Length of path_ without this directory
+    Rollup rollup;      // Its entries so far
+  };
+
+  RollupReport report_;
+  std::vector<Frame> open_;  // Root first
+  std::string path_;         // Path of the innermost one, with trailing '/'
+};
+
+/**
+ * WriteRollup - Print one line of the report
+ *
+ * @param out: Stream to print to
+ * @param path: Path of the directory, with trailing '/' (empty for the root)
+ * @param rollup: Its totals
+ *
+ * Throws std::runtime_error if the newest mtime can't be converted or the line can't
+ * be written.
+ */
+void WriteRollup(FILE *out, const std::string &path, const Rollup &rollup);
+
+#endif  // ROLLUP_H
@@ -0,0 +1,98 @@
+/*
+ * scan_filter.cpp
+ *
+ * Matching of exclusion patterns and shards, and the rules for a subtree.
+ */
+
+#include "scan_filter.h"
+
+#include <fnmatch.h>
+
+#include "shard_plan.h"
+
+namespace {
+// Whether s holds any of fnmatch()'s special characters
+bool HasSpecial(std::string_view s) {
+  return s.find_first_of("*?[\\") != std::string_view::npos;
+}
+}  // namespace
+
+// Implementation of ScanFilter::Exclude
+void ScanFilter::Exclude(std::string_view pattern) {
+  bool path = pattern.find('/') != std::string_view::npos;
+  if (path) {
+    while (!pattern.empty() && pattern.front() == '/') {
+      pattern.remove_prefix(1);
+    }
+    while (!pattern.empty() && pattern.back() == '/') {
+      pattern.remove_suffix(1);
+    }
+  }
+  if (pattern.empty()) {
+    return;
+  }
+
+  Rule rule{Match::kGlob, std::string(pattern)};
+  if (!HasSpecial(pattern)) {
+    rule.match = Match::kExact;
+  } else if (!path && pattern.size() > 1 && pattern.front() == '*' &&
+             !HasSpecial(pattern.substr(1))) {
+    rule.match = Match::kSuffix;
+    rule.text.erase(0, 1);
+  } else if (!path && pattern.size() > 1 && pattern.back() == '*' &&
+             !HasSpecial(pattern.substr(0, pattern.size() - 1))) {
+    rule.match = Match::kPrefix;
+    rule.text.pop_back();
+  }
+  (path ? path_rules_ : name_rules_).push_back(std::move(rule));
+}
+
+// Implementation of ScanFilter::Matches
+bool ScanFilter::Matches(const Rule &rule, std::string_view s, bool path) {
+  switch (rule.match) {
+    case Match::kExact:
+      return s == rule.text;
+    case Match::kPrefix:
+      return s.starts_with(rule.text);
+    case Match::kSuffix:
+      return s.ends_with(rule.text);
+    case Match::kGlob:
+      break;
+  }
+  return fnmatch(rule.text.c_str(), std::string(s).c_str(), path ? FNM_PATHNAME : 0) ==
+         0;
+}
+
+// Implementation of ScanFilter::Excluded
+bool ScanFilter::Excluded(std::string_view name, std::string_view dir) const {
+  if (plan_ && base_.empty() && dir.empty() && plan_->ShardOf(name) != shard_) {
+    return true;
+  }
+  for (const Rule &rule : name_rules_) {
+    if (Matches(rule, name, false)) {
+      return true;
+    }
+  }
+  if (path_rules_.empty()) {
+    return false;
+  }
+  std::string path = base_;
+  path += dir;
+  path += name;
+  for (const Rule &rule : path_rules_) {
+    if (Matches(rule, path, true)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Implementation of ScanFilter::Below
+ScanFilter ScanFilter::Below(std::string_view dir) const {
+  ScanFilter below = *this;
+  below.base_ += dir;
+  for (char c : dir) {
+    below.depth_base_ += c == '/';
+  }
+  return below;
+}
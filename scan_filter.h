@@ -0,0 +1,119 @@
+/*
+ * scan_filter.h
+ *
+ * Header file for the rules that keep parts of a tree out of a scan: exclusion
+ * patterns, a maximum depth, staying on one filesystem and scanning one shard.
+ */
+
+#ifndef SCAN_FILTER_H
+#define SCAN_FILTER_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class ShardPlan;
+
+/**
+ * ScanFilter - Which entries of a tree a scan (or a loaded snapshot) leaves out
+ *
+ * An excluded entry is dropped before it is stat'ed, so nothing below an excluded
+ * directory is opened, stored or compared. A pattern without a '/' is matched against
+ * every entry's name, one with a '/' against the entry's path from the root (a leading
+ * or trailing '/' is ignored); both are fnmatch() globs, where a '*' in a path pattern
+ * doesn't match a '/'. Patterns that are plain names, or a literal with a single '*'
+ * at the start or end, are matched without fnmatch().
+ *
+ * With a maximum depth N only entries at most N levels below the root are kept (the
+ * root's own entries are at depth 1), and directories at depth N are listed but not
+ * read. On one filesystem, directories on another device than the root (mount points)
+ * are listed but not read; snapshots carry no devices, so that rule only applies to
+ * scans. With a shard (see shard_plan.h), only the root's entries the plan gives to that
+ * shard are kept, with everything below them.
+ */
+class ScanFilter {
+ public:
+  // Exclude entries matching pattern (see above); ignores an empty pattern
+  void Exclude(std::string_view pattern);
+
+  // Keep only entries at most depth levels below the root (0 = no limit)
+  void SetMaxDepth(unsigned depth) { max_depth_ = depth; }
+
+  // Don't read directories on other filesystems than the root
+  void SetOneFilesystem(bool one_filesystem) { one_filesystem_ = one_filesystem; }
+
+  // Keep only the root's entries that plan gives to shard (1 to plan->Count())
+  void SetShard(std::shared_ptr<const ShardPlan> plan, unsigned shard) {
+    plan_ = std::move(plan);
+    shard_ = shard;
+  }
+
+  // Whether any rule is set
+  bool Active() const {
+    return !name_rules_.empty() || !path_rules_.empty() || max_depth_ ||
+           one_filesystem_ || plan_;
+  }
+
+  // Whether any pattern (or a shard, which is matched like one) is set
+  bool HasPatterns() const {
+    return !name_rules_.empty() || !path_rules_.empty() || plan_;
+  }
+
+  // Whether Excluded() needs the directory's path (to match path patterns, or to tell
+  // the root's entries apart for a shard)
+  bool NeedsPath() const { return !path_rules_.empty() || (plan_ && base_.empty()); }
+
+  bool OneFilesystem() const { return one_filesystem_; }
+
+  /**
+   * Excluded - Whether an entry matches an exclusion pattern, or is one of the root's
+   *            entries that belongs to another shard
+   *
+   * @param name: The entry's name
+   * @param dir: Path of its directory from the root, with trailing '/' (empty for the
+   *             root); only looked at if NeedsPath()
+   */
+  bool Excluded(std::string_view name, std::string_view dir) const;
+
+  // Whether the contents of a directory depth levels below the root (0 for the root
+  // itself) are read
+  bool ReadsBelow(unsigned depth) const {
+    return !max_depth_ || depth + depth_base_ < max_depth_;
+  }
+
+  /**
+   * Below - The same rules for scanning a subtree as a tree of its own
+   *
+   * @param dir: Path of the subtree's root from this filter's root, with trailing '/'
+   * @return: A filter whose paths and depths are relative to that directory
+   */
+  ScanFilter Below(std::string_view dir) const;
+
+ private:
+  enum class Match {
+    kExact,   // The whole text
+    kPrefix,  // text followed by anything
+    kSuffix,  // Anything followed by text
+    kGlob,    // fnmatch() pattern
+  };
+  struct Rule {
+    Match match;
+    std::string text;
+  };
+
+  // Whether s matches rule (as a path, if path)
+  static bool Matches(const Rule &rule, std::string_view s, bool path);
+
+  std::vector<Rule> name_rules_;
+  std::vector<Rule> path_rules_;
+  std::string base_;         // Path of the scanned root from the rules' root
+  unsigned depth_base_ = 0;  // Its depth below the rules' root
+  unsigned max_depth_ = 0;
+  bool one_filesystem_ = false;
+  std::shared_ptr<const ShardPlan> plan_;  // Shard plan, if only one shard is kept
+  unsigned shard_ = 0;                     // and that shard
+};
+
+#endif  // SCAN_FILTER_H
@@ -0,0 +1,130 @@
+/*
+ * scan_governor.cpp
+ *
+ * The concurrency limit of a scan's directory reads, and its rate limit per
+ * filesystem.
+ */
+
+#include "scan_governor.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "scan_stats.h"
+
+namespace {
+// Shortest window over which the latency is averaged before the limit is changed
+constexpr uint64_t kWindowNanos = 100'000'000;
+
+// Fewest calls the window needs, so that a few slow directories don't decide alone
+constexpr uint64_t kWindowCalls = 64;
+
+// A window whose latency is this many times the baseline is congested
+constexpr double kCongested = 2.0;
+
+// Windows over which the baseline moves most of the way to a lasting higher latency
+constexpr double kBaselineDrift = 256;
+}  // namespace
+
+// Implementation of ScanGovernor::ScanGovernor
+ScanGovernor::ScanGovernor(unsigned max_reads, bool adaptive, uint64_t calls_per_second)
+    : max_reads_(std::max(max_reads, 1u)),
+      adaptive_(adaptive),
+      rate_(calls_per_second),
+      limit_(adaptive ? 1 : max_reads_) {}
+
+// Implementation of ScanGovernor::Read::Read
+ScanGovernor::Read::Read(ScanGovernor *governor, dev_t dev)
+    : governor_(governor), dev_(dev) {
+  if (governor_ && governor_->adaptive_) {
+    governor_->Begin();
+    start_ = ScanStats::Now();
+  }
+}
+
+// Implementation of ScanGovernor::Read::Done
+void ScanGovernor::Read::Done() {
+  if (governor_ && governor_->adaptive_) {
+    governor_->End(calls_, ScanStats::Now() - start_ - waited_);
+  }
+  governor_ = nullptr;
+}
+
+// Implementation of ScanGovernor::Read::Calls
+void ScanGovernor::Read::Calls(uint64_t calls) {
+  if (governor_) {
+    calls_ += calls;
+    waited_ += governor_->Throttle(dev_, calls);
+  }
+}
+
+// Implementation of ScanGovernor::Throttle
+uint64_t ScanGovernor::Throttle(dev_t dev, uint64_t calls) {
+  if (rate_ == 0 || calls == 0) {
+    return 0;
+  }
+  auto cost = std::chrono::nanoseconds(int64_t(double(calls) * 1e9 / double(rate_)));
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point start;
+  {
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    auto &next = next_call_[dev];
+    start = std::max(next, now);
+    next = start + cost;
+  }
+  if (start == now) {
+    return 0;
+  }
+  std::this_thread::sleep_until(start);
+  return uint64_t(std::chrono::nanoseconds(start - now).count());
+}
+
+// Implementation of ScanGovernor::Limit
+unsigned ScanGovernor::Limit() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return limit_;
+}
+
+// Implementation of ScanGovernor::Begin
+void ScanGovernor::Begin() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  slot_cv_.wait(lock, [&] { return in_use_ < limit_; });
+  if (++in_use_ == limit_) {
+    window_full_ = true;
+  }
+  if (!window_start_) {
+    window_start_ = ScanStats::Now();
+  }
+}
+
+// Implementation of ScanGovernor::End
+void ScanGovernor::End(uint64_t calls, uint64_t busy) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  --in_use_;
+  if (calls) {  // A directory taken from the previous scan says nothing of latency
+    window_calls_ += calls;
+    window_busy_ += busy;
+  }
+  uint64_t now = ScanStats::Now();
+  if (window_calls_ < kWindowCalls || now - window_start_ < kWindowNanos) {
+    slot_cv_.notify_one();
+    return;
+  }
+
+  double latency = double(window_busy_) / double(window_calls_);
+  if (baseline_ == 0 || latency < baseline_) {
+    baseline_ = latency;
+  } else {
+    baseline_ += (latency - baseline_) / kBaselineDrift;
+  }
+  if (latency > baseline_ * kCongested) {
+    limit_ = std::max(1u, limit_ - std::max(1u, limit_ / 4));  // Multiplicative decrease
+    slow_start_ = false;
+  } else if (window_full_) {
+    limit_ = std::min(max_reads_, slow_start_ ? limit_ * 2 : limit_ + 1);
+  }
+  window_start_ = now;
+  window_calls_ = window_busy_ = 0;
+  window_full_ = in_use_ >= limit_;
+  slot_cv_.notify_all();
+}
@@ -0,0 +1,134 @@
+/*
+ * scan_governor.h
+ *
+ * Header file for the controller that adapts how many directories a scan reads at
+ * once to the latency of its metadata calls, and caps the calls made per second on
+ * each filesystem.
+ */
+
+#ifndef SCAN_GOVERNOR_H
+#define SCAN_GOVERNOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * ScanGovernor - Bounds the load a scan puts on the filesystems it reads
+ *
+ * Adaptive: each directory read takes one of a limited number of slots, the
+ * concurrency limit, and when it is done reports the metadata calls (getdents64,
+ * stat, open) it made and how long it was busy with them. Every 100ms or so the
+ * controller compares the window's mean latency per call with the lowest seen (the
+ * baseline, which drifts slowly towards more recent windows so that it follows a
+ * server that has become slower for good). While the limit is in use, throughput is
+ * the limit over the latency, so a latency near the baseline means more reads at once
+ * would add throughput: the limit grows, doubling at first (slow start) and by one
+ * later, up to the scan's thread count. A latency of twice the baseline means the
+ * reads are queueing at the server: the limit is cut by a quarter (AIMD, as in TCP
+ * congestion control). Without adapting, every thread reads at once.
+ *
+ * Rate: a scan may also make at most a given number of calls per second on each
+ * filesystem (device). Each batch of calls books the time it is worth at the rate on
+ * its device and waits for the bookings ahead of it, as ContentHasher does for bytes
+ * read. Time spent waiting isn't counted as latency.
+ *
+ * Used from any thread.
+ */
+class ScanGovernor {
+ public:
+  /**
+   * Constructor
+   *
+   * @param max_reads: Most directories to read at once (the scan's threads)
+   * @param adaptive: Adapt the number read at once (otherwise it is max_reads)
+   * @param calls_per_second: Most calls per second on each filesystem (0 = no limit)
+   */
+  ScanGovernor(unsigned max_reads, bool adaptive, uint64_t calls_per_second);
+
+  ScanGovernor(const ScanGovernor &) = delete;
+  ScanGovernor &operator=(const ScanGovernor &) = delete;
+
+  /**
+   * Read - One directory being read, holding a slot until Done()
+   *
+   * A nullptr governor makes every call a no-op, so scans without one pay nothing.
+   */
+  class Read {
+   public:
+    /**
+     * Constructor - Wait for a slot
+     *
+     * @param governor: The scan's governor, or nullptr
+     * @param dev: Device the directory is on (only used with a rate limit)
+     */
+    Read(ScanGovernor *governor, dev_t dev);
+
+    // Gives back the slot, unless Done() has, and reports the calls made while it was
+    // held
+    ~Read() { Done(); }
+
+    Read(const Read &) = delete;
+    Read &operator=(const Read &) = delete;
+
+    // Count calls about to be made, waiting for the rate limit
+    void Calls(uint64_t calls);
+
+    // Give back the slot before the destructor would
+    void Done();
+
+   private:
+    ScanGovernor *governor_;
+    dev_t dev_;
+    uint64_t calls_ = 0;   // Made so far
+    uint64_t start_ = 0;   // When the slot was taken (ScanStats::Now())
+    uint64_t waited_ = 0;  // Nanoseconds spent waiting for the rate limit
+  };
+
+  /**
+   * Throttle - Wait until calls more on a filesystem keep to the rate limit
+   *
+   * @param dev: The filesystem's device
+   * @param calls: Number of calls about to be made
+   * @return: Nanoseconds waited
+   */
+  uint64_t Throttle(dev_t dev, uint64_t calls);
+
+  // Whether calls are limited per filesystem, so the scan has to know devices
+  bool RateLimited() const { return rate_ != 0; }
+
+  // Current number of directories that may be read at once
+  unsigned Limit() const;
+
+ private:
+  // Take a slot, waiting while all are in use
+  void Begin();
+
+  // Give back a slot held for calls taking busy nanoseconds, and adjust the limit at
+  // the end of a window
+  void End(uint64_t calls, uint64_t busy);
+
+  const unsigned max_reads_;
+  const bool adaptive_;
+  const uint64_t rate_;  // Calls per second per device (0 = no limit)
+
+  mutable std::mutex mutex_;       // Guards the controller's state below
+  std::condition_variable slot_cv_;  // Signalled when a slot is freed or added
+  unsigned limit_;                 // Slots
+  unsigned in_use_ = 0;            // Slots taken
+  bool slow_start_ = true;         // Still doubling the limit
+  double baseline_ = 0;            // Lowest (drifting) latency per call, nanoseconds
+  uint64_t window_start_ = 0;      // ScanStats::Now() at the start of the window
+  uint64_t window_calls_ = 0;      // Calls reported during the window
+  uint64_t window_busy_ = 0;       // and the nanoseconds they took
+  bool window_full_ = false;       // Whether every slot was in use during the window
+
+  std::mutex rate_mutex_;  // Guards next_call_
+  std::unordered_map<dev_t, std::chrono::steady_clock::time_point> next_call_;
+};
+
+#endif  // SCAN_GOVERNOR_H
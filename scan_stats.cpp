@@ -0,0 +1,247 @@
+/*
+ * scan_stats.cpp
+ *
+ * Sharded scan counters, and their progress line and JSON summary.
+ */
+
+#include "scan_stats.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+
+namespace {
+// Names of the ScanCall kinds in the progress line and the summary
+constexpr const char *kCallNames[kScanCalls] = {"getdents", "stat", "open", "ring_batch"};
+
+// Next shard handed to a thread that records for the first time
+std::atomic<unsigned> next_shard{0};
+
+// Add to a counter only the calling thread's shard is likely to touch
+inline void Bump(std::atomic<uint64_t> &counter, uint64_t value) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// Print s as a JSON string. Bytes that aren't ASCII are passed through as they are.
+void PrintJsonString(FILE *out, const std::string &s) {
+  fputc('"', out);
+  for (char ch : s) {
+    auto c = (unsigned char)ch;
+    if (c == '"' || c == '\\') {
+      fputc('\\', out);
+      fputc(c, out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// Upper bound in nanoseconds of the latencies in a histogram bucket
+uint64_t BucketLimit(size_t bucket) { return uint64_t(1) << bucket; }
+
+// Smallest bucket limit that at least fraction of the calls in buckets fall under
+uint64_t Percentile(const uint64_t *buckets, size_t count, uint64_t calls,
+                    double fraction) {
+  uint64_t seen = 0;
+  for (size_t i = 0; i < count; ++i) {
+    seen += buckets[i];
+    if (calls > 0 && double(seen) >= fraction * double(calls)) {
+      return BucketLimit(i);
+    }
+  }
+  return 0;
+}
+}  // namespace
+
+// Implementation of ScanStats::ScanStats
+ScanStats::ScanStats() : start_(Now()) {}
+
+// Implementation of ScanStats::~ScanStats
+ScanStats::~ScanStats() { StopProgress(); }
+
+// Implementation of ScanStats::Now
+uint64_t ScanStats::Now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return uint64_t(now.tv_sec) * 1000000000 + uint64_t(now.tv_nsec);
+}
+
+// Implementation of ScanStats::ThreadShard
+ScanStats::Shard &ScanStats::ThreadShard() {
+  thread_local unsigned shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+  return shards_[shard % kShards];
+}
+
+// Implementation of ScanStats::Record
+void ScanStats::Record(ScanCall call, uint64_t start, bool failed) {
+  uint64_t elapsed = Now() - start;
+  size_t bucket = std::min<size_t>(std::bit_width(elapsed), kBuckets - 1);
+  Shard &shard = ThreadShard();
+  size_t c = size_t(call);
+  Bump(shard.calls[c], 1);
+  Bump(shard.failed[c], failed);
+  Bump(shard.nanos[c], elapsed);
+  Bump(shard.buckets[c][bucket], 1);
+}
+
+// Implementation of ScanStats::Count
+void ScanStats::Count(ScanCall call, uint64_t calls, uint64_t failed) {
+  Shard &shard = ThreadShard();
+  Bump(shard.calls[size_t(call)], calls);
+  Bump(shard.failed[size_t(call)], failed);
+}
+
+// Implementation of ScanStats::DirectoryRead
+bool ScanStats::DirectoryRead(unsigned depth, size_t entries, uint64_t elapsed) {
+  Shard &shard = ThreadShard();
+  Bump(shard.dirs, 1);
+  Bump(shard.entries, entries);
+  depth_.store(depth, std::memory_order_relaxed);
+  unsigned max_depth = max_depth_.load(std::memory_order_relaxed);
+  while (depth > max_depth &&
+         !max_depth_.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed)) {
+  }
+  return elapsed > slow_floor_.load(std::memory_order_relaxed);
+}
+
+// Implementation of ScanStats::AddSlow
+void ScanStats::AddSlow(std::string path, size_t entries, uint64_t elapsed) {
+  std::lock_guard<std::mutex> lock(slow_mutex_);
+  if (slowest_.size() == kSlowest) {
+    if (elapsed <= slowest_.back().elapsed) {
+      return;  // Overtaken by another thread since DirectoryRead()
+    }
+    slowest_.pop_back();
+  }
+  auto pos = std::find_if(slowest_.begin(), slowest_.end(),
+                          [&](const SlowDir &dir) { return dir.elapsed < elapsed; });
+  slowest_.insert(pos, SlowDir{std::move(path), entries, elapsed});
+  if (slowest_.size() == kSlowest) {
+    slow_floor_.store(slowest_.back().elapsed, std::memory_order_relaxed);
+  }
+}
+
+// Implementation of ScanStats::Sum
+ScanStats::Totals ScanStats::Sum() const {
+  Totals totals;
+  for (const Shard &shard : shards_) {
+    for (size_t c = 0; c < kScanCalls; ++c) {
+      totals.calls[c] += shard.calls[c].load(std::memory_order_relaxed);
+      totals.failed[c] += shard.failed[c].load(std::memory_order_relaxed);
+      totals.nanos[c] += shard.nanos[c].load(std::memory_order_relaxed);
+      for (size_t b = 0; b < kBuckets; ++b) {
+        totals.buckets[c][b] += shard.buckets[c][b].load(std::memory_order_relaxed);
+      }
+    }
+    totals.dirs += shard.dirs.load(std::memory_order_relaxed);
+    totals.entries += shard.entries.load(std::memory_order_relaxed);
+  }
+  return totals;
+}
+
+// Implementation of ScanStats::StartProgress
+void ScanStats::StartProgress(FILE *out, unsigned interval_ms) {
+  StopProgress();
+  stop_ = false;
+  progress_ = std::thread(&ScanStats::ProgressLoop, this, out, std::max(interval_ms, 1u));
+}
+
+// Implementation of ScanStats::StopProgress
+void ScanStats::StopProgress() {
+  if (!progress_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(progress_mutex_);
+    stop_ = true;
+  }
+  progress_cv_.notify_all();
+  progress_.join();
+}
+
+// Implementation of ScanStats::ProgressLoop
+void ScanStats::ProgressLoop(FILE *out, unsigned interval_ms) {
+  uint64_t last_time = start_;
+  uint64_t last_entries = 0;
+  std::unique_lock<std::mutex> lock(progress_mutex_);
+  while (!progress_cv_.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                                [this] { return stop_; })) {
+    Totals totals = Sum();
+    uint64_t now = Now();
+    double rate = double(totals.entries - last_entries) * 1e9 / double(now - last_time);
+    last_time = now;
+    last_entries = totals.entries;
+    // One fprintf per line, so that it comes out whole
+    fprintf(out,
+            "[%.1fs] %llu entries (%.0f/s) in %llu dirs, depth %u (max %u), "
+            "getdents %llu, stat %llu, open %llu, %.1f MiB out\n",
+            double(now - start_) / 1e9, (unsigned long long)totals.entries, rate,
+            (unsigned long long)totals.dirs, depth_.load(std::memory_order_relaxed),
+            max_depth_.load(std::memory_order_relaxed),
+            (unsigned long long)totals.calls[size_t(ScanCall::kGetdents)],
+            (unsigned long long)totals.calls[size_t(ScanCall::kStat)],
+            (unsigned long long)totals.calls[size_t(ScanCall::kOpen)],
+            double(emitted_.load(std::memory_order_relaxed)) / (1 << 20));
+    fflush(out);
+  }
+}
+
+// Implementation of ScanStats::WriteJson
+void ScanStats::WriteJson(FILE *out) const {
+  Totals totals = Sum();
+  double elapsed = double(Now() - start_) / 1e9;
+  fprintf(out,
+          "{\n  \"elapsed_seconds\": %.6f,\n  \"directories\": %llu,\n"
+          "  \"entries\": %llu,\n  \"entries_per_second\": %.1f,\n"
+          "  \"max_depth\": %u,\n  \"bytes_emitted\": %llu,\n  \"calls\": {",
+          elapsed, (unsigned long long)totals.dirs, (unsigned long long)totals.entries,
+          elapsed > 0 ? double(totals.entries) / elapsed : 0.0,
+          max_depth_.load(std::memory_order_relaxed),
+          (unsigned long long)emitted_.load(std::memory_order_relaxed));
+  for (size_t c = 0; c < kScanCalls; ++c) {
+    uint64_t timed = 0;
+    for (uint64_t count : totals.buckets[c]) {
+      timed += count;
+    }
+    fprintf(out,
+            "%s\n    \"%s\": {\"count\": %llu, \"failed\": %llu, \"timed\": %llu, "
+            "\"total_seconds\": %.6f, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+            "\"p99_ns\": %llu,\n      \"histogram_ns\": {",
+            c ? "," : "", kCallNames[c], (unsigned long long)totals.calls[c],
+            (unsigned long long)totals.failed[c], (unsigned long long)timed,
+            double(totals.nanos[c]) / 1e9,
+            (unsigned long long)Percentile(totals.buckets[c], kBuckets, timed, 0.5),
+            (unsigned long long)Percentile(totals.buckets[c], kBuckets, timed, 0.9),
+            (unsigned long long)Percentile(totals.buckets[c], kBuckets, timed, 0.99));
+    // Upper bound of each non-empty bucket (the last one has none)
+    const char *separator = "";
+    for (size_t b = 0; b < kBuckets; ++b) {
+      if (totals.buckets[c][b] == 0) {
+        continue;
+      }
+      if (b + 1 == kBuckets) {
+        fprintf(out, "%s\"inf\": %llu", separator,
+                (unsigned long long)totals.buckets[c][b]);
+      } else {
+        fprintf(out, "%s\"%llu\": %llu", separator, (unsigned long long)BucketLimit(b),
+                (unsigned long long)totals.buckets[c][b]);
+      }
+      separator = ", ";
+    }
+    fprintf(out, "}}");
+  }
+  fprintf(out, "\n  },\n  \"slowest_directories\": [");
+  std::lock_guard<std::mutex> lock(slow_mutex_);
+  for (size_t i = 0; i < slowest_.size(); ++i) {
+    fprintf(out, "%s\n    {\"path\": ", i ? "," : "");
+    PrintJsonString(out, slowest_[i].path);
+    fprintf(out, ", \"entries\": %zu, \"seconds\": %.6f}", slowest_[i].entries,
+            double(slowest_[i].elapsed) / 1e9);
+  }
+  fprintf(out, "%s]\n}\n", slowest_.empty() ? "" : "\n  ");
+}
@@ -0,0 +1,161 @@
+/*
+ * scan_stats.h
+ *
+ * Header file for the counters and latency histograms a scan can keep, and their
+ * periodic progress line and final JSON summary.
+ */
+
+#ifndef SCAN_STATS_H
+#define SCAN_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The system calls a scan keeps count of
+enum class ScanCall {
+  kGetdents,   // getdents64
+  kStat,       // statx or fstatat
+  kOpen,       // Opening a subdirectory
+  kRingBatch,  // Waiting for one directory's io_uring batch
+};
+inline constexpr size_t kScanCalls = 4;
+
+/**
+ * ScanStats - What a scan has done so far, and how long its calls took
+ *
+ * Counts calls, failures and time per kind of call, with a histogram of latencies in
+ * power-of-two buckets of nanoseconds, plus the directories and entries read, the
+ * deepest directory, the bytes of output written and the slowest directories. The
+ * scan records into it from any thread; the counters are spread over a few shards of
+ * relaxed atomics picked per thread, so the threads rarely share a cache line. A scan
+ * without a ScanStats (ScanOptions::stats unset) does no timing at all.
+ *
+ * Calls queued in an io_uring batch are counted but have no latency of their own;
+ * the wait for the whole batch is timed as a kRingBatch call instead.
+ */
+class ScanStats {
+ public:
+  ScanStats();
+  ~ScanStats();
+
+  ScanStats(const ScanStats &) = delete;
+  ScanStats &operator=(const ScanStats &) = delete;
+
+  // Current CLOCK_MONOTONIC time in nanoseconds, to pass to Record() afterwards
+  static uint64_t Now();
+
+  /**
+   * Record - Count one call that has just returned
+   *
+   * @param call: Kind of call
+   * @param start: Now() from just before the call
+   * @param failed: Whether it failed
+   */
+  void Record(ScanCall call, uint64_t start, bool failed);
+
+  // Count calls made without timing each (queued in an io_uring batch)
+  void Count(ScanCall call, uint64_t calls, uint64_t failed);
+
+  /**
+   * DirectoryRead - Count a directory whose entries have all been read
+   *
+   * @param depth: Levels below the root (0 for the root)
+   * @param entries: Entries it holds
+   * @param elapsed: Nanoseconds its names and metadata took to read
+   * @return: Whether it is among the slowest so far, in which case the caller passes
+   *          its path to AddSlow()
+   */
+  bool DirectoryRead(unsigned depth, size_t entries, uint64_t elapsed);
+
+  // Rank a directory DirectoryRead() reported as slow
+  void AddSlow(std::string path, size_t entries, uint64_t elapsed);
+
+  // Count bytes of output written
+  void AddEmitted(size_t bytes) {
+    emitted_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  /**
+   * StartProgress - Print a progress line periodically from a thread of its own
+   *
+   * @param out: Stream to print to (normally stderr)
+   * @param interval_ms: Milliseconds between lines
+   *
+   * Lines stop at StopProgress() or when the ScanStats is destroyed.
+   */
+  void StartProgress(FILE *out, unsigned interval_ms);
+  void StopProgress();
+
+  /**
+   * WriteJson - Print everything recorded as one JSON object
+   *
+   * @param out: Stream to print to
+   */
+  void WriteJson(FILE *out) const;
+
+ private:
+  // Power-of-two latency buckets: bucket i holds latencies in [2^(i-1), 2^i) ns, with
+  // the last one holding everything longer
+  static constexpr size_t kBuckets = 40;
+  static constexpr size_t kShards = 16;  // Power of two
+  static constexpr size_t kSlowest = 10;  // Slowest directories kept
+
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> calls[kScanCalls] = {};
+    std::atomic<uint64_t> failed[kScanCalls] = {};
+    std::atomic<uint64_t> nanos[kScanCalls] = {};
+    std::atomic<uint64_t> buckets[kScanCalls][kBuckets] = {};
+    std::atomic<uint64_t> dirs{0};
+    std::atomic<uint64_t> entries{0};
+  };
+
+  // Totals over the shards
+  struct Totals {
+    uint64_t calls[kScanCalls] = {};
+    uint64_t failed[kScanCalls] = {};
+    uint64_t nanos[kScanCalls] = {};
+    uint64_t buckets[kScanCalls][kBuckets] = {};
+    uint64_t dirs = 0;
+    uint64_t entries = 0;
+  };
+
+  struct SlowDir {
+    std::string path;
+    size_t entries;
+    uint64_t elapsed;
+  };
+
+  // The calling thread's shard
+  Shard &ThreadShard();
+
+  // Add up the shards
+  Totals Sum() const;
+
+  // Body of the progress thread
+  void ProgressLoop(FILE *out, unsigned interval_ms);
+
+  uint64_t start_;  // Now() at construction
+  Shard shards_[kShards];
+  std::atomic<unsigned> depth_{0};      // Depth of the last directory read
+  std::atomic<unsigned> max_depth_{0};  // Of every directory read
+  std::atomic<uint64_t> emitted_{0};
+
+  mutable std::mutex slow_mutex_;       // Guards slowest_
+  std::vector<SlowDir> slowest_;        // Slowest first
+  std::atomic<uint64_t> slow_floor_{0};  // Fastest time in a full slowest_, else 0
+
+  std::mutex progress_mutex_;           // Guards stop_
+  std::condition_variable progress_cv_;  // Signalled to stop the progress thread
+  bool stop_ = false;
+  std::thread progress_;
+};
+
+#endif  // SCAN_STATS_H
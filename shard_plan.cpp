@@ -0,0 +1,124 @@
+/*
+ * shard_plan.cpp
+ *
+ * Balancing a tree's top-level entries over shards, and reading and writing the plan.
+ */
+
+#include "shard_plan.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+#include "digest.h"
+
+// Implementation of ShardPlan::Make
+ShardPlan ShardPlan::Make(unsigned count,
+                          std::vector<std::pair<std::string, uint64_t>> weights) {
+  ShardPlan plan;
+  plan.count_ = std::max(count, 1u);
+
+  // Largest first (by name among equals, so the plan doesn't depend on the input's
+  // order), each to the lightest shard so far
+  std::sort(weights.begin(), weights.end(), [](const auto &a, const auto &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  std::vector<uint64_t> load(plan.count_, 0);
+  for (auto &[name, weight] : weights) {
+    size_t lightest = size_t(std::min_element(load.begin(), load.end()) - load.begin());
+    load[lightest] += weight;
+    plan.entries_.push_back(Entry{std::move(name), unsigned(lightest + 1), weight});
+  }
+  std::sort(plan.entries_.begin(), plan.entries_.end(),
+            [](const Entry &a, const Entry &b) { return a.name < b.name; });
+  return plan;
+}
+
+// Implementation of ShardPlan::Load
+ShardPlan ShardPlan::Load(const char *filename) {
+  std::unique_ptr<FILE, int (*)(FILE *)> file(fopen(filename, "r"), fclose);
+  if (!file) {
+    throw std::runtime_error(std::string("Cannot open ") + filename + ": " +
+                             strerror(errno));
+  }
+  std::string text;
+  char block[65536];
+  for (size_t got; (got = fread(block, 1, sizeof(block), file.get())) > 0;) {
+    text.append(block, got);
+  }
+  if (ferror(file.get())) {
+    throw std::runtime_error(std::string("Error reading ") + filename + ": " +
+                             strerror(errno));
+  }
+  auto invalid = [&](size_t line) {
+    return std::runtime_error(std::string("'") + filename +
+                              "' is not a shard plan at line " + std::to_string(line));
+  };
+
+  ShardPlan plan;
+  unsigned count;
+  char extra;
+  size_t header_end = text.find('\n');
+  if (header_end == std::string::npos ||
+      sscanf(text.substr(0, header_end).c_str(), "shards %u %c", &count, &extra) != 1 ||
+      !count) {
+    throw invalid(1);
+  }
+  plan.count_ = count;
+  size_t line = 1;
+  for (size_t pos = header_end + 1; pos < text.size();) {
+    ++line;
+    size_t nul = text.find('\0', pos);
+    size_t eol = nul == std::string::npos ? nul : text.find('\n', nul);
+    if (eol == std::string::npos || nul == pos) {
+      throw invalid(line);
+    }
+    Entry entry{text.substr(pos, nul - pos), 0, 0};
+    std::string numbers = text.substr(nul + 1, eol - nul - 1);
+    unsigned long long weight;
+    if (sscanf(numbers.c_str(), " %u %llu %c", &entry.shard, &weight, &extra) != 2 ||
+        entry.shard < 1 || entry.shard > count ||
+        (!plan.entries_.empty() && plan.entries_.back().name >= entry.name)) {
+      throw invalid(line);
+    }
+    entry.weight = weight;
+    plan.entries_.push_back(std::move(entry));
+    pos = eol + 1;
+  }
+  return plan;
+}
+
+// Implementation of ShardPlan::Write
+void ShardPlan::Write(FILE *out) const {
+  fprintf(out, "shards %u\n", count_);
+  for (const Entry &entry : entries_) {
+    fwrite(entry.name.data(), 1, entry.name.size() + 1, out);  // With its NUL
+    fprintf(out, " %u %llu\n", entry.shard, (unsigned long long)entry.weight);
+  }
+  if (fflush(out) != 0 || ferror(out)) {
+    throw std::runtime_error(std::string("Error writing shard plan: ") + strerror(errno));
+  }
+}
+
+// Implementation of ShardPlan::ShardOf
+unsigned ShardPlan::ShardOf(std::string_view name) const {
+  auto it = std::lower_bound(
+      entries_.begin(), entries_.end(), name,
+      [](const Entry &entry, std::string_view key) { return entry.name < key; });
+  if (it != entries_.end() && it->name == name) {
+    return it->shard;
+  }
+  return unsigned(DirDigest::HashName(name, 0) % count_) + 1;
+}
+
+// Implementation of ShardPlan::Weight
+uint64_t ShardPlan::Weight(unsigned shard) const {
+  uint64_t weight = 0;
+  for (const Entry &entry : entries_) {
+    weight += entry.shard == shard ? entry.weight : 0;
+  }
+  return weight;
+}
@@ -0,0 +1,85 @@
+/*
+ * shard_plan.h
+ *
+ * Header file for the partition of a tree's top-level entries into shards, each
+ * scanned on its own (e.g. on another host) and merged into one snapshot afterwards.
+ *
+ * Plan format: a first line "shards N\n", then one line per planned entry:
+ *   name '\0' ' ' shard ' ' weight '\n'
+ * with the shard (1 to N) and the weight (entries of its subtree, itself included) in
+ * decimal, sorted by name. The NUL allows names with embedded linefeeds, as in a
+ * listing.
+ */
+
+#ifndef SHARD_PLAN_H
+#define SHARD_PLAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * ShardPlan - Which shard each of the root's entries belongs to
+ *
+ * The planned entries are given to the shards largest first, each to the one with the
+ * least weight so far. An entry the plan doesn't know (made since the snapshot it was
+ * made from) is given to a shard by a hash of its name, so that every scan of a shard
+ * agrees on it and the shards together still cover the whole tree.
+ */
+class ShardPlan {
+ public:
+  /**
+   * Make - Factory function to balance entries over shards
+   *
+   * @param count: Number of shards (at least 1)
+   * @param weights: Each top-level entry's name and weight, e.g. the number of entries
+   *                 of its subtree in the previous snapshot
+   * @return: The plan
+   */
+  static ShardPlan Make(unsigned count,
+                        std::vector<std::pair<std::string, uint64_t>> weights);
+
+  /**
+   * Load - Factory function to read a plan written by Write()
+   *
+   * @param filename: Path of the plan
+   * @return: The plan
+   *
+   * Throws std::runtime_error if the file can't be read or isn't a plan.
+   */
+  static ShardPlan Load(const char *filename);
+
+  /**
+   * Write - Print the plan (see the format above)
+   *
+   * @param out: Stream to print to
+   *
+   * Throws std::runtime_error if it can't be written.
+   */
+  void Write(FILE *out) const;
+
+  // Number of shards
+  unsigned Count() const { return count_; }
+
+  // Shard (1 to Count()) a top-level entry belongs to
+  unsigned ShardOf(std::string_view name) const;
+
+  // Sum of the weights of the entries planned for a shard (1 to Count())
+  uint64_t Weight(unsigned shard) const;
+
+ private:
+  struct Entry {
+    std::string name;
+    unsigned shard;
+    uint64_t weight;
+  };
+
+  unsigned count_ = 1;
+  std::vector<Entry> entries_;  // Sorted by name
+};
+
+#endif  // SHARD_PLAN_H
@@ -0,0 +1,149 @@
+/*
+ * snapshot_index.cpp
+ *
+ * Loading of a snapshot's index, and lookups through it.
+ */
+
+#include "snapshot_index.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "snapshot_writer.h"
+
+// Implementation of SnapshotIndex::SnapshotIndex
+SnapshotIndex::SnapshotIndex(const char *snapshot, const char *index)
+    : index_name_(index), reader_(snapshot) {
+  // The index is small (one entry per kIndexSpacing bytes), so it is read whole
+  FILE *file = fopen(index, "r");
+  if (!file) {
+    throw std::runtime_error("Cannot open " + index_name_ + ": " + strerror(errno));
+  }
+  std::string data;
+  char block[65536];
+  size_t len;
+  while ((len = fread(block, 1, sizeof(block), file)) > 0) {
+    data.append(block, len);
+  }
+  bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    throw std::runtime_error("Error reading '" + index_name_ + "': " + strerror(errno));
+  }
+  if (data.size() <= sizeof(kIndexMagic) ||
+      memcmp(data.data(), kIndexMagic, sizeof(kIndexMagic)) != 0) {
+    throw std::runtime_error("'" + index_name_ + "' is not a snapshot index");
+  }
+  unsigned version = (unsigned char)data[sizeof(kIndexMagic)];
+  if (version != kIndexVersion) {
+    throw std::runtime_error("Unsupported index version " + std::to_string(version) +
+                             " in '" + index_name_ + "'");
+  }
+
+  // Entries up to the empty one, then the trailer
+  const char *p = data.data() + sizeof(kIndexMagic) + 1;
+  const char *end = data.data() + data.size();
+  std::string path;
+  uint64_t offset = 0, records = 0;
+  for (;;) {
+    uint64_t shared, suffix_len;
+    if (!(p = DecodeVarint(p, end, &shared)) ||
+        !(p = DecodeVarint(p, end, &suffix_len))) {
+      Corrupt();
+    }
+    if (suffix_len == 0) {
+      break;
+    }
+    if (shared > path.size() || suffix_len > size_t(end - p)) {
+      Corrupt();
+    }
+    path.resize(size_t(shared));
+    path.append(p, size_t(suffix_len));
+    p += suffix_len;
+    uint64_t offset_delta, records_delta;
+    if (!(p = DecodeVarint(p, end, &offset_delta)) ||
+        !(p = DecodeVarint(p, end, &records_delta))) {
+      Corrupt();
+    }
+    offset += offset_delta;
+    records += records_delta;
+    entries_.push_back(Entry{path, offset, records});
+  }
+  uint64_t count, size, total_records;
+  if (!(p = DecodeVarint(p, end, &count)) || !(p = DecodeVarint(p, end, &size)) ||
+      !(p = DecodeVarint(p, end, &total_records)) || p != end ||
+      count != entries_.size()) {
+    Corrupt();
+  }
+
+  // An index of another snapshot, or of an earlier one at the same path, would send
+  // the lookups astray. The size is the snapshot's own, even if it is compressed.
+  if (reader_.ContentSize() != size) {
+    throw std::runtime_error("'" + index_name_ + "' is not the index of '" +
+                             std::string(snapshot) + "'");
+  }
+}
+
+// Implementation of SnapshotIndex::Corrupt
+void SnapshotIndex::Corrupt() const {
+  throw std::runtime_error("Corrupt snapshot index '" + index_name_ + "'");
+}
+
+// Implementation of SnapshotIndex::SeekTo
+bool SnapshotIndex::SeekTo(std::string_view path, TraverseRecord *record) {
+  if (entries_.empty()) {
+    return false;  // An empty snapshot
+  }
+  auto it = std::upper_bound(entries_.begin(), entries_.end(), path,
+                             [](std::string_view key, const Entry &entry) {
+                               return ComparePaths(key, entry.path) < 0;
+                             });
+  if (it != entries_.begin()) {
+    --it;
+  }
+  reader_.Seek(it->offset, it->records);
+  while (reader_.Next(record)) {
+    if (ComparePaths(record->path, path) >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Implementation of SnapshotIndex::Find
+bool SnapshotIndex::Find(std::string_view path, TraverseRecord *record) {
+  return SeekTo(path, record) && record->path == path;
+}
+
+// Implementation of SnapshotIndex::List
+size_t SnapshotIndex::List(std::string_view path,
+                           const std::function<void(const TraverseRecord &)> &visit) {
+  TraverseRecord record;
+  if (path.empty()) {
+    // Everything, from the first record
+    size_t count = 0;
+    if (!entries_.empty()) {
+      reader_.Seek(entries_[0].offset, entries_[0].records);
+      for (; reader_.Next(&record); ++count) {
+        visit(record);
+      }
+    }
+    return count;
+  }
+  if (!Find(path, &record)) {
+    return 0;
+  }
+  // The entries below a directory come right after it
+  std::string prefix(path);
+  prefix += '/';
+  size_t count = 0;
+  do {
+    visit(record);
+    ++count;
+  } while (reader_.Next(&record) && record.path.starts_with(prefix));
+  return count;
+}
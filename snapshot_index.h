@@ -0,0 +1,110 @@
+/*
+ * snapshot_index.h
+ *
+ * Header file for the sparse index of a snapshot, and for looking up paths in the
+ * snapshot through it without reading the rest.
+ *
+ * Index format (version 1), written alongside a snapshot by SnapshotWriter:
+ *   header:  the 7 bytes of kIndexMagic, then one version byte
+ *   entries: one for the first record, then one for the first record at least
+ *            kIndexSpacing bytes after the last one indexed, in Traverse() order:
+ *              varint shared      bytes of the previous entry's path reused
+ *              varint suffix_len  length of the rest of the path (never 0)
+ *              suffix_len bytes   rest of the path
+ *              varint offset      offset of the record in the snapshot, minus the
+ *                                 previous entry's (or 0)
+ *              varint records     records before it in the snapshot, minus the
+ *                                 previous entry's (or 0)
+ *   trailer: varint 0, varint 0, then varint entries, varint size of the snapshot in
+ *            bytes and varint records in the snapshot
+ *
+ * A binary record the index points at shares no part of its path with the record
+ * before, so it can be decoded on its own; text records always can. Varints are as in
+ * snapshot_writer.h.
+ */
+
+#ifndef SNAPSHOT_INDEX_H
+#define SNAPSHOT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "traverse_reader.h"
+
+// First bytes of an index
+inline constexpr char kIndexMagic[7] = {'\0', 'F', 'L', 'I', 'N', 'D', 'X'};
+
+// Version written by SnapshotWriter
+inline constexpr unsigned char kIndexVersion = 1;
+
+// Fewest bytes of the snapshot between indexed records. A lookup reads at most about
+// this much of the snapshot, and the index holds one entry per this many bytes.
+inline constexpr uint64_t kIndexSpacing = 64 * 1024;
+
+/**
+ * SnapshotIndex - Random access to a snapshot through its index
+ *
+ * Loads the index, then answers each query by a binary search of it for the last
+ * indexed record at or before the path in Traverse() order, seeking the snapshot there
+ * and reading on from it. A subtree follows its directory's record directly, so it is
+ * listed by reading on until the paths leave it.
+ */
+class SnapshotIndex {
+ public:
+  /**
+   * Constructor - Open a snapshot and load its index
+   *
+   * @param snapshot: Path of the snapshot (text or binary, maybe compressed)
+   * @param index: Path of the index written with it
+   *
+   * Throws std::runtime_error if either can't be read, or if the index isn't the one
+   * of this snapshot (as far as its size tells).
+   */
+  SnapshotIndex(const char *snapshot, const char *index);
+
+  /**
+   * Find - Look up one entry
+   *
+   * @param path: Its path relative to the root, as in the snapshot
+   * @param record: Filled in with the entry if found (its strings are valid until the
+   *                next query)
+   * @return: Whether the snapshot has the entry
+   */
+  bool Find(std::string_view path, TraverseRecord *record);
+
+  /**
+   * List - Visit an entry and everything below it, in Traverse() order
+   *
+   * @param path: Path of the entry relative to the root (empty for the whole snapshot)
+   * @param visit: Called for each record
+   * @return: Number of records visited (0 if the snapshot doesn't have the entry)
+   */
+  size_t List(std::string_view path,
+              const std::function<void(const TraverseRecord &)> &visit);
+
+ private:
+  // An indexed record
+  struct Entry {
+    std::string path;
+    uint64_t offset;   // In the snapshot
+    uint64_t records;  // Before it
+  };
+
+  // Read on from the last indexed record at or before path to the first record at or
+  // after it. Returns false if there is none.
+  bool SeekTo(std::string_view path, TraverseRecord *record);
+
+  // Throw an error about a malformed index
+  [[noreturn]] void Corrupt() const;
+
+  std::string index_name_;
+  TraverseReader reader_;
+  std::vector<Entry> entries_;  // In Traverse() order
+};
+
+#endif  // SNAPSHOT_INDEX_H
@@ -0,0 +1,258 @@
+/*
+ * snapshot_writer.h
+ *
+ * Header file for writing snapshots of a directory tree, either as the text listing
+ * printed by DirLevel::Traverse() or in the compact binary format described below.
+ *
+ * Text format: one line per entry, in Traverse() order:
+ *   path '\0' ' ' type ' ' size ' ' YYYY-MM-DD HH:MM:SS.nnnnnnnnn [' ' hash] '\n'
+ * with the type and size in decimal and the mtime in UTC, each field as printf()
+ * formats it from gmtime()'s results (%d %lu %04u-%02u-%02u %02u:%02u:%02u.%09lu).
+ * The hash of a regular file's contents (see ContentHasher) follows only if it was
+ * computed, as 16 lowercase hex digits (%016llx), and the inode number only if it was
+ * recorded, as 'i' and the number in decimal (i%llu). A size or mtime not recorded
+ * (see EntryField) is written as '-'.
+ *
+ * Binary format (version 5):
+ *   header:  the 7 bytes of kSnapshotMagic, one version byte, then one byte of the
+ *            EntryField bits kFieldSize and kFieldMtime the records have
+ *   records: one per entry, in Traverse() order:
+ *              varint shared      bytes of the previous record's path reused
+ *              varint suffix_len  length of the rest of the path
+ *              suffix_len bytes   rest of the path, followed by a NUL
+ *              varint type        file type (DT_REG, DT_DIR, etc.) times 4, plus 2 if
+ *                                 an inode number follows, plus 1 if a content hash does
+ *              [varint size]      file size in bytes
+ *              [varint seconds]   mtime seconds, zigzag encoded
+ *              [varint nanosecs]  mtime nanoseconds
+ *              [8 bytes]          the content hash, little-endian
+ *              [varint inode]     the inode number
+ *            and after the last entry below each directory (the root included):
+ *              varint 0, varint 0 (an empty record), varint kDirClosed
+ *              8 bytes            the directory's DirDigest (see digest.h), little-endian
+ *   trailer: varint 0, varint 0, varint kSnapshotEnd, then varint record count
+ *
+ * Every directory is closed in turn, innermost first, so a reader can tell which
+ * directory a digest belongs to by keeping a stack of the directories seen. Version 1
+ * had no digests, and its trailer was just varint 0, varint 0, varint record count.
+ * Versions 1 and 2 had no content hashes, and stored the type as it is; version 3
+ * had no inode numbers, and stored the type times 2 plus the hash bit. Before version 5
+ * there was no byte of fields, and every record had a size and an mtime.
+ *
+ * Either format can be compressed (see Compress()) into the frames described in
+ * compressed_file.h; offsets in the index still count bytes of the snapshot itself.
+ *
+ * Varints are little-endian base 128 (7 bits per byte, high bit set on all but the
+ * last byte). The shared prefix never reaches into the entry's own name, so every name
+ * is stored whole, and NUL-terminated, in the file. A record the snapshot's index
+ * points at (see snapshot_index.h) shares nothing, so reading can start there.
+ */
+
+#ifndef SNAPSHOT_WRITER_H
+#define SNAPSHOT_WRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compressed_file.h"
+#include "digest.h"
+#include "dir_level.h"
+
+class ScanStats;
+
+// First bytes of a binary snapshot. A text listing never starts with a NUL.
+inline constexpr char kSnapshotMagic[7] = {'\0', 'F', 'L', 'S', 'N', 'A', 'P'};
+
+// Version written by SnapshotWriter
+inline constexpr unsigned char kSnapshotVersion = 5;
+
+// Kinds of binary records that follow an empty record (from version 2)
+inline constexpr uint64_t kSnapshotEnd = 0;
+inline constexpr uint64_t kDirClosed = 1;
+
+// Longest varint encoding of a 64-bit value
+inline constexpr size_t kMaxVarint = 10;
+
+// Append value to out as a varint
+inline void AppendVarint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out += char((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += char(value);
+}
+
+// Decode a varint at p, not reading at or past end. Returns the byte after it, or
+// nullptr if it is truncated or too long.
+inline const char *DecodeVarint(const char *p, const char *end, uint64_t *value) {
+  uint64_t result = 0;
+  for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+    unsigned char byte = (unsigned char)*p++;
+    result |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+// Map signed to unsigned so that small magnitudes get short varints
+inline uint64_t ZigZag(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+inline int64_t UnZigZag(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+/**
+ * SnapshotWriter - Writes entries given in Traverse() order as a snapshot
+ *
+ * Entries are formatted into a large buffer by hand (text lines reuse the date and time
+ * of the previous entry when it has the same mtime second or day) and the buffer is
+ * written to the stream's descriptor with write(), bypassing stdio and its locking.
+ * Whatever was printed to the stream before is flushed first, but nothing else may be
+ * printed to it between the first Add() and Finish().
+ */
+class SnapshotWriter {
+ public:
+  enum class Format {
+    kText,    // Traverse() listing
+    kBinary,  // Binary format
+  };
+
+  /**
+   * Constructor - Start a snapshot
+   *
+   * @param out: Stream to write to
+   * @param format: Format to write
+   * @param stats: Where to count the bytes written, or nullptr
+   */
+  SnapshotWriter(FILE *out, Format format, ScanStats *stats = nullptr);
+
+  // Writes out any text still buffered (e.g. when a scan failed part way), ignoring
+  // errors
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter &) = delete;
+  SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+
+  /**
+   * WriteIndex - Also write a sparse index of the snapshot (see snapshot_index.h)
+   *
+   * @param index: Stream to write the index to; it is complete after Finish()
+   *
+   * Offsets in the index count from the first byte this writer writes, so the
+   * snapshot should be a file of its own. Must be called before the first Add().
+   */
+  void WriteIndex(FILE *index);
+
+  /**
+   * Compress - Write the snapshot compressed, in frames (see compressed_file.h)
+   *
+   * @param threads: Number of threads to compress on while the entries are added
+   *
+   * Each block of records written out becomes a frame. Must be called before the
+   * first Add().
+   */
+  void Compress(unsigned threads);
+
+  /**
+   * SetFields - Choose the metadata to write
+   *
+   * @param fields: EntryField bits; a size or mtime not among them is left out (text
+   *                listings show '-'), while inode numbers and hashes are written
+   *                whenever an entry has one. kDefaultFields unless this is called.
+   *
+   * For a binary snapshot, must be called before the first Add().
+   */
+  void SetFields(unsigned fields);
+
+  /**
+   * Add - Write one entry
+   *
+   * @param dir: Path of the directory holding the entry, with trailing '/' (empty for
+   *             the root)
+   * @param info: The entry
+   *
+   * Throws std::runtime_error if the buffer had to be written out and that failed, or
+   * if a text entry's mtime can't be converted.
+   */
+  void Add(std::string_view dir, const EntryInfo &info);
+
+  /**
+   * Finish - Write the trailer (if any) and flush
+   *
+   * Throws std::runtime_error if anything couldn't be written.
+   */
+  void Finish();
+
+  /**
+   * Flush - Write out the records buffered so far
+   *
+   * For a stream of text records that is read as it is written. Throws
+   * std::runtime_error if they couldn't be written.
+   */
+  void Flush();
+
+ private:
+  // Format a text line into the buffer
+  void AddText(std::string_view dir, const EntryInfo &info);
+
+  // Format a text line with printf() and gmtime(), for values the fast path can't take
+  void AddTextSlow(std::string_view dir, const EntryInfo &info);
+
+  // Make stamp_ the date and time of seconds. Returns false for years outside 0..9999.
+  bool Stamp(int64_t seconds);
+
+  // Binary snapshots: end the innermost open directory with its digest
+  void CloseDir();
+
+  // Offset of the next byte of the snapshot
+  uint64_t Offset() const { return written_ + buffer_.size(); }
+
+  // Point the index at the record about to be added at the current offset
+  void AddIndexEntry(std::string_view dir, std::string_view name);
+
+  FILE *out_;
+  Format format_;
+  ScanStats *stats_;
+  unsigned fields_ = kDefaultFields;  // EntryField bits of size and mtime to write
+  std::string previous_;  // Path of the previous entry
+  std::string buffer_;    // Encoded records not yet written
+  uint64_t count_ = 0;    // Records written
+  uint64_t written_ = 0;  // Bytes written out (before compression)
+  std::unique_ptr<FrameWriter> frames_;  // Compressor, if the snapshot is compressed
+
+  // The index, if one is written: its stream, the records not yet written, the path
+  // of the last one, and where the next one is due
+  FILE *index_ = nullptr;
+  std::string index_buffer_;
+  std::string index_path_;
+  uint64_t index_offset_ = 0;
+  uint64_t index_record_ = 0;
+  uint64_t index_entries_ = 0;
+  uint64_t next_index_ = 0;
+
+  // Binary snapshots: the directories not yet closed (root first), and the path of the
+  // innermost one, with trailing '/'
+  struct OpenDir {
+    size_t parent_len;   // Length of open_path_ without this directory
+    uint64_t name_hash;  // DirDigest::HashName() of the directory's entry
+    DirDigest digest;    // Its entries so far
+  };
+  std::vector<OpenDir> open_dirs_;
+  std::string open_path_;
+
+  // "YYYY-MM-DD HH:MM:SS" of a text entry's mtime, for stamp_second_ in stamp_day_
+  char stamp_[19];
+  int64_t stamp_second_ = INT64_MIN;
+  int64_t stamp_day_ = INT64_MIN;
+};
+
+#endif  // SNAPSHOT_WRITER_H
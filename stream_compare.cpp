@@ -0,0 +1,233 @@
+/*
+ * stream_compare.cpp
+ *
+ * Merge-join of a directory tree and a Traverse() listing. Both sides come in the
+ * same order (a pre-order walk with each directory's entries sorted by name), so the
+ * pruning done by DirLevel::RemoveCommon() can be decided while walking them together:
+ * - an entry found on both sides with the same type, size and mtime (and not a
+ *   directory) is dropped from both;
+ * - a directory found on both sides is printed on a side only if something below it
+ *   is printed on that side, so its line is held back until then;
+ * - everything else is printed.
+ */
+
+#include "stream_compare.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "snapshot_writer.h"
+#include "traverse_reader.h"
+
+namespace {
+/*
+ * ReportSide - One side of the report: the chain of directories leading to the current
+ * entry, with the lines of those whose printing is being held back
+ */
+class ReportSide {
+ public:
+  explicit ReportSide(SnapshotWriter &out) : out_(out) {}
+
+  /*
+   * Enter - Make dir (with trailing '/', or empty for the root) the current directory
+   *
+   * Leaves the directories that don't contain it. Returns false if dir isn't one of
+   * the directories on the chain.
+   */
+  bool Enter(std::string_view dir) {
+    while (dir.substr(0, path_.size()) != path_) {
+      path_.resize(chain_.back().parent_len);
+      chain_.pop_back();
+    }
+    return dir == path_;
+  }
+
+  // Print an entry of the current directory, after any of its directories held back
+  void Print(const EntryInfo &info) {
+    for (Frame &frame : chain_) {
+      if (!frame.printed) {
+        std::string_view path(path_);
+        EntryInfo dir = frame.info;
+        dir.name = path.substr(frame.parent_len, frame.len - frame.parent_len - 1);
+        out_.Add(path.substr(0, frame.parent_len), dir);
+        frame.printed = true;
+      }
+    }
+    out_.Add(path_, info);
+  }
+
+  // Make a subdirectory of the current directory current. Unless printed, its line is
+  // held back until something below it is printed.
+  void Push(const EntryInfo &info, bool printed) {
+    size_t parent_len = path_.size();
+    path_ += info.name;
+    path_ += '/';
+    chain_.push_back(Frame{info, parent_len, path_.size(), printed});
+    chain_.back().info.name = {};  // Kept in path_ instead
+  }
+
+ private:
+  struct Frame {
+    EntryInfo info;     // The directory's metadata
+    size_t parent_len;  // Length of path_ up to the directory's name
+    size_t len;         // Length of path_ including the name and '/'
+    bool printed;       // The directory's own line has been printed
+  };
+
+  SnapshotWriter &out_;
+  std::string path_;  // Path of the current directory
+  std::vector<Frame> chain_;
+};
+
+// Print an entry that has no identical counterpart, and enter it if it is a directory
+void Report(ReportSide &side, const EntryInfo &info) {
+  side.Print(info);
+  if (info.type == DT_DIR) {
+    side.Push(info, true);
+  }
+}
+
+// Copy the rest of from to to
+void CopyFile(FILE *from, FILE *to) {
+  char buffer[65536];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+    fwrite(buffer, 1, len, to);
+  }
+  if (ferror(from)) {
+    throw std::runtime_error(std::string("Error reading temporary file: ") +
+                             strerror(errno));
+  }
+}
+}  // namespace
+
+// Implementation of StreamCompare
+void StreamCompare(const char *start_path, const char *input_file,
+                   const ScanOptions &options) {
+  TraverseReader reader(input_file);
+  std::unique_ptr<FILE, int (*)(FILE *)> spool(tmpfile(), fclose);
+  if (!spool) {
+    throw std::runtime_error(std::string("Cannot create temporary file: ") +
+                             strerror(errno));
+  }
+  SnapshotWriter path_out(stdout, SnapshotWriter::Format::kText);
+  SnapshotWriter file_out(spool.get(), SnapshotWriter::Format::kText);
+  ReportSide from_path(path_out);
+  ReportSide from_file(file_out);
+
+  // The current entry of each side, with its full path
+  std::string entry_path;
+  TraverseRecord record;
+  EntryInfo record_info{};
+  std::string_view record_dir;
+  std::string previous;  // Path of the previous record, to check the order
+  const ScanFilter &filter = options.filter;
+  std::string skipped;  // Path of the last directory left out, with trailing '/'
+
+  // Advance to the next record the filter keeps, splitting its path into directory and
+  // name. Everything below a directory left out follows it, so is skipped by its path.
+  auto next_record = [&]() {
+    size_t name_start;
+    for (;;) {
+      previous.assign(record.path);
+      if (!reader.Next(&record)) {
+        return false;
+      }
+      if (reader.LineNumber() > 1 && ComparePaths(previous, record.path) >= 0) {
+        throw std::runtime_error("'" + reader.Filename() +
+                                 "' is not in sorted order at line " +
+                                 std::to_string(reader.LineNumber()));
+      }
+      size_t last_slash = record.path.rfind('/');
+      name_start = last_slash != std::string_view::npos ? last_slash + 1 : 0;
+      record_dir = record.path.substr(0, name_start);
+      if (!filter.Active()) {
+        break;
+      }
+      if (!skipped.empty() && record.path.starts_with(skipped)) {
+        continue;
+      }
+      unsigned depth = unsigned(std::count(record_dir.begin(), record_dir.end(), '/'));
+      if (filter.ReadsBelow(depth) &&
+          !filter.Excluded(record.path.substr(name_start), record_dir)) {
+        break;
+      }
+      if (record.type == DT_DIR) {
+        skipped.assign(record.path);
+        skipped += '/';
+      }
+    }
+    record_info = EntryInfo{record.type, record.size, record.mtime,
+                            record.path.substr(name_start), nullptr, record.hash,
+                            record.ino};
+    return true;
+  };
+  bool have_record = next_record();
+
+  // The scan records no more than the listing has (as of its first record), as
+  // nothing else could be compared
+  ScanOptions scan_options = options;
+  unsigned listed = have_record ? record.fields : reader.Fields();
+  scan_options.fields &= listed;
+  path_out.SetFields(scan_options.fields);
+  file_out.SetFields(listed);
+  DirStream stream(start_path, scan_options);
+  const EntryInfo *entry = stream.Next();
+
+  printf("From Path: ----------------------------------------\n");
+  while (entry || have_record) {
+    if (entry) {
+      entry_path.assign(stream.Dir());
+      entry_path += entry->name;
+    }
+    int order = !have_record ? -1 : !entry ? 1 : ComparePaths(entry_path, record.path);
+    if (order <= 0) {
+      from_path.Enter(stream.Dir());
+    }
+    if (order >= 0 && !from_file.Enter(record_dir)) {
+      throw std::runtime_error("Directory " +
+                               std::string(record_dir.substr(0, record_dir.size() - 1)) +
+                               " not found when processing line " +
+                               std::to_string(reader.LineNumber()));
+    }
+
+    if (order < 0) {
+      Report(from_path, *entry);
+    } else if (order > 0) {
+      Report(from_file, record_info);
+    } else if (entry->type == DT_DIR && record_info.type == DT_DIR) {
+      // Both are directories (with the same name), so compare their contents, unless
+      // the scan left the tree's one unread
+      if (entry->dir->Pruned()) {
+        skipped.assign(record.path);
+        skipped += '/';
+      }
+      from_path.Push(*entry, false);
+      from_file.Push(record_info, false);
+    } else if (!SameFile(*entry, record_info, scan_options.fields & record.fields)) {
+      Report(from_path, *entry);
+      Report(from_file, record_info);
+    }
+
+    if (order <= 0) {
+      entry = stream.Next();
+    }
+    if (order >= 0) {
+      have_record = next_record();
+    }
+  }
+
+  // Then the listing's side
+  path_out.Finish();
+  file_out.Finish();
+  rewind(spool.get());
+  printf("From File: ----------------------------------------\n");
+  CopyFile(spool.get(), stdout);
+}
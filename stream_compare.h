@@ -0,0 +1,37 @@
+/*
+ * stream_compare.h
+ *
+ * Header file for comparing a directory tree with a Traverse() listing in one
+ * sequential pass over both.
+ */
+
+#ifndef STREAM_COMPARE_H
+#define STREAM_COMPARE_H
+
+#include "dir_level.h"
+
+/**
+ * StreamCompare - Print the differences between a directory tree and a listing
+ *
+ * @param start_path: Path to the directory to read
+ * @param input_file: Path of a listing written by Traverse()
+ * @param options: Scan tunables (options.threads is ignored); entries options.filter
+ *                 leaves out of the tree are skipped in the listing too
+ *
+ * Prints the same report as building both trees, calling DirLevel::RemoveCommon() and
+ * traversing each, but without building either: the directory is read with a
+ * DirStream and the listing line by line, and both are merged in Traverse() order.
+ * The entries that differ on the directory's side are printed as they are found; the
+ * listing's side is spooled to a temporary file and printed at the end. Memory use is
+ * bounded by the depth of the trees and the size of their largest directories.
+ * The scan records only the fields (see EntryField) of options.fields that the
+ * listing's first record has.
+ *
+ * The listing must be in Traverse() order, as file-lister writes it. Throws
+ * std::runtime_error if it isn't, or on any read or parse failure, possibly after part
+ * of the report has been printed.
+ */
+void StreamCompare(const char *start_path, const char *input_file,
+                   const ScanOptions &options);
+
+#endif  // STREAM_COMPARE_H
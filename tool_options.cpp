@@ -0,0 +1,168 @@
+/*
+ * tool_options.cpp
+ *
+ * Command-line handling shared by the tools that scan a directory tree.
+ */
+
+#include "tool_options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+
+#include "shard_plan.h"
+
+const char kScanOptionsHelp[] =
+    "Scan options:\n"
+    "  -j threads  Scan the tree with this many threads\n"
+    "  -A          Adapt the directories read at once (up to threads) to the latency of\n"
+    "              their metadata calls\n"
+    "  -M calls    Make at most this many metadata calls per second on each filesystem\n"
+    "  -C          Accept cached attributes on network filesystems (AT_STATX_DONT_SYNC)\n"
+    "  -U          Submit each directory's metadata calls as one io_uring batch\n"
+    "  -b bytes    Size of each thread's getdents64 buffer\n"
+    "  -F fds      Most file descriptors the scan may use (default: RLIMIT_NOFILE)\n"
+    "  -H          Hash the contents of regular files (adds a hash field to the output)\n"
+    "  -R bytes    With -H, read at most this many bytes per second\n"
+    "  -N          Record inode numbers (adds an inode field to the output)\n"
+    "  -f fields   Metadata to record: a comma-separated list of size, mtime and\n"
+    "              inode, or none for names and types only (default: size,mtime)\n"
+    "  -e pattern  Leave out entries matching this glob: a name, or a path from the\n"
+    "              root if it has a '/' (repeatable)\n"
+    "  -d depth    Leave out entries more than this many levels below the root\n"
+    "  -x          Don't read directories on other filesystems than the root\n"
+    "  -K N:plan   Scan only shard N of a plan written by file-shard -n: the root's\n"
+    "              entries the plan gives to it\n";
+
+// Implementation of ParseScanOption
+bool ParseScanOption(int opt, const char *arg, ScanOptions *options) {
+  switch (opt) {
+    case 'C':
+      options->dont_sync = true;
+      return true;
+    case 'U':
+      options->io_uring = true;
+      return true;
+    case 'A':
+      options->adaptive = true;
+      return true;
+    case 'H':
+      options->hash_contents = true;
+      return true;
+    case 'N':
+      options->fields |= kFieldInode;
+      return true;
+    case 'f': {
+      unsigned fields = 0;
+      for (std::string_view list = arg; !list.empty();) {
+        std::string_view name = list.substr(0, list.find(','));
+        list.remove_prefix(std::min(list.size(), name.size() + 1));
+        if (name == "size") {
+          fields |= kFieldSize;
+        } else if (name == "mtime") {
+          fields |= kFieldMtime;
+        } else if (name == "inode") {
+          fields |= kFieldInode;
+        } else if (name != "none") {
+          fprintf(stderr, "Invalid field list: %s\n", arg);
+          return false;
+        }
+      }
+      options->fields = fields | (options->fields & kFieldInode);  // -N still applies
+      return true;
+    }
+    case 'x':
+      options->filter.SetOneFilesystem(true);
+      return true;
+    case 'e':
+      if (*arg == '\0') {
+        fprintf(stderr, "Invalid exclude pattern: (empty)\n");
+        return false;
+      }
+      options->filter.Exclude(arg);
+      return true;
+    case 'd': {
+      int depth = atoi(arg);
+      if (depth < 1) {
+        fprintf(stderr, "Invalid depth: %s\n", arg);
+        return false;
+      }
+      options->filter.SetMaxDepth(unsigned(depth));
+      return true;
+    }
+    case 'K': {
+      char *end;
+      unsigned long shard = strtoul(arg, &end, 10);
+      if (end == arg || *end != ':' || end[1] == '\0') {
+        fprintf(stderr, "Invalid shard: %s\n", arg);
+        return false;
+      }
+      try {
+        auto plan = std::make_shared<const ShardPlan>(ShardPlan::Load(end + 1));
+        if (shard < 1 || shard > plan->Count()) {
+          fprintf(stderr, "Invalid shard: %s (the plan has %u)\n", arg, plan->Count());
+          return false;
+        }
+        options->filter.SetShard(std::move(plan), unsigned(shard));
+      } catch (const std::exception &e) {
+        fprintf(stderr, "Error loading shard plan: %s\n", e.what());
+        return false;
+      }
+      return true;
+    }
+    case 'R': {
+      char *end;
+      unsigned long long rate = strtoull(arg, &end, 0);
+      if (*end != '\0' || rate == 0) {
+        fprintf(stderr, "Invalid hash rate: %s\n", arg);
+        return false;
+      }
+      options->hash_rate = uint64_t(rate);
+      return true;
+    }
+    case 'M': {
+      char *end;
+      unsigned long long rate = strtoull(arg, &end, 0);
+      if (*end != '\0' || rate == 0) {
+        fprintf(stderr, "Invalid call rate: %s\n", arg);
+        return false;
+      }
+      options->call_rate = uint64_t(rate);
+      return true;
+    }
+    case 'b': {
+      char *end;
+      unsigned long bytes = strtoul(arg, &end, 0);
+      if (*end != '\0' || bytes == 0) {
+        fprintf(stderr, "Invalid buffer size: %s\n", arg);
+        return false;
+      }
+      options->dirent_buffer = size_t(bytes);
+      return true;
+    }
+    case 'F': {
+      int fds = atoi(arg);
+      if (fds < 1) {
+        fprintf(stderr, "Invalid descriptor limit: %s\n", arg);
+        return false;
+      }
+      options->max_open_fds = unsigned(fds);
+      return true;
+    }
+    case 'j': {
+      int threads = atoi(arg);
+      if (threads < 1) {
+        fprintf(stderr, "Invalid thread count: %s\n", arg);
+        return false;
+      }
+      options->threads = unsigned(threads);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,30 @@
+/*
+ * tool_options.h
+ *
+ * Command-line handling shared by the tools that scan a directory tree.
+ */
+
+#ifndef TOOL_OPTIONS_H
+#define TOOL_OPTIONS_H
+
+#include "dir_level.h"
+
+// getopt() option characters handled by ParseScanOption
+#define SCAN_OPTION_CHARS "ACHNUF:K:M:R:b:d:e:f:j:x"
+
+// Help text describing the options in SCAN_OPTION_CHARS
+extern const char kScanOptionsHelp[];
+
+/**
+ * ParseScanOption - Apply one getopt() result to a ScanOptions
+ *
+ * @param opt: Option character returned by getopt()
+ * @param arg: Its argument (optarg), if it takes one
+ * @param options: Options to update
+ * @return: true if the option was recognized and valid
+ *
+ * Prints a message to stderr for invalid arguments.
+ */
+bool ParseScanOption(int opt, const char *arg, ScanOptions *options);
+
+#endif  // TOOL_OPTIONS_H
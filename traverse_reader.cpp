@@ -0,0 +1,595 @@
+/*
+ * traverse_reader.cpp
+ *
+ * Parses snapshots one record at a time, straight from a mapping of the file or from
+ * large blocks read from it.
+ */
+
+#include "traverse_reader.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "compressed_file.h"
+#include "mapped_file.h"
+#include "snapshot_writer.h"
+
+namespace {
+// Size of the blocks unmappable files are read in
+constexpr size_t kBlockSize = 1 << 20;
+
+// Length of "YYYY-MM-DD HH:MM:SS.nnnnnnnnn"
+constexpr size_t kTimestampLen = 29;
+
+// Length of a content hash in a text line, after its ' '
+constexpr size_t kHashLen = 16;
+
+// Parse 1 to 19 decimal digits (so the value can't overflow) up to the next non-digit.
+// Returns the byte after them, or nullptr.
+const char *ParseNumber(const char *p, const char *end, uint64_t *value) {
+  const char *start = p;
+  uint64_t result = 0;
+  while (p < end && unsigned(*p - '0') < 10) {
+    result = result * 10 + unsigned(*p++ - '0');
+  }
+  if (p == start || p - start > 19) {
+    return nullptr;
+  }
+  *value = result;
+  return p;
+}
+
+// Parse exactly count decimal digits. Returns false if any isn't a digit.
+bool ParseDigits(const char *p, int count, unsigned *value) {
+  unsigned result = 0;
+  for (int i = 0; i < count; ++i) {
+    unsigned digit = unsigned(p[i] - '0');
+    if (digit >= 10) {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  *value = result;
+  return true;
+}
+
+// Take a trailing " i" and inode number off the metadata in [p, *end). Returns the
+// number, or 0 if there is none.
+uint64_t TakeInode(const char *p, const char **end) {
+  const char *digits = *end;
+  while (digits > p && unsigned(digits[-1] - '0') < 10) {
+    --digits;
+  }
+  uint64_t ino = 0;
+  if (digits - p < 2 || digits[-1] != 'i' || digits[-2] != ' ' ||
+      ParseNumber(digits, *end, &ino) != *end) {
+    return 0;
+  }
+  *end = digits - 2;
+  return ino;
+}
+
+// Parse the kHashLen lowercase hex digits of a content hash. Returns false if any isn't
+// one.
+bool ParseHash(const char *p, uint64_t *value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < kHashLen; ++i) {
+    unsigned digit = unsigned(p[i] - '0');
+    if (digit >= 10) {
+      digit = unsigned(p[i] - 'a') + 10;
+      if (digit < 10 || digit >= 16) {
+        return false;
+      }
+    }
+    result = result << 4 | digit;
+  }
+  *value = result;
+  return true;
+}
+
+/*
+ * DaysFromCivil - Days from 1970-01-01 to a date in the proleptic Gregorian calendar
+ *
+ * Howard Hinnant's algorithm: counts from 0000-03-01 so that leap days fall at the end
+ * of each year, in 400-year eras.
+ */
+int64_t DaysFromCivil(int64_t year, unsigned month, unsigned day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  unsigned year_of_era = unsigned(year - era * 400);  // [0, 399]
+  unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 +
+                        day_of_year;  // [0, 146096]
+  return era * 146097 + int64_t(day_of_era) - 719468;
+}
+}  // namespace
+
+// Implementation of ComparePaths
+int ComparePaths(std::string_view a, std::string_view b) {
+  size_t len = std::min(a.size(), b.size());
+  for (size_t i = 0; i < len; ++i) {
+    if (a[i] != b[i]) {
+      unsigned char ca = a[i] == '/' ? 0 : (unsigned char)a[i];
+      unsigned char cb = b[i] == '/' ? 0 : (unsigned char)b[i];
+      return ca < cb ? -1 : 1;
+    }
+  }
+  return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+}
+
+// Implementation of TraverseReader::TraverseReader
+TraverseReader::TraverseReader(const char *filename, unsigned threads)
+    : filename_(filename), header_fields_(kDefaultFields) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open " + filename_ + ": " + strerror(errno));
+  }
+  if (FrameReader::IsFramed(fd)) {
+    // Compressed: the reader takes the descriptor over
+    auto frames = std::make_unique<FrameReader>(fd, filename_, std::max(threads, 2u));
+    if (threads > 1) {
+      mapping_ = frames->ReadAll();
+      if (mapping_) {
+        data_ = mapping_->Data();
+        end_ = mapping_->Size();
+      }
+    } else {
+      frames_ = std::move(frames);
+      block_.resize(kBlockSize);
+      data_ = block_.data();
+    }
+  } else if ((mapping_ = MappedFile::Map(fd))) {
+    close(fd);
+    data_ = mapping_->Data();
+    end_ = mapping_->Size();
+  } else {
+    file_ = fdopen(fd, "r");
+    if (!file_) {
+      close(fd);
+      throw std::runtime_error("Cannot open " + filename_ + ": " + strerror(errno));
+    }
+    block_.resize(kBlockSize);
+    data_ = block_.data();
+  }
+
+  // A text listing never starts with a NUL, a binary snapshot always does
+  if (!Fill(1) || data_[0] != '\0') {
+    return;
+  }
+  binary_ = true;
+  if (!Fill(sizeof(kSnapshotMagic) + 1) ||
+      memcmp(data_, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0) {
+    throw std::runtime_error("'" + filename_ + "' is not a snapshot");
+  }
+  unsigned version = (unsigned char)data_[sizeof(kSnapshotMagic)];
+  version_ = version;
+  if (version < 1 || version > kSnapshotVersion) {
+    throw std::runtime_error("Unsupported snapshot version " + std::to_string(version) +
+                             " in '" + filename_ + "'");
+  }
+  pos_ = sizeof(kSnapshotMagic) + 1;
+
+  // From version 5 a byte of EntryField bits says which fields the records have
+  if (version > 4) {
+    if (!Fill(1) || ((unsigned char)data_[pos_] & ~kDefaultFields) != 0) {
+      throw std::runtime_error("'" + filename_ + "' is not a snapshot");
+    }
+    header_fields_ = (unsigned char)data_[pos_++];
+  }
+}
+
+// Implementation of TraverseReader::TraverseReader (part of a mapping)
+TraverseReader::TraverseReader(const std::string &filename,
+                               std::shared_ptr<MappedFile> mapping, size_t begin,
+                               size_t end)
+    : filename_(filename),
+      mapping_(std::move(mapping)),
+      data_(mapping_->Data()),
+      pos_(begin),
+      end_(end),
+      header_fields_(kDefaultFields) {}
+
+// Implementation of TraverseReader::~TraverseReader
+TraverseReader::~TraverseReader() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+// Implementation of TraverseReader::ContentSize
+uint64_t TraverseReader::ContentSize() const {
+  if (mapping_) {
+    return mapping_->Size();
+  }
+  if (frames_) {
+    return frames_->Size();
+  }
+  struct stat file_stat;
+  if (!file_ || fstat(fileno(file_), &file_stat) != 0) {
+    return 0;  // An empty compressed snapshot, or the size can't be told
+  }
+  return uint64_t(file_stat.st_size);
+}
+
+// Implementation of TraverseReader::Seek
+void TraverseReader::Seek(uint64_t offset, uint64_t record) {
+  if (mapping_) {
+    if (offset > mapping_->Size()) {
+      throw std::runtime_error("Offset " + std::to_string(offset) +
+                               " is past the end of '" + filename_ + "'");
+    }
+    end_ = mapping_->Size();
+    pos_ = size_t(offset);
+  } else if (frames_) {
+    frames_->Seek(offset);
+    pos_ = end_ = 0;
+  } else {
+    if (!file_ || fseeko(file_, off_t(offset), SEEK_SET) != 0) {
+      throw std::runtime_error("Cannot seek in '" + filename_ + "': " + strerror(errno));
+    }
+    pos_ = end_ = 0;
+  }
+  path_.clear();
+  closed_.clear();
+  ended_ = false;
+  line_num_ = int(record);
+}
+
+// Implementation of TraverseReader::Next
+bool TraverseReader::Next(TraverseRecord *record) {
+  return binary_ ? NextBinary(record) : NextText(record);
+}
+
+// Implementation of TraverseReader::Fill
+bool TraverseReader::Fill(size_t size) {
+  if (end_ - pos_ >= size) {
+    return true;
+  }
+  if (!file_ && !frames_) {
+    return false;  // The mapping is the whole file
+  }
+
+  // Move what is left to the front of the block, growing it for an unusually long line
+  std::copy(block_.begin() + long(pos_), block_.begin() + long(end_), block_.begin());
+  end_ -= pos_;
+  pos_ = 0;
+  if (block_.size() < size) {
+    block_.resize(std::max(size, 2 * block_.size()));
+  }
+  data_ = block_.data();
+  while (end_ < size) {
+    size_t len = frames_ ? frames_->Read(block_.data() + end_, block_.size() - end_)
+                         : fread(block_.data() + end_, 1, block_.size() - end_, file_);
+    if (len == 0) {
+      if (file_ && ferror(file_)) {
+        throw std::runtime_error("Error reading '" + filename_ + "': " + strerror(errno));
+      }
+      return false;  // End of file
+    }
+    end_ += len;
+  }
+  return true;
+}
+
+// Implementation of TraverseReader::Find
+size_t TraverseReader::Find(char c, size_t from) {
+  for (;;) {
+    size_t avail = end_ - pos_;
+    if (from < avail) {
+      const void *hit = memchr(data_ + pos_ + from, c, avail - from);
+      if (hit) {
+        return size_t(static_cast<const char *>(hit) - (data_ + pos_));
+      }
+    }
+    if (!Fill(avail + 1)) {
+      return std::string::npos;
+    }
+    from = avail;
+  }
+}
+
+// Implementation of TraverseReader::Corrupt
+void TraverseReader::Corrupt() const {
+  throw std::runtime_error("Corrupt snapshot '" + filename_ + "' at record " +
+                           std::to_string(line_num_ + 1));
+}
+
+// Implementation of TraverseReader::NextBinary
+bool TraverseReader::NextBinary(TraverseRecord *record) {
+  if (ended_) {
+    return false;
+  }
+
+  // Path: shared length, suffix length, suffix and its NUL. An empty record is
+  // followed by a directory's digest or the trailer.
+  closed_.clear();
+  const char *p;
+  const char *end;
+  uint64_t shared, suffix_len;
+  for (;;) {
+    Fill(3 * kMaxVarint + sizeof(uint64_t));
+    p = data_ + pos_;
+    end = data_ + end_;
+    if (!(p = DecodeVarint(p, end, &shared)) ||
+        !(p = DecodeVarint(p, end, &suffix_len))) {
+      Corrupt();
+    }
+    if (suffix_len != 0) {
+      break;
+    }
+    uint64_t kind = kSnapshotEnd;
+    if (shared != 0 || (version_ > 1 && !(p = DecodeVarint(p, end, &kind)))) {
+      Corrupt();
+    }
+    if (kind == kSnapshotEnd) {
+      // Trailer: the record count must match
+      uint64_t count;
+      if (!(p = DecodeVarint(p, end, &count)) || count != uint64_t(line_num_)) {
+        Corrupt();
+      }
+      ended_ = true;
+      return false;
+    }
+    if (kind != kDirClosed || size_t(end - p) < sizeof(uint64_t)) {
+      Corrupt();
+    }
+    uint64_t digest = 0;
+    for (int i = 0; i < 8; ++i) {
+      digest |= uint64_t((unsigned char)p[i]) << (8 * i);
+    }
+    closed_.push_back(digest);
+    pos_ = size_t(p + sizeof(uint64_t) - data_);
+  }
+  if (shared > path_.size() || suffix_len > (1u << 30)) {
+    Corrupt();
+  }
+  pos_ = size_t(p - data_);
+  Fill(size_t(suffix_len) + 1 + 4 * kMaxVarint + sizeof(uint64_t));
+  p = data_ + pos_;
+  end = data_ + end_;
+  if (size_t(end - p) <= suffix_len || p[suffix_len] != '\0') {
+    Corrupt();
+  }
+  const char *suffix = p;
+  if (line_num_ > 0 &&
+      ComparePaths(std::string_view(path_).substr(size_t(shared)),
+                   std::string_view(suffix, size_t(suffix_len))) >= 0) {
+    in_order_ = false;  // The rest of the two paths is the same
+  }
+  path_.resize(size_t(shared));
+  path_.append(suffix, size_t(suffix_len));
+  p += suffix_len + 1;
+
+  // Metadata, without the fields the snapshot doesn't record (from version 5)
+  uint64_t type, size = 0, seconds = 0, nsec = 0;
+  if (!(p = DecodeVarint(p, end, &type)) ||
+      ((header_fields_ & kFieldSize) && !(p = DecodeVarint(p, end, &size))) ||
+      ((header_fields_ & kFieldMtime) && (!(p = DecodeVarint(p, end, &seconds)) ||
+                                          !(p = DecodeVarint(p, end, &nsec)))) ||
+      nsec >= 1000000000) {
+    Corrupt();
+  }
+  // From version 3 the low bit of the type says whether a content hash follows, and
+  // from version 4 the next one whether an inode number does
+  uint64_t hash = 0, ino = 0;
+  bool has_ino = version_ > 3 && (type & 2);
+  if (version_ > 2) {
+    bool hashed = type & 1;
+    type >>= version_ > 3 ? 2 : 1;
+    if (hashed) {
+      if (size_t(end - p) < sizeof(uint64_t)) {
+        Corrupt();
+      }
+      for (int i = 0; i < 8; ++i) {
+        hash |= uint64_t((unsigned char)p[i]) << (8 * i);
+      }
+      p += sizeof(uint64_t);
+    }
+  }
+  if (has_ino && !(p = DecodeVarint(p, end, &ino))) {
+    Corrupt();
+  }
+  pos_ = size_t(p - data_);
+  line_num_++;
+
+  // The name is never shared with the previous path, so it is all in the suffix
+  record->path = path_;
+  size_t name_start = path_.rfind('/') + 1;  // 0 if there is no '/'
+  if (name_start < shared) {
+    Corrupt();
+  }
+  record->name =
+      std::string_view(suffix + (name_start - shared), path_.size() - name_start);
+  record->type = int(type);
+  record->size = size_t(size);
+  record->mtime.tv_sec = time_t(UnZigZag(seconds));
+  record->mtime.tv_nsec = long(nsec);
+  record->hash = hash;
+  record->ino = ino;
+  record->fields = header_fields_ | (ino ? unsigned(kFieldInode) : 0u);
+  if (record->type != DT_WHT) {
+    fields_ &= record->fields;
+  }
+  return true;
+}
+
+// Implementation of TraverseReader::NextText
+bool TraverseReader::NextText(TraverseRecord *record) {
+  // Get the line in two parts. First is the filename delimited by '\0', then the metadata
+  // delimited by '\n', This allows us to support filenames with embedded linefeeds by
+  // first using zero as delimiter before using '\n' as delimiter
+  if (!Fill(1)) {
+    return false;
+  }
+  size_t fname_len = Find('\0', 0);
+  if (fname_len == std::string::npos) {
+    throw std::runtime_error("Missing null in '" + filename_ + "' at line " +
+                             std::to_string(line_num_) + " :" + strerror(errno));
+  }
+  size_t line_len = Find('\n', fname_len + 1);
+  if (line_len == std::string::npos) {
+    const char *what = end_ - pos_ == fname_len + 1 ? "Cannot read linefeed from '"
+                                                    : "Missing linefeed in '";
+    throw std::runtime_error(what + filename_ + "' at line " + std::to_string(line_num_) +
+                             " :" + strerror(errno));
+  }
+  line_num_++;
+  const char *line = data_ + pos_;
+  pos_ += line_len + 1;
+  record->path = std::string_view(line, fname_len);
+  record->name = record->path.substr(record->path.rfind('/') + 1);
+  if (ParseFixed(line + fname_len + 1, line + line_len, record)) {
+    return true;
+  }
+
+  // Anything else is parsed as before: ' type size YYYY-MM-DD HH:MM:SS.nnnnnnnnn\n' with
+  // sscanf, after taking off any inode and hash. It is copied out so that sscanf sees a
+  // terminated string rather than the rest of the file.
+  const char *metadata = line + fname_len + 1;
+  const char *metadata_end = line + line_len;
+  record->ino = TakeInode(metadata, &metadata_end);
+  size_t metadata_len = size_t(metadata_end - metadata);
+  record->hash = 0;
+  if (metadata_len > kHashLen + 1 && metadata[metadata_len - kHashLen - 1] == ' ' &&
+      ParseHash(metadata + metadata_len - kHashLen, &record->hash)) {
+    metadata_len -= kHashLen + 1;
+  }
+  metadata_.assign(metadata, metadata_len);
+  unsigned fields = kFieldSize | kFieldMtime | (record->ino ? unsigned(kFieldInode) : 0u);
+  if (metadata_.ends_with(" -")) {
+    // No mtime recorded: parsed as the epoch, and the field dropped
+    metadata_.replace(metadata_.size() - 1, 1, "1970-01-01 00:00:00.0");
+    fields &= ~unsigned(kFieldMtime);
+  }
+  metadata_ += '\n';
+  int type;
+  unsigned long size;
+  struct tm tm_time = {};
+  long nsec;
+
+  // The path may contain spaces so search backwards from EOL for the final 4 fields
+  size_t ofs = metadata_.size();
+  int remain = 4;
+  while (ofs > 0) {
+    if (metadata_[--ofs] == ' ' && --remain == 0) {
+      break;
+    }
+  }
+  if (remain != 0) {
+    throw std::runtime_error("Parse error at line " + std::to_string(line_num_) +
+                             ": reading final four fields");
+  }
+
+  // No size recorded: parsed as 0, and the field dropped
+  size_t size_pos = metadata_.find(' ', ofs + 1);
+  if (metadata_.compare(size_pos, 3, " - ") == 0) {
+    metadata_[size_pos + 1] = '0';
+    fields &= ~unsigned(kFieldSize);
+  }
+
+  // scan the four fields
+  int matched = sscanf(metadata_.c_str() + ofs, "%d %lu %d-%d-%d %d:%d:%d.%ld", &type,
+                       &size, &tm_time.tm_year, &tm_time.tm_mon, &tm_time.tm_mday,
+                       &tm_time.tm_hour, &tm_time.tm_min, &tm_time.tm_sec, &nsec);
+  if (matched != 9) {
+    throw std::runtime_error("Parse error at line " + std::to_string(line_num_) +
+                             ": expected 9 fields, got " + std::to_string(matched));
+  }
+  tm_time.tm_year -= 1900;
+  tm_time.tm_mon -= 1;
+
+  record->type = type;
+  record->size = size;
+  record->mtime.tv_sec = timegm(&tm_time);
+  record->mtime.tv_nsec = nsec;
+  record->fields = fields;
+  if (record->type != DT_WHT) {
+    fields_ &= fields;
+  }
+  return true;
+}
+
+// Implementation of TraverseReader::MonthStart
+int64_t TraverseReader::MonthStart(unsigned year, unsigned month) {
+  // Consecutive entries mostly share a month, so remember the last one
+  unsigned key = year * 12 + month;
+  if (key != cached_month_) {
+    cached_month_ = key;
+    cached_days_ = DaysFromCivil(year, month, 1);
+  }
+  return cached_days_;
+}
+
+// Implementation of TraverseReader::ParseFixed
+bool TraverseReader::ParseFixed(const char *p, const char *end, TraverseRecord *record) {
+  // ' type size ', after taking off any inode; a size not recorded is '-'
+  uint64_t ino = TakeInode(p, &end);
+  uint64_t type, size = 0;
+  unsigned fields = kFieldSize | kFieldMtime | (ino ? unsigned(kFieldInode) : 0u);
+  if (p == end || *p++ != ' ' || !(p = ParseNumber(p, end, &type)) || p == end ||
+      *p++ != ' ' || type > 0x7fffffff) {
+    return false;
+  }
+  if (p != end && *p == '-') {
+    ++p;
+    fields &= ~unsigned(kFieldSize);
+  } else if (!(p = ParseNumber(p, end, &size))) {
+    return false;
+  }
+  if (p == end || *p++ != ' ') {
+    return false;
+  }
+
+  // 'YYYY-MM-DD HH:MM:SS.nnnnnnnnn', all zero-padded, or '-' if the mtime wasn't
+  // recorded, maybe followed by ' ' and a hash
+  uint64_t hash = 0;
+  size_t stamp_len = p != end && *p == '-' ? 1 : kTimestampLen;
+  if (size_t(end - p) == stamp_len + 1 + kHashLen) {
+    if (p[stamp_len] != ' ' || !ParseHash(p + stamp_len + 1, &hash)) {
+      return false;
+    }
+    end -= 1 + kHashLen;
+  }
+  if (size_t(end - p) != stamp_len) {
+    return false;
+  }
+  record->mtime = {};
+  if (stamp_len == 1) {
+    fields &= ~unsigned(kFieldMtime);
+  } else {
+    unsigned year, month, day, hour, minute, second, nsec;
+    if (p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' || p[16] != ':' ||
+        p[19] != '.' || !ParseDigits(p, 4, &year) || !ParseDigits(p + 5, 2, &month) ||
+        !ParseDigits(p + 8, 2, &day) || !ParseDigits(p + 11, 2, &hour) ||
+        !ParseDigits(p + 14, 2, &minute) || !ParseDigits(p + 17, 2, &second) ||
+        !ParseDigits(p + 20, 9, &nsec)) {
+      return false;
+    }
+    // timegm() carries out-of-range days, hours etc. into the next unit, which the sum
+    // below does too; only the month has to be in range for it
+    if (month < 1 || month > 12) {
+      return false;
+    }
+    record->mtime.tv_sec = time_t((MonthStart(year, month) + day - 1) * 86400 +
+                                  hour * 3600 + minute * 60 + second);
+    record->mtime.tv_nsec = long(nsec);
+  }
+
+  record->type = int(type);
+  record->size = size_t(size);
+  record->hash = hash;
+  record->ino = ino;
+  record->fields = fields;
+  if (record->type != DT_WHT) {
+    fields_ &= fields;
+  }
+  return true;
+}
@@ -0,0 +1,210 @@
+/*
+ * traverse_reader.h
+ *
+ * Header file for a sequential reader of snapshots: the text listings written by
+ * DirLevel::Traverse() and the binary format written by SnapshotWriter.
+ */
+
+#ifndef TRAVERSE_READER_H
+#define TRAVERSE_READER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class FrameReader;
+class MappedFile;
+
+/**
+ * TraverseRecord - One line of a Traverse() listing
+ */
+struct TraverseRecord {
+  std::string_view path;  // Path relative to the root (valid until the next Next())
+  std::string_view name;  // Last component of path, followed by a NUL in memory
+  int type;               // File type (DT_REG, DT_DIR, etc.)
+  size_t size;            // File size in bytes
+  struct timespec mtime;  // Modification time
+  uint64_t hash;          // Content hash, 0 if the snapshot has none for the entry
+  uint64_t ino;           // Inode number, 0 if the snapshot has none for the entry
+  unsigned fields;        // EntryField bits (see dir_level.h) of what it has; size and
+                          // mtime are 0 unless recorded
+};
+
+/**
+ * ComparePaths - Order two relative paths as Traverse() visits them
+ *
+ * @return: Negative, zero or positive as a comes before, is the same as or comes after b
+ *
+ * Names are compared bytewise, but a '/' sorts before everything else, so that a
+ * directory's descendants come right after it and before its next sibling.
+ */
+int ComparePaths(std::string_view a, std::string_view b);
+
+/**
+ * TraverseReader - Reads a snapshot one record at a time
+ *
+ * The format is detected from the first byte. In a text listing each line is
+ * "path\0 type size YYYY-MM-DD HH:MM:SS.nnnnnnnnn\n", with a content hash and an
+ * inode number before the '\n' if they were recorded, and '-' for a size or mtime that
+ * wasn't; the NUL after the path allows paths with embedded linefeeds. The binary
+ * format is described in snapshot_writer.h.
+ *
+ * Regular files are memory-mapped and decoded in place, so nothing is copied per
+ * record and the names handed out stay valid for as long as the mapping does. Other
+ * files (pipes etc.) are read in large blocks.
+ *
+ * A snapshot compressed in frames (see compressed_file.h), which must be a regular
+ * file, is recognized by its first bytes and decompressed on threads of its own: into
+ * memory as a whole, which then stands in for the mapping, or a few frames ahead of the
+ * records being read.
+ */
+class TraverseReader {
+ public:
+  /**
+   * Constructor - Open a snapshot
+   *
+   * @param filename: Path of the file to read
+   * @param threads: Threads to decompress a compressed snapshot on. With more than 1 it
+   *                 is decompressed into memory whole, so that it has a Mapping();
+   *                 otherwise it is read on while it is decompressed.
+   *
+   * Throws std::runtime_error if the file can't be opened, or if it is a binary
+   * snapshot of an unsupported version.
+   */
+  explicit TraverseReader(const char *filename, unsigned threads = 1);
+
+  /**
+   * Constructor - Read part of a mapped text listing
+   *
+   * @param filename: Name of the file, for error messages
+   * @param mapping: Mapping of the whole listing
+   * @param begin: Offset of the first record to read
+   * @param end: Offset just past the last record to read
+   */
+  TraverseReader(const std::string &filename, std::shared_ptr<MappedFile> mapping,
+                 size_t begin, size_t end);
+
+  ~TraverseReader();
+
+  TraverseReader(const TraverseReader &) = delete;
+  TraverseReader &operator=(const TraverseReader &) = delete;
+
+  /**
+   * Next - Read the next record
+   *
+   * @param record: Filled in with the record
+   * @return: false at the end of the file
+   *
+   * Throws std::runtime_error on read or parse errors.
+   */
+  bool Next(TraverseRecord *record);
+
+  /**
+   * Seek - Continue reading at another record
+   *
+   * @param offset: Offset in the snapshot (after decompression) of a record that stores
+   *                its whole path (one a SnapshotIndex points at)
+   * @param record: Number of records before it
+   *
+   * Throws std::runtime_error if the file can't be repositioned.
+   */
+  void Seek(uint64_t offset, uint64_t record);
+
+  /**
+   * ContentSize - Size of the snapshot
+   *
+   * @return: Its size in bytes, after decompression if it is compressed
+   */
+  uint64_t ContentSize() const;
+
+  // Number of the line (or binary record) read last (1-based)
+  int LineNumber() const { return line_num_; }
+
+  // Name of the file being read
+  const std::string &Filename() const { return filename_; }
+
+  /**
+   * Mapping - The mapping records are decoded from
+   *
+   * @return: The mapping, or nullptr if the file is read in blocks. While it is kept,
+   *          every record's name stays valid.
+   */
+  const std::shared_ptr<MappedFile> &Mapping() const { return mapping_; }
+
+  // Whether the file is a binary snapshot
+  bool Binary() const { return binary_; }
+
+  // Whether the file is a binary snapshot with directory digests (version 2 or later)
+  bool HasDigests() const { return version_ > 1; }
+
+  /**
+   * ClosedDigests - Digests of the directories closed just before the last record
+   *
+   * @return: The digests, innermost directory first, of the directories (see
+   *          snapshot_writer.h) closed since the record before the one the last Next()
+   *          returned, or since the last record if Next() returned false
+   */
+  const std::vector<uint64_t> &ClosedDigests() const { return closed_; }
+
+  // EntryField bits every record read so far had (all of them before the first),
+  // leaving out a delta's whiteouts (see DirLevel::WriteDelta), which carry none
+  unsigned Fields() const { return fields_; }
+
+  // Whether each binary record so far came strictly after the one before in Traverse()
+  // order, so that the directory digests match the entries as they will be sorted
+  bool InOrder() const { return in_order_; }
+
+ private:
+  // Next() for each format
+  bool NextText(TraverseRecord *record);
+  bool NextBinary(TraverseRecord *record);
+
+  // Parse a text line's metadata when it is laid out exactly as Traverse() prints it.
+  // Returns false for anything else, which is left to sscanf.
+  bool ParseFixed(const char *p, const char *end, TraverseRecord *record);
+
+  // Days from 1970-01-01 to the first of the given month
+  int64_t MonthStart(unsigned year, unsigned month);
+
+  // Make at least size bytes available at data_[pos_] unless the file ends first.
+  // Returns whether they are.
+  bool Fill(size_t size);
+
+  // Offset from pos_ of the first c at or after offset from, or npos if the file ends
+  // first
+  size_t Find(char c, size_t from);
+
+  // Throw an error about a malformed binary snapshot
+  [[noreturn]] void Corrupt() const;
+
+  std::string filename_;
+  std::shared_ptr<MappedFile> mapping_;  // Contents, if mapped
+  FILE *file_ = nullptr;                 // Otherwise the file being read into block_,
+  std::unique_ptr<FrameReader> frames_;  // or the compressed file decompressed into it
+  std::vector<char> block_;
+  bool binary_ = false;
+
+  // The bytes being decoded: the whole mapping, or what has been read into block_
+  const char *data_ = nullptr;
+  size_t pos_ = 0;  // Next byte to decode
+  size_t end_ = 0;  // End of the valid bytes
+
+  std::string path_;         // Binary snapshots: the path being reassembled
+  bool ended_ = false;       // Binary snapshots: trailer seen
+  unsigned version_ = 0;     // Binary snapshots: format version
+  unsigned header_fields_;   // EntryField bits of size and mtime the format records
+  unsigned fields_ = ~0u;    // See Fields()
+  std::vector<uint64_t> closed_;  // Binary snapshots: see ClosedDigests()
+  bool in_order_ = true;          // Binary snapshots: see InOrder()
+  std::string metadata_;     // Text listings: the current line's metadata (slow path)
+  unsigned cached_month_ = 0;  // Text listings: year * 12 + month of the last MonthStart
+  int64_t cached_days_ = 0;    // and its result
+  int line_num_ = 0;
+};
+
+#endif  // TRAVERSE_READER_H
@@ -0,0 +1,153 @@
+/*
+ * tree_generator.cpp
+ *
+ * Builds synthetic directory trees breadth-first with the *at() calls, relative to the
+ * top directory.
+ */
+
+#include "tree_generator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+// Largest size given to a file (they are sparse, so it costs no space)
+constexpr uint64_t kMaxFileSize = 1 << 20;
+
+// Characters of "unicode" names: two, three and four bytes of UTF-8 each
+constexpr const char *kUnicodeChars[] = {
+    "\xc3\xa9",          // e acute
+    "\xc3\x9f",          // sharp s
+    "\xd0\x96",          // Cyrillic zhe
+    "\xe5\x90\x8d",      // CJK "name"
+    "\xe5\xad\x97",      // CJK "character"
+    "\xf0\x9f\x98\x80",  // grinning face
+};
+
+// Name of the index'th file ('f') or directory ('d') of a directory
+std::string MakeName(const TreeShape &shape, char kind, size_t index) {
+  std::string name(1, kind);
+  name += std::to_string(index);
+  for (size_t i = index; name.size() < shape.name_len; ++i) {
+    if (!shape.unicode) {
+      name += char('a' + i % 26);
+      continue;
+    }
+    const char *c = kUnicodeChars[i % std::size(kUnicodeChars)];
+    if (name.size() + strlen(c) > shape.name_len) {
+      break;
+    }
+    name += c;
+  }
+  return name;
+}
+
+// Throw the error of a call on path that failed
+[[noreturn]] void Fail(const char *what, const std::string &path) {
+  throw std::runtime_error(std::string("Cannot ") + what + " " + path + ": " +
+                           strerror(errno));
+}
+
+// nftw() callback of RemoveTree(): remove each entry after everything below it
+int RemoveEntry(const char *path, const struct stat *, int, struct FTW *) {
+  return remove(path);
+}
+}  // namespace
+
+// Implementation of StandardShapes
+std::vector<TreeShape> StandardShapes(size_t entries) {
+  // About 2000 entries per chain keeps "deep" 200 levels deep at any size
+  unsigned chains = unsigned(std::max<size_t>((entries + 1999) / 2000, 1));
+  unsigned wide_files = unsigned(std::max<size_t>(entries / 4, 1));
+  return {
+      {"wide", entries, 4, 0, wide_files, 0, 12, false},
+      {"deep", entries, chains, 1, 9, 199, 8, false},
+      {"tiny", entries, 16, 4, 1, 12, 8, false},
+      {"long", entries, 16, 8, 40, 4, 200, false},
+      {"unicode", entries, 16, 8, 40, 4, 48, true},
+  };
+}
+
+// Implementation of GenerateTree
+size_t GenerateTree(const std::string &top, const TreeShape &shape) {
+  int topfd = open(top.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (topfd < 0) {
+    Fail("open", top);
+  }
+
+  // Directories still to fill, by path relative to the top, with their level (0 for
+  // the top, 1 for the roots)
+  std::deque<std::pair<std::string, unsigned>> queue;
+  queue.emplace_back(".", 0);
+  uint64_t state = 0x9e3779b97f4a7c15;  // xorshift64 state for the file sizes
+  size_t created = 0;
+  try {
+    while (!queue.empty() && created < shape.entries) {
+      auto [dir, level] = std::move(queue.front());
+      queue.pop_front();
+      int fddir = openat(topfd, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fddir < 0) {
+        Fail("open", top + "/" + dir);
+      }
+      std::string prefix = level == 0 ? std::string() : dir + "/";
+
+      unsigned files = level == 0 ? 0 : shape.files;
+      for (unsigned i = 0; i < files && created < shape.entries; ++i, ++created) {
+        std::string name = MakeName(shape, 'f', i);
+        int fd = openat(fddir, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                        0644);
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        if (fd < 0 || ftruncate(fd, off_t(state % kMaxFileSize)) != 0) {
+          int saved_errno = errno;
+          if (fd >= 0) {
+            close(fd);
+          }
+          close(fddir);
+          errno = saved_errno;
+          Fail("create", top + "/" + prefix + name);
+        }
+        close(fd);
+      }
+
+      unsigned subdirs = level == 0             ? shape.roots
+                         : level <= shape.depth ? shape.fanout
+                                                : 0;
+      for (unsigned i = 0; i < subdirs && created < shape.entries; ++i, ++created) {
+        std::string name = MakeName(shape, 'd', i);
+        if (mkdirat(fddir, name.c_str(), 0755) != 0) {
+          int saved_errno = errno;
+          close(fddir);
+          errno = saved_errno;
+          Fail("create", top + "/" + prefix + name);
+        }
+        queue.emplace_back(prefix + name, level + 1);
+      }
+      close(fddir);
+    }
+  } catch (...) {
+    close(topfd);
+    throw;
+  }
+  close(topfd);
+  return created;
+}
+
+// Implementation of RemoveTree
+void RemoveTree(const std::string &path) {
+  if (nftw(path.c_str(), RemoveEntry, 64, FTW_DEPTH | FTW_PHYS) != 0) {
+    Fail("remove", path);
+  }
+}
@@ -0,0 +1,66 @@
+/*
+ * tree_generator.h
+ *
+ * Header file for building synthetic directory trees of a given shape, for
+ * benchmarking the scanner against trees unlike the ones at hand.
+ */
+
+#ifndef TREE_GENERATOR_H
+#define TREE_GENERATOR_H
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * TreeShape - Layout of a synthetic tree
+ *
+ * The top directory holds `roots` subdirectories. Every directory below it holds
+ * `files` files and, down to `depth` levels below the roots, `fanout` subdirectories.
+ * Directories are filled breadth-first until `entries` entries exist, so a shape can
+ * describe more than is built. Files are sparse, with sizes up to 1 MiB.
+ */
+struct TreeShape {
+  std::string name;   // What the shape is called
+  size_t entries;     // Entries to create, directories included
+  unsigned roots;     // Subdirectories of the top directory
+  unsigned fanout;    // Subdirectories of every other directory
+  unsigned files;     // Files in every directory below the top one
+  unsigned depth;     // Levels of directories below the roots
+  unsigned name_len;  // Bytes per name (more if needed to keep names unique)
+  bool unicode;       // Pad names with multibyte UTF-8 characters rather than ASCII
+};
+
+/**
+ * StandardShapes - The shapes file-bench measures by default
+ *
+ * @param entries: Entries each tree should have
+ * @return: "wide" (a few huge directories), "deep" (long chains of directories),
+ *          "tiny" (many directories of one file), "long" (200-byte names) and
+ *          "unicode" (names of multibyte characters)
+ */
+std::vector<TreeShape> StandardShapes(size_t entries);
+
+/**
+ * GenerateTree - Build a tree of a given shape
+ *
+ * @param top: Path of the (existing, empty) directory to build it in
+ * @param shape: The shape to build
+ * @return: Number of entries created
+ *
+ * The same shape always gives the same names and sizes. Throws std::runtime_error if
+ * anything can't be created.
+ */
+size_t GenerateTree(const std::string &top, const TreeShape &shape);
+
+/**
+ * RemoveTree - Delete a directory and everything below it
+ *
+ * @param path: The directory
+ *
+ * Throws std::runtime_error if anything can't be removed.
+ */
+void RemoveTree(const std::string &path);
+
+#endif  // TREE_GENERATOR_H
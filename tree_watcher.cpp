@@ -0,0 +1,625 @@
+/*
+ * tree_watcher.cpp
+ *
+ * Keeps a DirLevel tree current from fanotify or inotify events, patching the entries
+ * an event names instead of scanning everything again.
+ */
+
+#include "tree_watcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "arena.h"
+#include "content_hasher.h"
+#include "snapshot_writer.h"
+
+namespace {
+// Events to subscribe to. The rest (opens, reads, closes) can't change a listing.
+constexpr uint64_t kFanotifyMask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM |
+                                   FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+constexpr uint32_t kInotifyMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                  IN_MODIFY | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW |
+                                  IN_EXCL_UNLINK;
+
+// Size of the buffer events are read into
+constexpr size_t kEventBuffer = 256 * 1024;
+
+// Times a new directory is scanned before giving up while it keeps changing underneath
+constexpr int kScanAttempts = 3;
+
+// Replaced storage that makes the tree worth copying, as a fraction of its size, and
+// the least that does
+constexpr size_t kCompactFraction = 2;
+constexpr size_t kMinCompact = 1 << 20;
+
+// Key of a directory for fanotify: its fsid, then its file handle's type and bytes
+std::string HandleKey(const fsid_t &fsid, int handle_type, const unsigned char *handle,
+                      size_t handle_bytes) {
+  std::string key(reinterpret_cast<const char *>(&fsid), sizeof(fsid));
+  key.append(reinterpret_cast<const char *>(&handle_type), sizeof(handle_type));
+  key.append(reinterpret_cast<const char *>(handle), handle_bytes);
+  return key;
+}
+
+// Key of a directory for inotify: its watch descriptor
+std::string WatchKey(int wd) {
+  return std::string(reinterpret_cast<const char *>(&wd), sizeof(wd));
+}
+}  // namespace
+
+// Implementation of TreeWatcher::TreeWatcher
+TreeWatcher::TreeWatcher(const char *root_path, const ScanOptions &options,
+                         bool fanotify)
+    : root_(root_path), options_(options), buffer_(kEventBuffer) {
+  if (root_.empty() || root_.back() != '/') {
+    root_ += '/';
+  }
+  options_.previous = nullptr;
+
+  if (fanotify) {
+    fd_ = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC,
+                        O_RDONLY | O_LARGEFILE);
+  }
+  fanotify_ = fd_ >= 0;
+  if (!fanotify_) {
+    fd_ = inotify_init1(IN_CLOEXEC);
+    if (fd_ < 0) {
+      throw std::runtime_error(std::string("Cannot create inotify instance: ") +
+                               strerror(errno));
+    }
+  }
+  try {
+    struct stat root_stat;
+    if (access(root_path, R_OK) < 0 || stat(root_path, &root_stat) != 0) {
+      throw std::runtime_error("Cannot access " + std::string(root_path) + ": " +
+                               strerror(errno));
+    }
+    root_dev_ = root_stat.st_dev;
+    if (!Scan(tree_, "")) {
+      throw std::runtime_error("Cannot open " + std::string(root_path) + ": " +
+                               strerror(ENOENT));
+    }
+  } catch (...) {
+    close(fd_);
+    throw;
+  }
+}
+
+// Implementation of TreeWatcher::~TreeWatcher
+TreeWatcher::~TreeWatcher() { close(fd_); }
+
+// Implementation of TreeWatcher::Poll
+bool TreeWatcher::Poll(SnapshotWriter &changes, int timeout_ms) {
+  struct pollfd pfd = {fd_, POLLIN, 0};
+  int ready = poll(&pfd, 1, timeout_ms);
+  if (ready < 0 && errno != EINTR) {
+    throw std::runtime_error(std::string("Error waiting for events: ") + strerror(errno));
+  }
+  if (ready <= 0) {
+    return false;
+  }
+  ssize_t len = read(fd_, buffer_.data(), buffer_.size());
+  if (len < 0) {
+    if (errno == EINTR || errno == EAGAIN) {
+      return false;
+    }
+    throw std::runtime_error(std::string("Error reading events: ") + strerror(errno));
+  }
+
+  // A burst of events for the same entry (a file being written, say) is handled once.
+  // The set is sorted, so a directory's own entry is looked at before its contents.
+  Pending pending;
+  bool complete = fanotify_ ? ParseFanotify(size_t(len), pending)
+                            : ParseInotify(size_t(len), pending);
+  if (!complete) {
+    Resync(changes);
+  } else {
+    // A change to a directory's entries changes its own mtime, which no event reports
+    std::vector<std::string> dirs;
+    for (const auto &[dir, name] : pending) {
+      if (dirs.empty() || dirs.back() != dir) {
+        dirs.push_back(dir);
+      }
+    }
+    for (const std::string &dir : dirs) {
+      AddSelf(dir, pending);
+    }
+    for (const auto &[dir, name] : pending) {
+      Recheck(dir, name, changes);
+    }
+  }
+  Compact();
+  changes.Flush();
+  return true;
+}
+
+// Implementation of TreeWatcher::Report
+void TreeWatcher::Report(SnapshotWriter &changes, char op) {
+  for (size_t i = 0; i < tree_.count_; ++i) {
+    EmitTree(op, "", tree_.entries_[i], changes);
+  }
+}
+
+// Implementation of TreeWatcher::Scan
+bool TreeWatcher::Scan(DirLevel &level, const std::string &dir) {
+  std::string path = root_ + dir;
+
+  // A directory the filter keeps the scan out of is listed but not read
+  struct stat dir_stat;
+  if (!options_.filter.ReadsBelow(unsigned(std::count(dir.begin(), dir.end(), '/'))) ||
+      (options_.filter.OneFilesystem() && stat(path.c_str(), &dir_stat) == 0 &&
+       dir_stat.st_dev != root_dev_)) {
+    level.pruned_ = true;
+    WatchTree(dir, level);
+    return true;
+  }
+  // The level knows its place in the tree, a tree of its own doesn't
+  ScanOptions below = options_;
+  below.filter = options_.filter.Below(dir);
+
+  for (int attempt = 1;; ++attempt) {
+    try {
+      if (!fanotify_) {
+        WatchTree(dir, DirLevel::CreateFromPath(path.c_str(), below));
+      }
+      int fddir = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+      if (fddir < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+          Unwatch(dir);
+          return false;
+        }
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+      }
+      level.ReadTree(root_.c_str(), fddir, options_, nullptr);
+      WatchTree(dir, level);
+      return true;
+    } catch (const std::runtime_error &) {
+      // Something below went away while it was being read. Start over, unless the
+      // directory itself has gone (its removal has an event of its own).
+      level.entries_ = nullptr;
+      level.count_ = 0;
+      if (stat(path.c_str(), &dir_stat) != 0 && errno == ENOENT) {
+        Unwatch(dir);
+        return false;
+      }
+      if (attempt == kScanAttempts) {
+        throw;
+      }
+    }
+  }
+}
+
+// Implementation of TreeWatcher::WatchTree
+void TreeWatcher::WatchTree(const std::string &dir, const DirLevel &level) {
+  // A directory left unread at the depth limit is watched for its own mtime, one on
+  // another filesystem not at all
+  if (level.pruned_ &&
+      options_.filter.ReadsBelow(unsigned(std::count(dir.begin(), dir.end(), '/')))) {
+    return;
+  }
+  Watch(dir);
+  for (size_t i = 0; i < level.count_; ++i) {
+    const EntryInfo &info = level.entries_[i];
+    if (info.dir) {
+      WatchTree(dir + std::string(info.name) + '/', *info.dir);
+    }
+  }
+}
+
+// Implementation of TreeWatcher::Watch
+void TreeWatcher::Watch(const std::string &dir) {
+  std::string path = root_ + dir;
+  std::string key;
+  if (fanotify_) {
+    alignas(struct file_handle) unsigned char storage[sizeof(struct file_handle) +
+                                                      MAX_HANDLE_SZ];
+    auto *handle = reinterpret_cast<struct file_handle *>(storage);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mount_id;
+    if (name_to_handle_at(AT_FDCWD, path.c_str(), handle, &mount_id, 0) != 0) {
+      if (errno == ENOENT || errno == ENOTDIR) {
+        return;
+      }
+      throw std::runtime_error("Cannot get file handle of " + path + ": " +
+                               strerror(errno));
+    }
+
+    // One mark covers a whole filesystem; events from outside the tree are ignored as
+    // their directories have no keys
+    auto mount = mounts_.find(mount_id);
+    if (mount == mounts_.end()) {
+      struct statfs fs_stat;
+      if (statfs(path.c_str(), &fs_stat) != 0 ||
+          fanotify_mark(fd_, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, kFanotifyMask, AT_FDCWD,
+                        path.c_str()) != 0) {
+        throw std::runtime_error("Cannot watch " + path + ": " + strerror(errno));
+      }
+      mount = mounts_.emplace(mount_id, fs_stat.f_fsid).first;
+    }
+    key = HandleKey(mount->second, handle->handle_type, handle->f_handle,
+                    handle->handle_bytes);
+  } else {
+    int wd = inotify_add_watch(fd_, path.c_str(), kInotifyMask);
+    if (wd < 0) {
+      if (errno == ENOENT || errno == ENOTDIR) {
+        return;
+      }
+      std::string message = "Cannot watch " + path + ": " + strerror(errno);
+      if (errno == ENOSPC) {
+        message += " (see /proc/sys/fs/inotify/max_user_watches)";
+      }
+      throw std::runtime_error(message);
+    }
+    key = WatchKey(wd);
+  }
+  keys_[dir] = key;
+  dirs_[key] = dir;
+}
+
+// Implementation of TreeWatcher::Unwatch
+void TreeWatcher::Unwatch(const std::string &dir) {
+  auto it = keys_.lower_bound(dir);
+  while (it != keys_.end() && it->first.starts_with(dir)) {
+    auto key = dirs_.find(it->second);
+    if (key != dirs_.end() && key->second == it->first) {
+      if (!fanotify_) {
+        int wd;
+        memcpy(&wd, it->second.data(), sizeof(wd));
+        inotify_rm_watch(fd_, wd);  // Fails if the kernel dropped it with the directory
+      }
+      dirs_.erase(key);
+    }
+    it = keys_.erase(it);
+  }
+}
+
+// Implementation of TreeWatcher::ParseFanotify
+bool TreeWatcher::ParseFanotify(size_t len, Pending &pending) {
+  bool complete = true;
+  const char *data = buffer_.data();
+  size_t offset = 0;
+  while (offset + sizeof(fanotify_event_metadata) <= len) {
+    fanotify_event_metadata meta;
+    memcpy(&meta, data + offset, sizeof(meta));
+    if (meta.vers != FANOTIFY_METADATA_VERSION) {
+      throw std::runtime_error("Unsupported fanotify event version");
+    }
+    if (meta.event_len < meta.metadata_len || offset + meta.event_len > len) {
+      break;
+    }
+    if (meta.fd >= 0) {
+      close(meta.fd);
+    }
+    if (meta.mask & FAN_Q_OVERFLOW) {
+      complete = false;
+    }
+
+    // The information records follow the metadata
+    size_t info = offset + meta.metadata_len;
+    size_t end = offset + meta.event_len;
+    while (info + sizeof(fanotify_event_info_fid) + sizeof(struct file_handle) <= end) {
+      fanotify_event_info_header header;
+      memcpy(&header, data + info, sizeof(header));
+      if (header.len == 0 || info + header.len > end) {
+        break;
+      }
+      if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+        fanotify_event_info_fid fid;
+        struct file_handle handle;
+        memcpy(&fid, data + info, sizeof(fid));
+        size_t at = info + sizeof(fid);
+        memcpy(&handle, data + at, sizeof(handle));
+        at += sizeof(handle);
+        if (at + handle.handle_bytes < info + header.len) {
+          fsid_t fsid;
+          memcpy(&fsid, &fid.fsid, sizeof(fsid));
+          const auto *bytes = reinterpret_cast<const unsigned char *>(data + at);
+          auto dir = dirs_.find(HandleKey(fsid, handle.handle_type, bytes,
+                                          handle.handle_bytes));
+          if (dir != dirs_.end()) {
+            // The name is NUL-terminated within the record
+            std::string name(data + at + handle.handle_bytes);
+            if (name.empty() || name == ".") {
+              AddSelf(dir->second, pending);
+            } else {
+              pending.emplace(dir->second, std::move(name));
+            }
+          }
+        }
+      }
+      info += header.len;
+    }
+    offset += meta.event_len;
+  }
+  return complete;
+}
+
+// Implementation of TreeWatcher::ParseInotify
+bool TreeWatcher::ParseInotify(size_t len, Pending &pending) {
+  bool complete = true;
+  const char *data = buffer_.data();
+  size_t offset = 0;
+  while (offset + sizeof(inotify_event) <= len) {
+    inotify_event event;
+    memcpy(&event, data + offset, sizeof(event));
+    const char *name = data + offset + sizeof(event);  // NUL-padded to event.len
+    offset += sizeof(event) + event.len;
+    if (event.mask & IN_Q_OVERFLOW) {
+      complete = false;
+      continue;
+    }
+    auto dir = dirs_.find(WatchKey(event.wd));
+    if (dir == dirs_.end()) {
+      continue;
+    }
+    if (event.mask & IN_IGNORED) {
+      // The directory has gone, and the kernel has dropped its watch
+      keys_.erase(dir->second);
+      dirs_.erase(dir);
+    } else if (event.len == 0) {
+      AddSelf(dir->second, pending);  // The directory itself changed
+    } else {
+      pending.emplace(dir->second, std::string(name));
+    }
+  }
+  return complete;
+}
+
+// Implementation of TreeWatcher::AddSelf
+void TreeWatcher::AddSelf(const std::string &dir, Pending &pending) const {
+  if (dir.empty()) {
+    return;  // The root has no entry of its own
+  }
+  size_t slash = dir.rfind('/', dir.size() - 2);
+  size_t start = slash == std::string::npos ? 0 : slash + 1;
+  pending.emplace(dir.substr(0, start), dir.substr(start, dir.size() - 1 - start));
+}
+
+// Implementation of TreeWatcher::Lookup
+DirLevel *TreeWatcher::Lookup(std::string_view dir, bool modified) {
+  DirLevel *level = &tree_;
+  for (;;) {
+    if (modified) {
+      level->digest_ = 0;
+    }
+    if (dir.empty()) {
+      return level;
+    }
+    size_t slash = dir.find('/');
+    EntryInfo *info = level->Find(dir.substr(0, slash));
+    if (!info || !info->dir) {
+      return nullptr;
+    }
+    level = info->dir;
+    dir.remove_prefix(slash + 1);
+  }
+}
+
+// Implementation of TreeWatcher::Recheck
+void TreeWatcher::Recheck(const std::string &dir, const std::string &name,
+                          SnapshotWriter &changes) {
+  DirLevel *level = Lookup(dir, false);
+  if (!level) {
+    return;  // Gone with a directory removed earlier in the batch
+  }
+  if (level->pruned_ || options_.filter.Excluded(name, dir)) {
+    return;  // Left out of the tree
+  }
+  EntryInfo *existing = level->Find(name);
+
+  std::string path = root_ + dir + name;
+  int flags = AT_SYMLINK_NOFOLLOW | (options_.dont_sync ? AT_STATX_DONT_SYNC : 0);
+  struct statx stx;
+  unsigned mask = STATX_TYPE | ((options_.fields & kFieldSize) ? STATX_SIZE : 0) |
+                  ((options_.fields & kFieldMtime) ? STATX_MTIME : 0) |
+                  ((options_.fields & kFieldInode) ? STATX_INO : 0);
+  if (statx(AT_FDCWD, path.c_str(), flags, mask, &stx) != 0) {
+    if (errno != ENOENT && errno != ENOTDIR) {
+      throw std::runtime_error("Cannot get info about " + path + ": " + strerror(errno));
+    }
+    if (existing) {
+      RemoveEntry(Lookup(dir, true), dir, existing, changes);
+    }
+    return;
+  }
+  EntryInfo current = {DT_UNKNOWN, 0, {}, name, nullptr, 0, 0};
+  DirLevel::SetMetadata(&current, stx, options_.fields);
+  // The event may have come from a write that left the size and mtime as they were
+  if (options_.hash_contents && current.type == DT_REG &&
+      !ContentHasher::HashFile(path, nullptr, &current.hash)) {
+    if (existing) {
+      RemoveEntry(Lookup(dir, true), dir, existing, changes);
+    }
+    return;
+  }
+
+  if (existing && existing->type == current.type) {
+    // A directory's contents come with events of their own
+    if (!SameFile(*existing, current, options_.fields) || existing->ino != current.ino) {
+      Lookup(dir, true);
+      existing->size = current.size;
+      existing->mtime = current.mtime;
+      existing->hash = current.hash;
+      existing->ino = current.ino;
+      Emit('~', dir, *existing, changes);
+    }
+    return;
+  }
+  level = Lookup(dir, true);
+  if (existing) {
+    RemoveEntry(level, dir, existing, changes);
+  }
+  AddEntry(level, dir, current, changes);
+}
+
+// Implementation of TreeWatcher::AddEntry
+void TreeWatcher::AddEntry(DirLevel *level, const std::string &dir, EntryInfo info,
+                           SnapshotWriter &changes) {
+  Arena &arena = tree_.MainArena();
+  info.name = arena.Intern(info.name);
+
+  // Make room, growing the array geometrically so a directory filling up one entry at
+  // a time costs amortized constant copying
+  size_t &capacity = capacity_[level];
+  capacity = std::max(capacity, level->count_);
+  if (level->count_ == capacity) {
+    capacity = std::max<size_t>(2 * capacity, 4);
+    EntryInfo *entries = arena.AllocateArray<EntryInfo>(capacity);
+    std::copy(level->entries_, level->entries_ + level->count_, entries);
+    garbage_ += level->count_ * sizeof(EntryInfo);
+    level->entries_ = entries;
+  }
+  EntryInfo *end = level->entries_ + level->count_;
+  EntryInfo *slot = std::lower_bound(
+      level->entries_, end, info.name,
+      [](const EntryInfo &entry, std::string_view key) { return entry.name < key; });
+  std::copy_backward(slot, end, end + 1);
+  ++level->count_;
+  *slot = info;
+
+  if (info.type == DT_DIR) {
+    slot->dir = arena.New<DirLevel>(level, slot->name);
+    // If it has gone again already, its removal has an event of its own
+    Scan(*slot->dir, dir + std::string(info.name) + '/');
+  }
+  EmitTree('+', dir, *slot, changes);
+}
+
+// Implementation of TreeWatcher::RemoveEntry
+void TreeWatcher::RemoveEntry(DirLevel *level, const std::string &dir, EntryInfo *info,
+                              SnapshotWriter &changes) {
+  EmitTree('-', dir, *info, changes);
+  if (info->dir) {
+    Unwatch(dir + std::string(info->name) + '/');
+  }
+  garbage_ += TreeBytes(*info);
+  std::copy(info + 1, level->entries_ + level->count_, info);
+  --level->count_;
+}
+
+// Implementation of TreeWatcher::Resync
+void TreeWatcher::Resync(SnapshotWriter &changes) {
+  DirLevel fresh;
+  if (!Scan(fresh, "")) {
+    throw std::runtime_error("Cannot open " + root_ + ": " + strerror(ENOENT));
+  }
+  Diff(tree_, fresh, "", changes);
+  tree_ = std::move(fresh);
+  capacity_.clear();
+  garbage_ = 0;
+
+  // Drop the watches of directories that are gone
+  for (auto it = keys_.begin(); it != keys_.end();) {
+    if (Lookup(it->first, false)) {
+      ++it;
+    } else {
+      std::string dir = it->first;
+      Unwatch(dir);
+      it = keys_.lower_bound(dir);
+    }
+  }
+}
+
+// Implementation of TreeWatcher::Diff
+void TreeWatcher::Diff(const DirLevel &before, const DirLevel &after,
+                       const std::string &dir, SnapshotWriter &changes) {
+  size_t i = 0, j = 0;
+  while (i < before.count_ || j < after.count_) {
+    const EntryInfo *old_info = i < before.count_ ? &before.entries_[i] : nullptr;
+    const EntryInfo *new_info = j < after.count_ ? &after.entries_[j] : nullptr;
+    int order = !old_info ? 1 : !new_info ? -1 : old_info->name.compare(new_info->name);
+    if (order < 0) {
+      EmitTree('-', dir, *old_info, changes);
+      ++i;
+    } else if (order > 0) {
+      EmitTree('+', dir, *new_info, changes);
+      ++j;
+    } else if (old_info->type != new_info->type) {
+      EmitTree('-', dir, *old_info, changes);
+      EmitTree('+', dir, *new_info, changes);
+      ++i, ++j;
+    } else {
+      if (!SameFile(*old_info, *new_info, options_.fields)) {
+        Emit('~', dir, *new_info, changes);
+      }
+      if (old_info->dir && new_info->dir) {
+        Diff(*old_info->dir, *new_info->dir, dir + std::string(new_info->name) + '/',
+             changes);
+      }
+      ++i, ++j;
+    }
+  }
+}
+
+// Implementation of TreeWatcher::EmitTree
+void TreeWatcher::EmitTree(char op, const std::string &dir, const EntryInfo &info,
+                           SnapshotWriter &changes) {
+  Emit(op, dir, info, changes);
+  if (info.dir) {
+    std::string sub = dir + std::string(info.name) + '/';
+    for (size_t i = 0; i < info.dir->count_; ++i) {
+      EmitTree(op, sub, info.dir->entries_[i], changes);
+    }
+  }
+}
+
+// Implementation of TreeWatcher::Emit
+void TreeWatcher::Emit(char op, std::string_view dir, const EntryInfo &info,
+                       SnapshotWriter &changes) {
+  record_ = op;
+  record_ += ' ';
+  record_ += dir;
+  changes.Add(record_, info);
+}
+
+// Implementation of TreeWatcher::Compact
+void TreeWatcher::Compact() {
+  if (garbage_ < kMinCompact || garbage_ < tree_.Footprint() / kCompactFraction) {
+    return;
+  }
+  DirLevel copy;
+  CopyTree(tree_, &copy, copy.MainArena());
+  tree_ = std::move(copy);
+  capacity_.clear();
+  garbage_ = 0;
+}
+
+// Implementation of TreeWatcher::TreeBytes
+size_t TreeWatcher::TreeBytes(const EntryInfo &info) {
+  size_t bytes = sizeof(EntryInfo) + info.name.size() + 1;
+  if (info.dir) {
+    bytes += sizeof(DirLevel);
+    for (const EntryInfo &entry : info.dir->Entries()) {
+      bytes += TreeBytes(entry);
+    }
+  }
+  return bytes;
+}
+
+// Implementation of TreeWatcher::CopyTree
+void TreeWatcher::CopyTree(const DirLevel &from, DirLevel *to, Arena &arena) {
+  EntryInfo *entries = arena.AllocateArray<EntryInfo>(from.count_);
+  for (size_t i = 0; i < from.count_; ++i) {
+    EntryInfo &info = entries[i];
+    info = from.entries_[i];
+    info.name = arena.Intern(info.name);
+    if (info.dir) {
+      info.dir = arena.New<DirLevel>(to, info.name);
+      CopyTree(*from.entries_[i].dir, info.dir, arena);
+    }
+  }
+  to->entries_ = entries;
+  to->count_ = from.count_;
+  to->digest_ = from.digest_;
+  to->pruned_ = from.pruned_;
+}
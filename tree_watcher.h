@@ -0,0 +1,192 @@
+/*
+ * tree_watcher.h
+ *
+ * Header file for keeping a DirLevel tree current from filesystem change events.
+ */
+
+#ifndef TREE_WATCHER_H
+#define TREE_WATCHER_H
+
+#include <sys/statfs.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dir_level.h"
+
+class Arena;
+class SnapshotWriter;
+
+/**
+ * TreeWatcher - A scanned tree kept up to date by fanotify or inotify events
+ *
+ * Scans the tree once, then subscribes to its change events: with one fanotify mark per
+ * filesystem where fanotify can report directory handles and names
+ * (FAN_REPORT_DFID_NAME, Linux 5.9 with CAP_SYS_ADMIN), otherwise with one inotify watch
+ * per directory. Every event names an entry of a directory in the tree; that entry is
+ * stat'ed again and patched into the tree in place, and each difference is written as a
+ * change record. A directory that appears is scanned whole, and one that goes away is
+ * dropped with everything below it (so a renamed directory is dropped and scanned again
+ * under its new name). If the kernel's event queue overflows, the whole tree is scanned
+ * again and compared with the one held.
+ *
+ * Change records are text snapshot lines (see snapshot_writer.h) with the kind of change
+ * and a space in front of the path:
+ *   '+' the entry was added
+ *   '-' the entry was removed (with its last known metadata)
+ *   '~' the entry's size, mtime or content hash changed (with its new metadata)
+ * An entry whose type changed is removed and added again. Records for a directory
+ * added or removed are followed by records for everything below it.
+ */
+class TreeWatcher {
+ public:
+  /**
+   * Constructor - Scan a tree and start watching it
+   *
+   * @param root_path: Path to the directory to watch
+   * @param options: Scan tunables for this and every later scan (options.previous is
+   *                 ignored)
+   * @param fanotify: Use fanotify if the kernel and our privileges allow (otherwise
+   *                  inotify is used, as when they don't)
+   *
+   * Throws std::runtime_error if the tree can't be read or watched.
+   */
+  TreeWatcher(const char *root_path, const ScanOptions &options, bool fanotify = true);
+
+  ~TreeWatcher();
+
+  TreeWatcher(const TreeWatcher &) = delete;
+  TreeWatcher &operator=(const TreeWatcher &) = delete;
+
+  /**
+   * Poll - Wait for events and apply them to the tree
+   *
+   * @param changes: Text snapshot to write the change records to (flushed afterwards)
+   * @param timeout_ms: Longest time to wait for an event, in milliseconds (-1 = no limit)
+   * @return: true if any events were read
+   *
+   * Reads whatever events are queued, looks at each entry they name once, and writes a
+   * record for each difference found. Throws std::runtime_error if the events can't be
+   * read or a changed entry can't be read or watched.
+   */
+  bool Poll(SnapshotWriter &changes, int timeout_ms);
+
+  /**
+   * Report - Write a record for every entry of the tree
+   *
+   * @param changes: Text snapshot to write the records to
+   * @param op: Kind of change to give each record
+   */
+  void Report(SnapshotWriter &changes, char op);
+
+  // The tree as of the last Poll()
+  const DirLevel &Tree() const { return tree_; }
+
+  // Whether events come from fanotify (rather than inotify)
+  bool UsesFanotify() const { return fanotify_; }
+
+ private:
+  using Pending = std::set<std::pair<std::string, std::string>>;  // (directory, name)
+
+  /**
+   * Scan - Read the tree below a directory and watch every directory in it
+   *
+   * @param level: The (empty) directory to fill in
+   * @param dir: Its path below the root, with trailing '/' (empty for the root)
+   * @return: false if the directory has gone away (level is left empty)
+   *
+   * With inotify the directories are watched from a first scan before the scan that is
+   * kept, as a watch only sees changes made after it was added. Throws
+   * std::runtime_error if the tree can't be read or watched.
+   */
+  bool Scan(DirLevel &level, const std::string &dir);
+
+  // Watch every directory of a tree, dir being the path of level
+  void WatchTree(const std::string &dir, const DirLevel &level);
+
+  // Watch one directory (nothing happens if it has gone away)
+  void Watch(const std::string &dir);
+
+  // Stop watching a directory and every directory below it
+  void Unwatch(const std::string &dir);
+
+  // Turn the events in buffer_[0, len) into entries to look at. Returns false if the
+  // queue overflowed.
+  bool ParseFanotify(size_t len, Pending &pending);
+  bool ParseInotify(size_t len, Pending &pending);
+
+  // Queue the entry of directory dir (in its parent) to be looked at
+  void AddSelf(const std::string &dir, Pending &pending) const;
+
+  /**
+   * Lookup - Find a directory of the tree by path
+   *
+   * @param dir: Path below the root, with trailing '/' (empty for the root)
+   * @param modified: Forget the digests of the directory and those above it
+   * @return: The directory, or nullptr if it isn't in the tree
+   */
+  DirLevel *Lookup(std::string_view dir, bool modified);
+
+  // Stat an entry of directory dir again and patch the difference into the tree
+  void Recheck(const std::string &dir, const std::string &name, SnapshotWriter &changes);
+
+  // Add an entry (whose metadata is set) to level, at path dir, scanning a directory
+  void AddEntry(DirLevel *level, const std::string &dir, EntryInfo info,
+                SnapshotWriter &changes);
+
+  // Remove an entry from level, at path dir
+  void RemoveEntry(DirLevel *level, const std::string &dir, EntryInfo *info,
+                   SnapshotWriter &changes);
+
+  // Scan the whole tree again and report how it differs from the one held
+  void Resync(SnapshotWriter &changes);
+
+  // Report the differences between two versions of the directory at path dir
+  void Diff(const DirLevel &before, const DirLevel &after, const std::string &dir,
+            SnapshotWriter &changes);
+
+  // Write a record for an entry, and for everything below it if it is a directory
+  void EmitTree(char op, const std::string &dir, const EntryInfo &info,
+                SnapshotWriter &changes);
+
+  // Write a record for one entry
+  void Emit(char op, std::string_view dir, const EntryInfo &info,
+            SnapshotWriter &changes);
+
+  // Copy the tree into fresh storage once replaced entry arrays make up much of it
+  void Compact();
+
+  // Bytes of storage held by an entry and everything below it
+  static size_t TreeBytes(const EntryInfo &info);
+
+  // Copy a directory's entries and everything below them into an arena
+  static void CopyTree(const DirLevel &from, DirLevel *to, Arena &arena);
+
+  std::string root_;     // Path of the root, with trailing '/'
+  ScanOptions options_;  // Tunables for every scan
+  dev_t root_dev_ = 0;   // Device of the root, for ScanFilter::OneFilesystem()
+  DirLevel tree_;
+  int fd_ = -1;          // fanotify or inotify descriptor
+  bool fanotify_ = false;
+
+  // Watched directories by path (with trailing '/'), and the other way round by the
+  // key events identify them with: the fsid and file handle for fanotify, the watch
+  // descriptor for inotify
+  std::map<std::string, std::string> keys_;
+  std::unordered_map<std::string, std::string> dirs_;
+  std::map<int, fsid_t> mounts_;  // fanotify: fsid of each mount seen (marked already)
+
+  // Entry arrays that have room to grow by insertion, by directory
+  std::unordered_map<const DirLevel *, size_t> capacity_;
+  size_t garbage_ = 0;  // Bytes of the tree's storage no longer in use
+
+  std::vector<char> buffer_;  // Events read
+  std::string record_;        // Path of the record being written
+};
+
+#endif  // TREE_WATCHER_H
@@ -0,0 +1,174 @@
+/*
+ * work_pool.cpp
+ *
+ * Work-stealing thread pool. Workers keep their own deque of tasks and only touch other
+ * workers' deques to steal when idle, so the common submit/pop path contends on nothing
+ * but an uncontended per-worker mutex.
+ */
+
+#include "work_pool.h"
+
+namespace {
+// Pool and worker index of the calling thread (nullptr when not inside a pool)
+thread_local const WorkPool *tls_pool = nullptr;
+thread_local unsigned tls_index = 0;
+}  // namespace
+
+// Implementation of WorkPool::WorkPool
+WorkPool::WorkPool(unsigned threads) {
+  if (threads < 1) {
+    threads = 1;
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    queues_.emplace_back(new Queue);
+  }
+  // Worker 0 is whichever thread calls Run(), so only spawn the others
+  for (unsigned i = 1; i < threads; ++i) {
+    threads_.emplace_back(&WorkPool::WorkerLoop, this, i);
+  }
+}
+
+// Implementation of WorkPool::~WorkPool
+WorkPool::~WorkPool() {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    stop_ = true;
+  }
+  // Anything still queued (e.g. after the submitter threw) is dropped rather than run
+  cancelled_.store(true);
+  idle_cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+// Implementation of WorkPool::CurrentWorker
+unsigned WorkPool::CurrentWorker() { return tls_pool ? tls_index : 0; }
+
+// Implementation of WorkPool::Submit
+void WorkPool::Submit(Task task) {
+  unsigned index = (tls_pool == this) ? tls_index : 0;
+
+  // Count the task as pending before it becomes visible so Run() can't finish early
+  pending_.fetch_add(1);
+  {
+    Queue &queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+  }
+  queued_.fetch_add(1);
+
+  // Taking the idle mutex orders this wakeup after any waiter's predicate check
+  { std::lock_guard<std::mutex> lock(idle_mutex_); }
+  idle_cv_.notify_one();
+}
+
+// Implementation of WorkPool::TryGetTask
+bool WorkPool::TryGetTask(unsigned index, Task &task) {
+  if (queued_.load() == 0) {
+    return false;
+  }
+
+  // Newest task from our own deque first (depth-first)
+  {
+    Queue &queue = *queues_[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+
+  // Then the oldest task from somebody else's deque (breadth-first)
+  size_t count = queues_.size();
+  for (size_t i = 1; i < count; ++i) {
+    Queue &victim = *queues_[(index + i) % count];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Implementation of WorkPool::Execute
+void WorkPool::Execute(Task &task) {
+  // Once something has failed, drain the remaining tasks without running them
+  if (!cancelled_.load()) {
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+      if (!first_error_) {
+        first_error_ = std::current_exception();
+      }
+      cancelled_.store(true);
+    }
+  }
+  // Release whatever the task captured before announcing that it has finished
+  task = nullptr;
+
+  if (pending_.fetch_sub(1) == 1) {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    idle_cv_.notify_all();
+  }
+}
+
+// Implementation of WorkPool::WorkerLoop
+void WorkPool::WorkerLoop(unsigned index) {
+  tls_pool = this;
+  tls_index = index;
+
+  for (;;) {
+    Task task;
+    if (TryGetTask(index, task)) {
+      Execute(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    idle_cv_.wait(lock, [this] { return stop_ || queued_.load() > 0; });
+    if (stop_) {
+      return;
+    }
+  }
+}
+
+// Implementation of WorkPool::Run
+void WorkPool::Run() {
+  const WorkPool *saved_pool = tls_pool;
+  unsigned saved_index = tls_index;
+  tls_pool = this;
+  tls_index = 0;
+
+  for (;;) {
+    Task task;
+    if (TryGetTask(0, task)) {
+      Execute(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    idle_cv_.wait(lock, [this] { return pending_.load() == 0 || queued_.load() > 0; });
+    if (pending_.load() == 0) {
+      break;
+    }
+  }
+
+  tls_pool = saved_pool;
+  tls_index = saved_index;
+
+  // Hand the first failure (if any) to the caller and make the pool reusable
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    std::swap(error, first_error_);
+    cancelled_.store(false);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
@@ -0,0 +1,104 @@
+/*
+ * work_pool.h
+ *
+ * Header file for a small work-stealing thread pool used to run independent
+ * per-directory tasks in parallel.
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * WorkPool - Fixed-size pool of threads with one task deque per worker
+ *
+ * Each worker pushes and pops tasks at the back of its own deque (depth-first, which
+ * keeps the working set small) and steals from the front of other workers' deques when
+ * its own runs dry (breadth-first, which hands out large pieces of work). The thread
+ * that calls Run() acts as worker 0, so a pool of size 1 runs everything on the caller's
+ * thread without spawning any threads.
+ */
+class WorkPool {
+ public:
+  using Task = std::function<void()>;
+
+  /**
+   * Constructor - Start the pool
+   *
+   * @param threads: Total number of workers including the caller of Run(). Values less
+   *                 than 1 are treated as 1.
+   */
+  explicit WorkPool(unsigned threads);
+
+  // Stops and joins all worker threads
+  ~WorkPool();
+
+  WorkPool(const WorkPool &) = delete;
+  WorkPool &operator=(const WorkPool &) = delete;
+
+  /**
+   * Submit - Queue a task for execution
+   *
+   * @param task: Callable to run on some worker
+   *
+   * May be called from any thread, including from inside a running task. Tasks submitted
+   * from a worker go to that worker's own deque; others go to worker 0's deque.
+   */
+  void Submit(Task task);
+
+  /**
+   * Run - Execute tasks on the calling thread until every submitted task has finished
+   *
+   * If any task throws, the remaining queued tasks are discarded and the first exception
+   * is rethrown here once all running tasks have returned.
+   */
+  void Run();
+
+  // Number of workers in the pool (including the caller of Run())
+  unsigned Size() const { return unsigned(queues_.size()); }
+
+  /**
+   * CurrentWorker - Index of the calling worker within its pool
+   *
+   * @return: Worker index in [0, Size()) when called from a task, 0 otherwise
+   */
+  static unsigned CurrentWorker();
+
+ private:
+  // One deque per worker, each guarded by its own mutex
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Main loop of the spawned worker threads
+  void WorkerLoop(unsigned index);
+
+  // Pop from our own deque, or steal from another. Returns false if nothing was found.
+  bool TryGetTask(unsigned index, Task &task);
+
+  // Run one task, recording the first exception and maintaining the pending count
+  void Execute(Task &task);
+
+  std::vector<std::unique_ptr<Queue>> queues_;  // Per-worker task deques
+  std::vector<std::thread> threads_;            // Spawned workers 1..N-1
+
+  std::mutex idle_mutex_;              // Guards sleeping/waking and first_error_
+  std::condition_variable idle_cv_;    // Signalled when work arrives or pending_ hits 0
+  std::atomic<size_t> queued_{0};      // Tasks sitting in some deque
+  std::atomic<size_t> pending_{0};     // Tasks submitted but not yet finished
+  std::atomic<bool> cancelled_{false};  // Set once a task has thrown
+  bool stop_ = false;                  // Set by the destructor
+  std::exception_ptr first_error_;     // First exception thrown by a task
+};
+
+#endif  // WORK_POOL_H